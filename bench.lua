@@ -0,0 +1,170 @@
+-- cipher throughput benchmark
+--
+--   lua bench.lua [--quick] [--cipher name] [--mode name] [--time seconds]
+--                 [--baseline file.json] [--threshold percent]
+--
+-- Every cipher in lcrypt.ciphers is run in every mode of lcrypt.cipher_modes it
+-- accepts, over messages from 16 bytes to 64 MB, and key setup is timed on its
+-- own. Results go to stdout as JSON, one result per line. With --baseline the
+-- run is compared against an earlier output, every result that got slower than
+-- the threshold (default 10%) is reported on stderr and the exit code is 1.
+
+local lcrypt = require('lcrypt')
+local unpack = unpack or table.unpack
+
+local options = { time = 0.2, threshold = 10 }
+local i = 1
+while i <= #arg do
+  local a = arg[i]
+  if a == '--quick' then options.quick = true
+  elseif a == '--cipher' then i = i + 1; options.cipher = arg[i]
+  elseif a == '--mode' then i = i + 1; options.mode = arg[i]
+  elseif a == '--time' then i = i + 1; options.time = tonumber(arg[i])
+  elseif a == '--baseline' then i = i + 1; options.baseline = arg[i]
+  elseif a == '--threshold' then i = i + 1; options.threshold = tonumber(arg[i])
+  else
+    io.stderr:write('unknown argument ', a, '\n')
+    os.exit(2)
+  end
+  i = i + 1
+end
+
+local sizes = { 16, 256, 4096, 65536, 1048576, 67108864 }
+if options.quick then sizes = { 16, 256, 4096, 65536 } end
+
+local aead = { gcm = true, ccm = true, eax = true, ocb = true, poly1305 = true }
+
+local function sorted_keys(t)
+  local keys = {}
+  for k in pairs(t) do keys[#keys + 1] = k end
+  table.sort(keys)
+  return keys
+end
+
+-- runs fn until options.time has passed, returns the iterations and the seconds they took
+local function measure(fn)
+  local iterations, start, elapsed = 0, lcrypt.time(), 0
+  repeat
+    fn()
+    iterations = iterations + 1
+    elapsed = lcrypt.time() - start
+  until elapsed >= options.time
+  return iterations, elapsed
+end
+
+-- the arguments lcrypt.key takes for cipher and mode, key lengths are cut down to what the cipher supports
+local function key_args(cipher, mode, block_size)
+  if cipher == 'chacha20' then return { cipher, mode, string.rep('k', 32), string.rep('n', 12) } end
+  local key = string.rep('k', mode == 'xts' and 64 or 32)
+  local iv = string.rep('i', block_size)
+  if mode == 'ecb' then return { cipher, mode, key } end
+  if mode == 'ctr' then return { cipher, mode, key, iv, 'be' } end
+  if mode == 'lrw' then return { cipher, mode, key, iv, string.rep('t', 16) } end
+  if mode == 'ccm' then return { cipher, mode, key, string.rep('n', 12) } end
+  if mode == 'xts' then return { cipher, mode, key } end
+  return { cipher, mode, key, iv }
+end
+
+local results = {}
+
+local function result(cipher, mode, op, size, iterations, elapsed)
+  local ns = elapsed * 1e9 / iterations
+  local r = { cipher = cipher, mode = mode, op = op, size = size, iterations = iterations, ns_per_op = ns }
+  if size > 0 then r.mb_per_s = size * iterations / elapsed / 1048576 end
+  results[#results + 1] = r
+end
+
+local function bench(cipher, mode)
+  local block_size = 16
+  if cipher ~= 'chacha20' then
+    local ok, k = pcall(lcrypt.key, cipher, 'ecb', string.rep('k', 32))
+    if not ok then return end
+    block_size = k.block_size
+  end
+  local args = key_args(cipher, mode, block_size)
+  local ok, key = pcall(lcrypt.key, unpack(args))
+  if not ok then return end
+
+  local iterations, elapsed = measure(function() lcrypt.key(unpack(args)) end)
+  result(cipher, mode, 'setup', 0, iterations, elapsed)
+
+  local iv = args[4]
+  for _, size in ipairs(sizes) do
+    local data = string.rep('x', size)
+    for _, op in ipairs({ 'encrypt', 'decrypt' }) do
+      local fn = key[op]
+      if aead[mode] then
+        iterations, elapsed = measure(function()
+          key.iv = iv
+          fn(key, data)
+          key:done()
+        end)
+      else
+        iterations, elapsed = measure(function() fn(key, data) end)
+      end
+      result(cipher, mode, op, size, iterations, elapsed)
+    end
+  end
+end
+
+local function encode(r)
+  local fields = {}
+  for _, name in ipairs({ 'cipher', 'mode', 'op', 'size', 'iterations', 'ns_per_op', 'mb_per_s' }) do
+    local v = r[name]
+    if type(v) == 'string' then
+      fields[#fields + 1] = string.format('"%s": "%s"', name, v)
+    elseif v ~= nil and math.floor(v) == v then
+      fields[#fields + 1] = string.format('"%s": %d', name, v)
+    elseif v ~= nil then
+      fields[#fields + 1] = string.format('"%s": %.3f', name, v)
+    end
+  end
+  return '{' .. table.concat(fields, ', ') .. '}'
+end
+
+-- reads the results of an earlier run, only this script's own output format is understood
+local function load_baseline(name)
+  local f = assert(io.open(name, 'r'))
+  local baseline = {}
+  for line in f:lines() do
+    local cipher, mode, op, size = line:match('"cipher": "([^"]*)", "mode": "([^"]*)", "op": "([^"]*)", "size": (%d+)')
+    local ns = line:match('"ns_per_op": ([%d%.]+)')
+    if cipher and ns then baseline[cipher .. '/' .. mode .. '/' .. op .. '/' .. size] = tonumber(ns) end
+  end
+  f:close()
+  return baseline
+end
+
+local cache = lcrypt.key_cache()
+lcrypt.key_cache(0)
+for _, cipher in ipairs(sorted_keys(lcrypt.ciphers)) do
+  if options.cipher == nil or options.cipher == cipher then
+    for _, mode in ipairs(sorted_keys(lcrypt.cipher_modes)) do
+      if options.mode == nil or options.mode == mode then bench(cipher, mode) end
+    end
+  end
+end
+lcrypt.key_cache(cache)
+
+local lines = {}
+for n, r in ipairs(results) do lines[n] = '    ' .. encode(r) end
+local implementations = {}
+for _, name in ipairs(sorted_keys(lcrypt.implementations)) do
+  implementations[#implementations + 1] = string.format('"%s": "%s"', name, lcrypt.implementations[name])
+end
+io.write('{\n  "implementations": {', table.concat(implementations, ', '), '},\n')
+io.write('  "results": [\n', table.concat(lines, ',\n'), '\n  ]\n}\n')
+
+if options.baseline then
+  local baseline, regressions = load_baseline(options.baseline), 0
+  for _, r in ipairs(results) do
+    local name = r.cipher .. '/' .. r.mode .. '/' .. r.op .. '/' .. r.size
+    local before = baseline[name]
+    if before and r.ns_per_op > before * (1 + options.threshold / 100) then
+      io.stderr:write(string.format('regression %s: %.1f ns -> %.1f ns (+%.1f%%)\n',
+        name, before, r.ns_per_op, (r.ns_per_op / before - 1) * 100))
+      regressions = regressions + 1
+    end
+  end
+  if regressions > 0 then os.exit(1) end
+end
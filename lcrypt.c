@@ -15,10 +15,14 @@
 #include <string.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <termios.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <zlib.h>
 #include "lua.h"
 #include "lauxlib.h"
@@ -75,10 +79,66 @@ static void* lcrypt_malloc (lua_State *L, size_t size) {
   return ret;
 }
 
+static FILE *lgetfile (lua_State *L, int index) {
+  FILE **fp = lua_touserdata(L, index);
+  if (fp == NULL) return NULL;
+  if (lua_getmetatable(L, index) != 0) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_FILEHANDLE);
+    if (lua_rawequal(L, -1, -2) != 0) {
+      lua_pop(L, 2);
+      return *fp;
+    }
+    lua_pop(L, 2);
+  }
+  return NULL;
+}
+
+/* adds methods to the table on top */
+static void lcrypt_add_methods (lua_State *L, const luaL_Reg *methods) {
+  for (; methods->name != NULL; ++methods) {
+    lua_pushcfunction(L, methods->func);
+    lua_setfield(L, -2, methods->name);
+  }
+}
+
+/* __index over a methods table (upvalue 1), anything not in it goes to the properties function (upvalue 2) */
+static int lcrypt_index (lua_State *L) {
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1));
+  if (!lua_isnil(L, -1)) return 1;
+  lua_pop(L, 1);
+  return lua_tocfunction(L, lua_upvalueindex(2))(L);
+}
+
+/**
+ * Sets __index of the metatable on top. Without properties it is the methods table itself, so a method call
+ * is a plain table lookup, otherwise lcrypt_index tries the table before the properties function.
+ */
+static void lcrypt_set_index (lua_State *L, const luaL_Reg *methods, lua_CFunction properties) {
+  lua_pushliteral(L, "__index");
+  lua_newtable(L);
+  lcrypt_add_methods(L, methods);
+  if (properties != NULL) {
+    lua_pushcfunction(L, properties);
+    lua_pushcclosure(L, lcrypt_index, 2);
+  }
+  lua_rawset(L, -3);
+}
+
+#include "lcrypt_cpu.c"
+#include "lcrypt_threads.c"
+#include "lcrypt_buffer.c"
+#include "lcrypt_aesni.c"
+#include "lcrypt_chacha20.c"
 #include "lcrypt_ciphers.c"
+#include "lcrypt_sha.c"
+#include "lcrypt_multihash.c"
+#include "lcrypt_blake.c"
 #include "lcrypt_hashes.c"
+#include "lcrypt_kdf.c"
 #include "lcrypt_math.c"
 #include "lcrypt_bits.c"
+#include "lcrypt_crc.c"
 
 static int lcrypt_tohex (lua_State *L) {
   const char digits[] = "0123456789ABCDEF";
@@ -227,7 +287,20 @@ static int lcrypt_base64_decode (lua_State *L) {
 static int lcrypt_crc32 (lua_State *L) {
   size_t inlen = 0;
   const unsigned char *in  = (const unsigned char*)luaL_checklstring(L, 1, &inlen);
-  lua_pushnumber(L, crc32(0L, in, inlen) & 0xffffffff);
+  uLong crc = (uLong)_lcrypt_crc_arg(L, 2);
+  while (inlen > 0) {           /* zlib takes an unsigned int length */
+    uInt n = (inlen > 0x40000000) ? 0x40000000 : (uInt)inlen;
+    crc = crc32(crc, in, n);
+    in += n;
+    inlen -= n;
+  }
+  lua_pushnumber(L, crc & 0xffffffff);
+  return 1;
+}
+
+static int lcrypt_crc32_combine (lua_State *L) {
+  uLong a = (uLong)_lcrypt_crc_arg(L, 1), b = (uLong)_lcrypt_crc_arg(L, 2);
+  lua_pushnumber(L, crc32_combine(a, b, (z_off_t)_lcrypt_crc_length(L, 3)) & 0xffffffff);
   return 1;
 }
 
@@ -305,20 +378,6 @@ static int lcrypt_random (lua_State *L) {
   return 1;
 }
 
-static FILE *lgetfile (lua_State *L, int index) {
-  FILE **fp = lua_touserdata(L, index);
-  if (fp == NULL) return NULL;
-  if (lua_getmetatable(L, index) != 0) {
-    lua_getfield(L, LUA_REGISTRYINDEX, LUA_FILEHANDLE);
-    if (lua_rawequal(L, -1, -2) != 0) {
-      lua_pop(L, 2);
-      return *fp;
-    }
-    lua_pop(L, 2);
-  }
-  return NULL;
-}
-
 static int lcrypt_tcsetattr (lua_State* L) {
   struct termios old, new;
   FILE *fp = lgetfile(L, 1);
@@ -459,21 +518,12 @@ static int lcrypt_spawn_write (lua_State *L) {
   return 0;
 }
 
-static int lcrypt_spawn_index (lua_State *L) {
-  (void)luaL_checkudata(L, 1, "LSPAWN");
-  {
-    const char *index = luaL_checkstring(L, 2);
-    if (strcmp(index, "read") == 0)
-      lua_pushcfunction(L, lcrypt_spawn_read);
-    else if (strcmp(index, "write") == 0)
-      lua_pushcfunction(L, lcrypt_spawn_write);
-    else if (strcmp(index, "close") == 0)
-      lua_pushcfunction(L, lcrypt_spawn_close);
-    else
-      return 0;
-  }
-  return 1;
-}
+static const luaL_Reg lcrypt_spawn_methods[] = {
+  {"read",  &lcrypt_spawn_read},
+  {"write", &lcrypt_spawn_write},
+  {"close", &lcrypt_spawn_close},
+  {NULL,    NULL}
+};
 
 static const luaL_Reg lcrypt_spawn_flib[] = {
   {"__gc",  &lcrypt_spawn_close},
@@ -489,7 +539,8 @@ static const luaL_Reg lcryptlib[] = {
   {"uncompress",    &lcrypt_uncompress},    /* data = lcrypt.uncompress(data)                      */
   {"base64_encode", &lcrypt_base64_encode}, /* data = lcrypt.base64_encode(data)                   */
   {"base64_decode", &lcrypt_base64_decode}, /* data = lcrypt.base64_decode(data)                   */
-  {"crc32",         &lcrypt_crc32},         /* data = lcrypt.crc32(data)                           */
+  {"crc32",         &lcrypt_crc32},         /* crc = lcrypt.crc32(data [, crc])                    */
+  {"crc32_combine", &lcrypt_crc32_combine}, /* crc = lcrypt.crc32_combine(crc_a, crc_b, length_b)  */
   {"xor",           &lcrypt_xor},           /* data = lcrypt.xor(data_a, data_b)                   */
   {"sleep",         &lcrypt_sleep},         /* lcrypt.sleep(seconds)                               */
   {"time",          &lcrypt_time},          /* now = lcrypt.time()                                 */
@@ -508,16 +559,19 @@ int luaopen_lcrypt(lua_State *L) {
 
   #ifndef USE_NCIPHER
     (void)luaL_newmetatable(L, "LSPAWN");
-    lua_pushliteral(L, "__index");
-    lua_pushcfunction(L, lcrypt_spawn_index);
-    lua_rawset(L, -3);
+    lcrypt_set_index(L, lcrypt_spawn_methods, NULL);
     luaL_register(L, NULL, lcrypt_spawn_flib);
   #endif
 
+  lcrypt_start_cpu(L);
+  lcrypt_start_threads(L);
+  lcrypt_start_buffer(L);
   lcrypt_start_ciphers(L);
   lcrypt_start_hashes(L);
+  lcrypt_start_kdf(L);
   lcrypt_start_math(L);
   lcrypt_start_bits(L);
+  lcrypt_start_crc(L);
 
   lua_pushstring(L, "iflag");
   lua_newtable(L);
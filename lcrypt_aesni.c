@@ -0,0 +1,296 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+/*
+ * AES with the AES-NI instructions, registered as "aes" in place of the table
+ * based aes_desc when lcrypt_cpu.aesni is set. The round keys are kept as raw
+ * 16 byte blocks in rijndael.eK / rijndael.dK so the symmetric_key layout and
+ * every libtomcrypt mode stay unchanged; the accel_* hooks let ecb, cbc and
+ * the parallel slices hand whole runs of blocks to the interleaved loops below.
+ */
+
+#ifdef LCRYPT_X86
+
+#define LCRYPT_AESNI_LANES 4
+#define LCRYPT_AESNI_STREAMS 8
+
+#define AESNI_ROUND_KEY(k, i) _mm_loadu_si128((const __m128i*)((const unsigned char*)(k) + 16 * (i)))
+
+LCRYPT_TARGET("aes,sse2") static ulong32 _lcrypt_aesni_subword (ulong32 word) {
+  /* dword 0 of aeskeygenassist is SubWord of dword 1 */
+  return (ulong32)_mm_cvtsi128_si32(_mm_aeskeygenassist_si128(_mm_set1_epi32((int)word), 0));
+}
+
+LCRYPT_TARGET("aes,sse2") static int lcrypt_aesni_setup (const unsigned char *key, int keylength, int num_rounds, symmetric_key *skey) {
+  ulong32 w[60];
+  unsigned char *ek, *dk;
+  ulong32 rcon = 1;
+  int nk, nr, i;
+
+  if (key == NULL || skey == NULL) return CRYPT_INVALID_ARG;
+  if (keylength != 16 && keylength != 24 && keylength != 32) return CRYPT_INVALID_KEYSIZE;
+  nk = keylength / 4;
+  nr = nk + 6;
+  if (num_rounds != 0 && num_rounds != nr) return CRYPT_INVALID_ROUNDS;
+
+  /* FIPS-197 key expansion on little endian words, RotWord is then a right rotate by 8 */
+  memcpy(w, key, (size_t)keylength);
+  for (i = nk; i < 4 * (nr + 1); ++i) {
+    ulong32 t = w[i - 1];
+    if (i % nk == 0) {
+      t = _lcrypt_aesni_subword(t);
+      t = ((t >> 8) | (t << 24)) ^ rcon;
+      rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x11b : 0);
+    } else if (nk > 6 && i % nk == 4) {
+      t = _lcrypt_aesni_subword(t);
+    }
+    w[i] = w[i - nk] ^ t;
+  }
+
+  ek = (unsigned char*)skey->rijndael.eK;
+  dk = (unsigned char*)skey->rijndael.dK;
+  memcpy(ek, w, (size_t)(16 * (nr + 1)));
+  /* equivalent inverse cipher, reversed order with InvMixColumns on the inner round keys */
+  _mm_storeu_si128((__m128i*)dk, AESNI_ROUND_KEY(ek, nr));
+  for (i = 1; i < nr; ++i)
+    _mm_storeu_si128((__m128i*)(dk + 16 * i), _mm_aesimc_si128(AESNI_ROUND_KEY(ek, nr - i)));
+  _mm_storeu_si128((__m128i*)(dk + 16 * nr), AESNI_ROUND_KEY(ek, 0));
+  skey->rijndael.Nr = nr;
+
+  zeromem(w, sizeof(w));
+  return CRYPT_OK;
+}
+
+LCRYPT_TARGET("aes,sse2") static __m128i _lcrypt_aesni_encrypt1 (__m128i b, const unsigned char *rk, int nr) {
+  int r;
+  b = _mm_xor_si128(b, AESNI_ROUND_KEY(rk, 0));
+  for (r = 1; r < nr; ++r) b = _mm_aesenc_si128(b, AESNI_ROUND_KEY(rk, r));
+  return _mm_aesenclast_si128(b, AESNI_ROUND_KEY(rk, nr));
+}
+
+LCRYPT_TARGET("aes,sse2") static __m128i _lcrypt_aesni_decrypt1 (__m128i b, const unsigned char *rk, int nr) {
+  int r;
+  b = _mm_xor_si128(b, AESNI_ROUND_KEY(rk, 0));
+  for (r = 1; r < nr; ++r) b = _mm_aesdec_si128(b, AESNI_ROUND_KEY(rk, r));
+  return _mm_aesdeclast_si128(b, AESNI_ROUND_KEY(rk, nr));
+}
+
+/* several independent blocks per round hides the latency of aesenc / aesdec */
+#define AESNI_LANES(in, out, rk, nr, first, round, last)                          \
+{                                                                                 \
+  __m128i k = AESNI_ROUND_KEY(rk, 0);                                             \
+  __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), k);           \
+  __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in) + 1), k);       \
+  __m128i b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in) + 2), k);       \
+  __m128i b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in) + 3), k);       \
+  int r;                                                                          \
+  for (r = 1; r < (nr); ++r) {                                                    \
+    k = AESNI_ROUND_KEY(rk, r);                                                   \
+    b0 = round(b0, k);  b1 = round(b1, k);  b2 = round(b2, k);  b3 = round(b3, k); \
+  }                                                                               \
+  k = AESNI_ROUND_KEY(rk, nr);                                                    \
+  first[0] = last(b0, k);  first[1] = last(b1, k);                                \
+  first[2] = last(b2, k);  first[3] = last(b3, k);                                \
+}
+
+LCRYPT_TARGET("aes,sse2") static int lcrypt_aesni_ecb_encrypt (const unsigned char *pt, unsigned char *ct, symmetric_key *skey) {
+  const unsigned char *rk = (const unsigned char*)skey->rijndael.eK;
+  _mm_storeu_si128((__m128i*)ct, _lcrypt_aesni_encrypt1(_mm_loadu_si128((const __m128i*)pt), rk, skey->rijndael.Nr));
+  return CRYPT_OK;
+}
+
+LCRYPT_TARGET("aes,sse2") static int lcrypt_aesni_ecb_decrypt (const unsigned char *ct, unsigned char *pt, symmetric_key *skey) {
+  const unsigned char *rk = (const unsigned char*)skey->rijndael.dK;
+  _mm_storeu_si128((__m128i*)pt, _lcrypt_aesni_decrypt1(_mm_loadu_si128((const __m128i*)ct), rk, skey->rijndael.Nr));
+  return CRYPT_OK;
+}
+
+LCRYPT_TARGET("aes,sse2") static int lcrypt_aesni_accel_ecb_encrypt (const unsigned char *pt, unsigned char *ct, unsigned long blocks, symmetric_key *skey) {
+  const unsigned char *rk = (const unsigned char*)skey->rijndael.eK;
+  int nr = skey->rijndael.Nr;
+  __m128i b[LCRYPT_AESNI_LANES];
+  for (; blocks >= LCRYPT_AESNI_LANES; blocks -= LCRYPT_AESNI_LANES) {
+    AESNI_LANES(pt, ct, rk, nr, b, _mm_aesenc_si128, _mm_aesenclast_si128);
+    _mm_storeu_si128((__m128i*)ct,     b[0]);  _mm_storeu_si128((__m128i*)ct + 1, b[1]);
+    _mm_storeu_si128((__m128i*)ct + 2, b[2]);  _mm_storeu_si128((__m128i*)ct + 3, b[3]);
+    pt += 16 * LCRYPT_AESNI_LANES;  ct += 16 * LCRYPT_AESNI_LANES;
+  }
+  for (; blocks > 0; --blocks, pt += 16, ct += 16)
+    _mm_storeu_si128((__m128i*)ct, _lcrypt_aesni_encrypt1(_mm_loadu_si128((const __m128i*)pt), rk, nr));
+  return CRYPT_OK;
+}
+
+LCRYPT_TARGET("aes,sse2") static int lcrypt_aesni_accel_ecb_decrypt (const unsigned char *ct, unsigned char *pt, unsigned long blocks, symmetric_key *skey) {
+  const unsigned char *rk = (const unsigned char*)skey->rijndael.dK;
+  int nr = skey->rijndael.Nr;
+  __m128i b[LCRYPT_AESNI_LANES];
+  for (; blocks >= LCRYPT_AESNI_LANES; blocks -= LCRYPT_AESNI_LANES) {
+    AESNI_LANES(ct, pt, rk, nr, b, _mm_aesdec_si128, _mm_aesdeclast_si128);
+    _mm_storeu_si128((__m128i*)pt,     b[0]);  _mm_storeu_si128((__m128i*)pt + 1, b[1]);
+    _mm_storeu_si128((__m128i*)pt + 2, b[2]);  _mm_storeu_si128((__m128i*)pt + 3, b[3]);
+    ct += 16 * LCRYPT_AESNI_LANES;  pt += 16 * LCRYPT_AESNI_LANES;
+  }
+  for (; blocks > 0; --blocks, ct += 16, pt += 16)
+    _mm_storeu_si128((__m128i*)pt, _lcrypt_aesni_decrypt1(_mm_loadu_si128((const __m128i*)ct), rk, nr));
+  return CRYPT_OK;
+}
+
+LCRYPT_TARGET("aes,sse2") static int lcrypt_aesni_accel_cbc_encrypt (const unsigned char *pt, unsigned char *ct, unsigned long blocks, unsigned char *IV, symmetric_key *skey) {
+  const unsigned char *rk = (const unsigned char*)skey->rijndael.eK;
+  int nr = skey->rijndael.Nr;
+  __m128i iv = _mm_loadu_si128((const __m128i*)IV);
+  for (; blocks > 0; --blocks, pt += 16, ct += 16) {
+    iv = _lcrypt_aesni_encrypt1(_mm_xor_si128(iv, _mm_loadu_si128((const __m128i*)pt)), rk, nr);
+    _mm_storeu_si128((__m128i*)ct, iv);
+  }
+  _mm_storeu_si128((__m128i*)IV, iv);
+  return CRYPT_OK;
+}
+
+/* CBC decryption has no chain through the cipher, so it runs on the same lanes as ECB */
+LCRYPT_TARGET("aes,sse2") static int lcrypt_aesni_accel_cbc_decrypt (const unsigned char *ct, unsigned char *pt, unsigned long blocks, unsigned char *IV, symmetric_key *skey) {
+  const unsigned char *rk = (const unsigned char*)skey->rijndael.dK;
+  int nr = skey->rijndael.Nr;
+  __m128i iv = _mm_loadu_si128((const __m128i*)IV);
+  __m128i b[LCRYPT_AESNI_LANES];
+  for (; blocks >= LCRYPT_AESNI_LANES; blocks -= LCRYPT_AESNI_LANES) {
+    __m128i c0 = _mm_loadu_si128((const __m128i*)ct),     c1 = _mm_loadu_si128((const __m128i*)ct + 1);
+    __m128i c2 = _mm_loadu_si128((const __m128i*)ct + 2), c3 = _mm_loadu_si128((const __m128i*)ct + 3);
+    AESNI_LANES(ct, pt, rk, nr, b, _mm_aesdec_si128, _mm_aesdeclast_si128);
+    /* ct and pt may be the same buffer, the ciphertext is already in registers */
+    _mm_storeu_si128((__m128i*)pt,     _mm_xor_si128(b[0], iv));
+    _mm_storeu_si128((__m128i*)pt + 1, _mm_xor_si128(b[1], c0));
+    _mm_storeu_si128((__m128i*)pt + 2, _mm_xor_si128(b[2], c1));
+    _mm_storeu_si128((__m128i*)pt + 3, _mm_xor_si128(b[3], c2));
+    iv = c3;
+    ct += 16 * LCRYPT_AESNI_LANES;  pt += 16 * LCRYPT_AESNI_LANES;
+  }
+  for (; blocks > 0; --blocks, ct += 16, pt += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i*)ct);
+    _mm_storeu_si128((__m128i*)pt, _mm_xor_si128(_lcrypt_aesni_decrypt1(c, rk, nr), iv));
+    iv = c;
+  }
+  _mm_storeu_si128((__m128i*)IV, iv);
+  return CRYPT_OK;
+}
+
+#undef AESNI_LANES
+
+/**
+ * One block from each of count independent streams, every one under its own schedule with nr rounds. The
+ * streams share nothing, so their rounds interleave like the lanes above even though each is a single block.
+ */
+LCRYPT_TARGET("aes,sse2") static void lcrypt_aesni_crypt_streams (
+    unsigned char (*in)[16], unsigned char (*out)[16], symmetric_key *const *keys, int count, int nr, int decrypt
+  ) {
+  const unsigned char *rk[LCRYPT_AESNI_STREAMS];
+  __m128i b[LCRYPT_AESNI_STREAMS];
+  int i, r;
+  for (i = 0; i < count; ++i) {
+    rk[i] = (const unsigned char*)(decrypt ? keys[i]->rijndael.dK : keys[i]->rijndael.eK);
+    b[i]  = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in[i]), AESNI_ROUND_KEY(rk[i], 0));
+  }
+  if (decrypt) {
+    for (r = 1; r < nr; ++r)
+      for (i = 0; i < count; ++i) b[i] = _mm_aesdec_si128(b[i], AESNI_ROUND_KEY(rk[i], r));
+    for (i = 0; i < count; ++i) _mm_storeu_si128((__m128i*)out[i], _mm_aesdeclast_si128(b[i], AESNI_ROUND_KEY(rk[i], nr)));
+  } else {
+    for (r = 1; r < nr; ++r)
+      for (i = 0; i < count; ++i) b[i] = _mm_aesenc_si128(b[i], AESNI_ROUND_KEY(rk[i], r));
+    for (i = 0; i < count; ++i) _mm_storeu_si128((__m128i*)out[i], _mm_aesenclast_si128(b[i], AESNI_ROUND_KEY(rk[i], nr)));
+  }
+}
+
+static int lcrypt_aesni_test (void) {
+  static const struct {
+    int keylength;
+    unsigned char key[32], pt[16], ct[16];
+  } tests[] = {
+    { 16, { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f },
+      { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+      { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a } },
+    { 24, { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+            0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17 },
+      { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+      { 0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91 } },
+    { 32, { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+            0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f },
+      { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff },
+      { 0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 } }
+  };
+  symmetric_key skey;
+  unsigned char out[16];
+  size_t i;
+  int err;
+
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+    if ((err = lcrypt_aesni_setup(tests[i].key, tests[i].keylength, 0, &skey)) != CRYPT_OK) return err;
+    (void)lcrypt_aesni_ecb_encrypt(tests[i].pt, out, &skey);
+    if (memcmp(out, tests[i].ct, 16) != 0) return CRYPT_FAIL_TESTVECTOR;
+    (void)lcrypt_aesni_ecb_decrypt(out, out, &skey);
+    if (memcmp(out, tests[i].pt, 16) != 0) return CRYPT_FAIL_TESTVECTOR;
+  }
+  return CRYPT_OK;
+}
+
+static void lcrypt_aesni_done (symmetric_key *skey) {
+  (void)skey;
+}
+
+static int lcrypt_aesni_keysize (int *keysize) {
+  if (keysize == NULL) return CRYPT_INVALID_ARG;
+  if (*keysize < 16) return CRYPT_INVALID_KEYSIZE;
+  *keysize = (*keysize < 24) ? 16 : (*keysize < 32) ? 24 : 32;
+  return CRYPT_OK;
+}
+
+static const struct ltc_cipher_descriptor lcrypt_aesni_desc = {
+  .name              = "aes",
+  .ID                = 6,
+  .min_key_length    = 16,
+  .max_key_length    = 32,
+  .block_length      = 16,
+  .default_rounds    = 10,
+  .setup             = lcrypt_aesni_setup,
+  .ecb_encrypt       = lcrypt_aesni_ecb_encrypt,
+  .ecb_decrypt       = lcrypt_aesni_ecb_decrypt,
+  .test              = lcrypt_aesni_test,
+  .done              = lcrypt_aesni_done,
+  .keysize           = lcrypt_aesni_keysize,
+  .accel_ecb_encrypt = lcrypt_aesni_accel_ecb_encrypt,
+  .accel_ecb_decrypt = lcrypt_aesni_accel_ecb_decrypt,
+  .accel_cbc_encrypt = lcrypt_aesni_accel_cbc_encrypt,
+  .accel_cbc_decrypt = lcrypt_aesni_accel_cbc_decrypt
+};
+
+#undef AESNI_ROUND_KEY
+
+#endif
+
+/* rounds of a schedule the AES-NI descriptor expanded, 0 when cipher runs some other way */
+static int lcrypt_aesni_rounds (int cipher, const symmetric_key *skey) {
+  #ifdef LCRYPT_X86
+    if (cipher >= 0 && cipher_descriptor[cipher].setup == lcrypt_aesni_setup) return skey->rijndael.Nr;
+  #endif
+  (void)cipher;
+  (void)skey;
+  return 0;
+}
+
+/* the aes descriptor to register, AES-NI when the cpu has it and it passes its own test vectors */
+static const struct ltc_cipher_descriptor *lcrypt_aes_desc (const char **implementation) {
+  #ifdef LCRYPT_X86
+    if (lcrypt_cpu.aesni && lcrypt_cpu.sse2 && lcrypt_aesni_test() == CRYPT_OK) {
+      *implementation = "aesni";
+      return &lcrypt_aesni_desc;
+    }
+  #endif
+  *implementation = "portable";
+  return &aes_desc;
+}
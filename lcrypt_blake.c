@@ -0,0 +1,525 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+/*
+ * BLAKE2b, BLAKE2s (RFC 7693) and BLAKE3. libtomcrypt 1.17 has none of them and
+ * their states do not fit hash_state, so lcrypt_hashes.c carries them itself.
+ * BLAKE3 is a tree of 1 KB chunks, whole subtrees of a large update are split
+ * into pieces that lcrypt_parallel hashes on several threads.
+ */
+
+#define LCRYPT_BLAKE3_CHUNK       1024
+#define LCRYPT_BLAKE3_MAX_DEPTH   54    /* 2^54 chunks is 2^64 bytes */
+#define LCRYPT_BLAKE3_MAX_PIECES  512   /* pieces of one subtree, several per thread evens out the load */
+
+#define LCRYPT_BLAKE3_CHUNK_START 1
+#define LCRYPT_BLAKE3_CHUNK_END   2
+#define LCRYPT_BLAKE3_PARENT      4
+#define LCRYPT_BLAKE3_ROOT        8
+#define LCRYPT_BLAKE3_KEYED_HASH  16
+
+typedef struct {
+  ulong64 h[8], t[2];
+  unsigned char buffer[128];
+  unsigned long length;         /* bytes in buffer, a full one is kept until more data or done */
+} lcrypt_blake2b_t;
+
+typedef struct {
+  uint32_t h[8], t[2];
+  unsigned char buffer[64];
+  unsigned long length;
+} lcrypt_blake2s_t;
+
+typedef struct {
+  uint32_t cv[8];
+  ulong64 counter;              /* chunk index */
+  unsigned char block[64];
+  unsigned long length, blocks; /* bytes in block, blocks compressed */
+  uint32_t flags;
+} lcrypt_blake3_chunk_t;
+
+typedef struct {
+  uint32_t key[8];
+  lcrypt_blake3_chunk_t chunk;
+  unsigned char stack[(LCRYPT_BLAKE3_MAX_DEPTH + 1) * 32];   /* chaining values of finished subtrees */
+  unsigned long stack_length;
+} lcrypt_blake3_t;
+
+static const ulong64 lcrypt_blake2b_iv[8] = {
+  CONST64(0x6a09e667f3bcc908), CONST64(0xbb67ae8584caa73b), CONST64(0x3c6ef372fe94f82b), CONST64(0xa54ff53a5f1d36f1),
+  CONST64(0x510e527fade682d1), CONST64(0x9b05688c2b3e6c1f), CONST64(0x1f83d9abfb41bd6b), CONST64(0x5be0cd19137e2179)
+};
+
+/* BLAKE2s and BLAKE3 share the SHA-256 iv */
+static const uint32_t lcrypt_blake2s_iv[8] = {
+  0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL, 0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL
+};
+
+static const unsigned char lcrypt_blake2_sigma[12][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+  { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 }, { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+  { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 }, { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+  { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 }, { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+  { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 }, { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+/* BLAKE3 permutes the message words after every round, these are the 7 rounds written out */
+static const unsigned char lcrypt_blake3_schedule[7][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+  { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 }, { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+  { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 }, { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+  { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+};
+
+#define BLAKE_ROTR32(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+#define BLAKE_ROTR64(v, n) (((v) >> (n)) | ((v) << (64 - (n))))
+
+#define BLAKE_G32(v, a, b, c, d, x, y)                                                  \
+  v[a] += v[b] + (x); v[d] = BLAKE_ROTR32(v[d] ^ v[a], 16);                             \
+  v[c] += v[d];       v[b] = BLAKE_ROTR32(v[b] ^ v[c], 12);                             \
+  v[a] += v[b] + (y); v[d] = BLAKE_ROTR32(v[d] ^ v[a], 8);                              \
+  v[c] += v[d];       v[b] = BLAKE_ROTR32(v[b] ^ v[c], 7);
+
+#define BLAKE_G64(v, a, b, c, d, x, y)                                                  \
+  v[a] += v[b] + (x); v[d] = BLAKE_ROTR64(v[d] ^ v[a], 32);                             \
+  v[c] += v[d];       v[b] = BLAKE_ROTR64(v[b] ^ v[c], 24);                             \
+  v[a] += v[b] + (y); v[d] = BLAKE_ROTR64(v[d] ^ v[a], 16);                             \
+  v[c] += v[d];       v[b] = BLAKE_ROTR64(v[b] ^ v[c], 63);
+
+#define BLAKE_ROUND(G, v, m, s)                                                         \
+  G(v, 0, 4, 8,  12, m[s[0]],  m[s[1]]);  G(v, 1, 5, 9,  13, m[s[2]],  m[s[3]]);        \
+  G(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);  G(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);        \
+  G(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);  G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);       \
+  G(v, 2, 7, 8,  13, m[s[12]], m[s[13]]); G(v, 3, 4, 9,  14, m[s[14]], m[s[15]]);
+
+/* written out so the schedule indexes are constants and the message stays in registers */
+#define BLAKE_ROUNDS(G, v, m, schedule, first)                                          \
+  BLAKE_ROUND(G, v, m, schedule[first]);     BLAKE_ROUND(G, v, m, schedule[first + 1]); \
+  BLAKE_ROUND(G, v, m, schedule[first + 2]); BLAKE_ROUND(G, v, m, schedule[first + 3]); \
+  BLAKE_ROUND(G, v, m, schedule[first + 4]);
+
+/* BLAKE2b */
+
+static void _lcrypt_blake2b_compress (lcrypt_blake2b_t *s, const unsigned char *block, int last) {
+  ulong64 m[16], v[16];
+  int i;
+  for (i = 0; i < 16; ++i) LOAD64L(m[i], block + 8 * i);
+  for (i = 0; i < 8; ++i) { v[i] = s->h[i]; v[i + 8] = lcrypt_blake2b_iv[i]; }
+  v[12] ^= s->t[0];
+  v[13] ^= s->t[1];
+  if (last) v[14] = ~v[14];
+  BLAKE_ROUNDS(BLAKE_G64, v, m, lcrypt_blake2_sigma, 0);  BLAKE_ROUNDS(BLAKE_G64, v, m, lcrypt_blake2_sigma, 5);
+  BLAKE_ROUND(BLAKE_G64, v, m, lcrypt_blake2_sigma[10]);  BLAKE_ROUND(BLAKE_G64, v, m, lcrypt_blake2_sigma[11]);
+  for (i = 0; i < 8; ++i) s->h[i] ^= v[i] ^ v[i + 8];
+}
+
+static void _lcrypt_blake2b_count (lcrypt_blake2b_t *s, unsigned long length) {
+  s->t[0] += length;
+  if (s->t[0] < length) s->t[1]++;
+}
+
+static int lcrypt_blake2b_process (lcrypt_blake2b_t *s, const unsigned char *in, unsigned long length) {
+  while (length > 0) {
+    unsigned long take;
+    if (s->length == 128) {
+      _lcrypt_blake2b_count(s, 128);
+      _lcrypt_blake2b_compress(s, s->buffer, 0);
+      s->length = 0;
+    }
+    /* the last block needs the final flag, so one is always left for done */
+    if (s->length == 0) {
+      for (; length > 128; in += 128, length -= 128) {
+        _lcrypt_blake2b_count(s, 128);
+        _lcrypt_blake2b_compress(s, in, 0);
+      }
+    }
+    take = (128 - s->length < length) ? 128 - s->length : length;
+    memcpy(s->buffer + s->length, in, take);
+    s->length += take;
+    in += take;
+    length -= take;
+  }
+  return CRYPT_OK;
+}
+
+/* a 64 byte digest, key may be up to 64 bytes and empty for the plain hash */
+static int lcrypt_blake2b_init (lcrypt_blake2b_t *s, const unsigned char *key, unsigned long key_length) {
+  if (key_length > 64) return CRYPT_INVALID_KEYSIZE;
+  memset(s, 0, sizeof(*s));
+  memcpy(s->h, lcrypt_blake2b_iv, sizeof(s->h));
+  s->h[0] ^= 0x01010000UL ^ (key_length << 8) ^ 64;
+  if (key_length > 0) {
+    memcpy(s->buffer, key, key_length);
+    s->length = 128;
+  }
+  return CRYPT_OK;
+}
+
+static int lcrypt_blake2b_done (lcrypt_blake2b_t *s, unsigned char *out) {
+  int i;
+  _lcrypt_blake2b_count(s, s->length);
+  memset(s->buffer + s->length, 0, 128 - s->length);
+  _lcrypt_blake2b_compress(s, s->buffer, 1);
+  for (i = 0; i < 8; ++i) STORE64L(s->h[i], out + 8 * i);
+  zeromem(s, sizeof(*s));
+  return CRYPT_OK;
+}
+
+/* BLAKE2s */
+
+static void _lcrypt_blake2s_compress (lcrypt_blake2s_t *s, const unsigned char *block, int last) {
+  uint32_t m[16], v[16];
+  int i;
+  for (i = 0; i < 16; ++i) LOAD32L(m[i], block + 4 * i);
+  for (i = 0; i < 8; ++i) { v[i] = s->h[i]; v[i + 8] = lcrypt_blake2s_iv[i]; }
+  v[12] ^= s->t[0];
+  v[13] ^= s->t[1];
+  if (last) v[14] = ~v[14];
+  BLAKE_ROUNDS(BLAKE_G32, v, m, lcrypt_blake2_sigma, 0);  BLAKE_ROUNDS(BLAKE_G32, v, m, lcrypt_blake2_sigma, 5);
+  for (i = 0; i < 8; ++i) s->h[i] ^= v[i] ^ v[i + 8];
+}
+
+static void _lcrypt_blake2s_count (lcrypt_blake2s_t *s, unsigned long length) {
+  s->t[0] = (s->t[0] + (uint32_t)length) & 0xffffffffUL;
+  if (s->t[0] < length) s->t[1]++;
+}
+
+static int lcrypt_blake2s_process (lcrypt_blake2s_t *s, const unsigned char *in, unsigned long length) {
+  while (length > 0) {
+    unsigned long take;
+    if (s->length == 64) {
+      _lcrypt_blake2s_count(s, 64);
+      _lcrypt_blake2s_compress(s, s->buffer, 0);
+      s->length = 0;
+    }
+    if (s->length == 0) {
+      for (; length > 64; in += 64, length -= 64) {
+        _lcrypt_blake2s_count(s, 64);
+        _lcrypt_blake2s_compress(s, in, 0);
+      }
+    }
+    take = (64 - s->length < length) ? 64 - s->length : length;
+    memcpy(s->buffer + s->length, in, take);
+    s->length += take;
+    in += take;
+    length -= take;
+  }
+  return CRYPT_OK;
+}
+
+/* a 32 byte digest, key may be up to 32 bytes */
+static int lcrypt_blake2s_init (lcrypt_blake2s_t *s, const unsigned char *key, unsigned long key_length) {
+  if (key_length > 32) return CRYPT_INVALID_KEYSIZE;
+  memset(s, 0, sizeof(*s));
+  memcpy(s->h, lcrypt_blake2s_iv, sizeof(s->h));
+  s->h[0] ^= 0x01010000UL ^ (uint32_t)(key_length << 8) ^ 32;
+  if (key_length > 0) {
+    memcpy(s->buffer, key, key_length);
+    s->length = 64;
+  }
+  return CRYPT_OK;
+}
+
+static int lcrypt_blake2s_done (lcrypt_blake2s_t *s, unsigned char *out) {
+  int i;
+  _lcrypt_blake2s_count(s, s->length);
+  memset(s->buffer + s->length, 0, 64 - s->length);
+  _lcrypt_blake2s_compress(s, s->buffer, 1);
+  for (i = 0; i < 8; ++i) STORE32L(s->h[i], out + 4 * i);
+  zeromem(s, sizeof(*s));
+  return CRYPT_OK;
+}
+
+/* BLAKE3 */
+
+static void _lcrypt_blake3_compress (const uint32_t *cv, const unsigned char *block, ulong64 counter, uint32_t length, uint32_t flags, uint32_t *out) {
+  uint32_t m[16];
+  int i;
+  for (i = 0; i < 16; ++i) LOAD32L(m[i], block + 4 * i);
+  for (i = 0; i < 8; ++i) out[i] = cv[i];
+  for (i = 0; i < 4; ++i) out[i + 8] = lcrypt_blake2s_iv[i];
+  out[12] = (uint32_t)(counter & 0xffffffffUL);
+  out[13] = (uint32_t)(counter >> 32);
+  out[14] = length;
+  out[15] = flags;
+  BLAKE_ROUNDS(BLAKE_G32, out, m, lcrypt_blake3_schedule, 0);
+  BLAKE_ROUND(BLAKE_G32, out, m, lcrypt_blake3_schedule[5]);  BLAKE_ROUND(BLAKE_G32, out, m, lcrypt_blake3_schedule[6]);
+  for (i = 0; i < 8; ++i) {
+    out[i] ^= out[i + 8];
+    out[i + 8] ^= cv[i];
+  }
+}
+
+/* the last compression of a chunk or parent, kept apart until it is known whether it is the root */
+typedef struct {
+  uint32_t cv[8];
+  unsigned char block[64];
+  ulong64 counter;
+  uint32_t length, flags;
+} lcrypt_blake3_output_t;
+
+static void _lcrypt_blake3_cv (const lcrypt_blake3_output_t *o, unsigned char *cv) {
+  uint32_t out[16];
+  int i;
+  _lcrypt_blake3_compress(o->cv, o->block, o->counter, o->length, o->flags, out);
+  for (i = 0; i < 8; ++i) STORE32L(out[i], cv + 4 * i);
+}
+
+static void _lcrypt_blake3_parent (lcrypt_blake3_output_t *o, const unsigned char *children, const uint32_t *key, uint32_t flags) {
+  memcpy(o->cv, key, sizeof(o->cv));
+  memcpy(o->block, children, 64);
+  o->counter = 0;
+  o->length  = 64;
+  o->flags   = flags | LCRYPT_BLAKE3_PARENT;
+}
+
+static void _lcrypt_blake3_chunk_init (lcrypt_blake3_chunk_t *c, const uint32_t *key, ulong64 counter, uint32_t flags) {
+  memset(c, 0, sizeof(*c));
+  memcpy(c->cv, key, sizeof(c->cv));
+  c->counter = counter;
+  c->flags   = flags;
+}
+
+static uint32_t _lcrypt_blake3_chunk_start (const lcrypt_blake3_chunk_t *c) {
+  return (c->blocks == 0) ? LCRYPT_BLAKE3_CHUNK_START : 0;
+}
+
+static void _lcrypt_blake3_chunk_block (lcrypt_blake3_chunk_t *c, const unsigned char *block) {
+  uint32_t out[16];
+  _lcrypt_blake3_compress(c->cv, block, c->counter, 64, c->flags | _lcrypt_blake3_chunk_start(c), out);
+  memcpy(c->cv, out, sizeof(c->cv));
+  c->blocks++;
+}
+
+static unsigned long _lcrypt_blake3_chunk_length (const lcrypt_blake3_chunk_t *c) {
+  return c->blocks * 64 + c->length;
+}
+
+static void _lcrypt_blake3_chunk_update (lcrypt_blake3_chunk_t *c, const unsigned char *in, unsigned long length) {
+  while (length > 0) {
+    unsigned long take;
+    if (c->length == 64) {
+      _lcrypt_blake3_chunk_block(c, c->block);
+      c->length = 0;
+    }
+    if (c->length == 0) {
+      for (; length > 64; in += 64, length -= 64) _lcrypt_blake3_chunk_block(c, in);
+    }
+    take = (64 - c->length < length) ? 64 - c->length : length;
+    memcpy(c->block + c->length, in, take);
+    c->length += take;
+    in += take;
+    length -= take;
+  }
+}
+
+static void _lcrypt_blake3_chunk_output (const lcrypt_blake3_chunk_t *c, lcrypt_blake3_output_t *o) {
+  memcpy(o->cv, c->cv, sizeof(o->cv));
+  memset(o->block, 0, sizeof(o->block));
+  memcpy(o->block, c->block, c->length);
+  o->counter = c->counter;
+  o->length  = (uint32_t)c->length;
+  o->flags   = c->flags | _lcrypt_blake3_chunk_start(c) | LCRYPT_BLAKE3_CHUNK_END;
+}
+
+/* chaining value of a complete subtree, length is a power of two number of chunks */
+static void _lcrypt_blake3_subtree (const unsigned char *in, unsigned long length, ulong64 counter, const uint32_t *key, uint32_t flags, unsigned char *cv) {
+  lcrypt_blake3_output_t o;
+  if (length == LCRYPT_BLAKE3_CHUNK) {
+    lcrypt_blake3_chunk_t c;
+    _lcrypt_blake3_chunk_init(&c, key, counter, flags);
+    _lcrypt_blake3_chunk_update(&c, in, length);
+    _lcrypt_blake3_chunk_output(&c, &o);
+  } else {
+    unsigned char children[64];
+    unsigned long half = length / 2;
+    _lcrypt_blake3_subtree(in, half, counter, key, flags, children);
+    _lcrypt_blake3_subtree(in + half, half, counter + half / LCRYPT_BLAKE3_CHUNK, key, flags, children + 32);
+    _lcrypt_blake3_parent(&o, children, key, flags);
+  }
+  _lcrypt_blake3_cv(&o, cv);
+}
+
+typedef struct {
+  const unsigned char *in;
+  unsigned long piece_length;
+  ulong64 counter;              /* chunk index of the first piece */
+  const uint32_t *key;
+  uint32_t flags;
+  unsigned long first, count;   /* pieces of this job */
+  unsigned char *cvs;
+} lcrypt_blake3_job_t;
+
+static void *_lcrypt_blake3_job (void *arg) {
+  lcrypt_blake3_job_t *job = arg;
+  unsigned long i;
+  for (i = job->first; i < job->first + job->count; ++i) {
+    _lcrypt_blake3_subtree(job->in + i * job->piece_length, job->piece_length,
+                           job->counter + i * (job->piece_length / LCRYPT_BLAKE3_CHUNK), job->key, job->flags, job->cvs + i * 32);
+  }
+  return NULL;
+}
+
+/* chaining values of the two halves of a subtree of at least two chunks, hashed by up to threads threads */
+static void _lcrypt_blake3_halves (const unsigned char *in, unsigned long length, ulong64 counter, const uint32_t *key, uint32_t flags, int threads, unsigned char *cvs) {
+  unsigned char piece_cvs[LCRYPT_BLAKE3_MAX_PIECES * 32];
+  lcrypt_blake3_job_t jobs[LCRYPT_THREADS_MAX];
+  unsigned long pieces = 2, i;
+
+  if ((unsigned long)threads > length / LCRYPT_THREADS_MIN_SLICE) threads = (int)(length / LCRYPT_THREADS_MIN_SLICE);
+  if (threads < 1) threads = 1;
+  while (pieces < LCRYPT_BLAKE3_MAX_PIECES && pieces < 8UL * (unsigned long)threads && length / pieces > LCRYPT_BLAKE3_CHUNK)
+    pieces *= 2;
+
+  for (i = 0; i < (unsigned long)threads; ++i) {
+    jobs[i].in           = in;
+    jobs[i].piece_length = length / pieces;
+    jobs[i].counter      = counter;
+    jobs[i].key          = key;
+    jobs[i].flags        = flags;
+    jobs[i].first        = pieces * i / (unsigned long)threads;
+    jobs[i].count        = pieces * (i + 1) / (unsigned long)threads - jobs[i].first;
+    jobs[i].cvs          = piece_cvs;
+  }
+  if (threads == 1) (void)_lcrypt_blake3_job(jobs);
+  else lcrypt_parallel(_lcrypt_blake3_job, jobs, sizeof(jobs[0]), threads);
+
+  /* the pieces are whole subtrees side by side, join neighbours until the two halves are left */
+  for (; pieces > 2; pieces /= 2) {
+    for (i = 0; i < pieces / 2; ++i) {
+      lcrypt_blake3_output_t o;
+      _lcrypt_blake3_parent(&o, piece_cvs + i * 64, key, flags);
+      _lcrypt_blake3_cv(&o, piece_cvs + i * 32);
+    }
+  }
+  memcpy(cvs, piece_cvs, 64);
+}
+
+static unsigned long _lcrypt_blake3_popcount (ulong64 v) {
+  unsigned long count = 0;
+  for (; v != 0; v &= v - 1) count++;
+  return count;
+}
+
+/* joins finished subtrees, but leaves the last two for done in case they make the root */
+static void _lcrypt_blake3_merge (lcrypt_blake3_t *s, ulong64 chunks) {
+  unsigned long keep = _lcrypt_blake3_popcount(chunks);
+  while (s->stack_length > keep) {
+    lcrypt_blake3_output_t o;
+    unsigned char *children = s->stack + (s->stack_length - 2) * 32;
+    _lcrypt_blake3_parent(&o, children, s->key, s->chunk.flags);
+    _lcrypt_blake3_cv(&o, children);
+    s->stack_length--;
+  }
+}
+
+static void _lcrypt_blake3_push (lcrypt_blake3_t *s, const unsigned char *cv, ulong64 counter) {
+  _lcrypt_blake3_merge(s, counter);
+  memcpy(s->stack + s->stack_length * 32, cv, 32);
+  s->stack_length++;
+}
+
+/* a 32 byte digest, key is empty for the plain hash or 32 bytes for the keyed one */
+static int lcrypt_blake3_init (lcrypt_blake3_t *s, const unsigned char *key, unsigned long key_length) {
+  uint32_t flags = 0;
+  int i;
+  if (key_length != 0 && key_length != 32) return CRYPT_INVALID_KEYSIZE;
+  memset(s, 0, sizeof(*s));
+  if (key_length == 32) {
+    for (i = 0; i < 8; ++i) LOAD32L(s->key[i], key + 4 * i);
+    flags = LCRYPT_BLAKE3_KEYED_HASH;
+  } else {
+    memcpy(s->key, lcrypt_blake2s_iv, sizeof(s->key));
+  }
+  _lcrypt_blake3_chunk_init(&s->chunk, s->key, 0, flags);
+  return CRYPT_OK;
+}
+
+static int lcrypt_blake3_process (lcrypt_blake3_t *s, const unsigned char *in, unsigned long length, int threads) {
+  /* finish a started chunk first, but only once more data shows it is not the last */
+  if (_lcrypt_blake3_chunk_length(&s->chunk) > 0) {
+    unsigned long take = LCRYPT_BLAKE3_CHUNK - _lcrypt_blake3_chunk_length(&s->chunk);
+    if (take > length) take = length;
+    _lcrypt_blake3_chunk_update(&s->chunk, in, take);
+    in += take;
+    length -= take;
+    if (length == 0) return CRYPT_OK;
+    {
+      lcrypt_blake3_output_t o;
+      unsigned char cv[32];
+      _lcrypt_blake3_chunk_output(&s->chunk, &o);
+      _lcrypt_blake3_cv(&o, cv);
+      _lcrypt_blake3_push(s, cv, s->chunk.counter);
+      _lcrypt_blake3_chunk_init(&s->chunk, s->key, s->chunk.counter + 1, s->chunk.flags);
+    }
+  }
+
+  /* then the largest whole subtrees that line up with the chunks hashed so far */
+  while (length > LCRYPT_BLAKE3_CHUNK) {
+    unsigned long subtree = LCRYPT_BLAKE3_CHUNK, chunks;
+    ulong64 offset = s->chunk.counter * LCRYPT_BLAKE3_CHUNK;
+    while (subtree * 2 <= length && subtree * 2 > subtree && ((ulong64)(subtree * 2 - 1) & offset) == 0) subtree *= 2;
+    chunks = subtree / LCRYPT_BLAKE3_CHUNK;
+    if (chunks == 1) {
+      unsigned char cv[32];
+      _lcrypt_blake3_subtree(in, subtree, s->chunk.counter, s->key, s->chunk.flags, cv);
+      _lcrypt_blake3_push(s, cv, s->chunk.counter);
+    } else {
+      unsigned char cvs[64];
+      _lcrypt_blake3_halves(in, subtree, s->chunk.counter, s->key, s->chunk.flags, threads, cvs);
+      _lcrypt_blake3_push(s, cvs, s->chunk.counter);
+      _lcrypt_blake3_push(s, cvs + 32, s->chunk.counter + chunks / 2);
+    }
+    s->chunk.counter += chunks;
+    in += subtree;
+    length -= subtree;
+  }
+
+  /* and what is left goes into the chunk, it may be the last */
+  if (length > 0) {
+    _lcrypt_blake3_chunk_update(&s->chunk, in, length);
+    _lcrypt_blake3_merge(s, s->chunk.counter);
+  }
+  return CRYPT_OK;
+}
+
+static int lcrypt_blake3_done (lcrypt_blake3_t *s, unsigned char *out) {
+  lcrypt_blake3_output_t o;
+  uint32_t root[16];
+  unsigned long remaining = s->stack_length;
+  int i;
+
+  if (_lcrypt_blake3_chunk_length(&s->chunk) > 0 || remaining == 0) {
+    _lcrypt_blake3_chunk_output(&s->chunk, &o);
+  } else {
+    /* the input ended on a subtree, whose two halves are at the top of the stack */
+    remaining -= 2;
+    _lcrypt_blake3_parent(&o, s->stack + remaining * 32, s->key, s->chunk.flags);
+  }
+  while (remaining > 0) {
+    unsigned char children[64];
+    remaining--;
+    memcpy(children, s->stack + remaining * 32, 32);
+    _lcrypt_blake3_cv(&o, children + 32);
+    _lcrypt_blake3_parent(&o, children, s->key, s->chunk.flags);
+  }
+
+  _lcrypt_blake3_compress(o.cv, o.block, 0, o.length, o.flags | LCRYPT_BLAKE3_ROOT, root);
+  for (i = 0; i < 8; ++i) STORE32L(root[i], out + 4 * i);
+  zeromem(s, sizeof(*s));
+  return CRYPT_OK;
+}
+
+#undef BLAKE_ROUNDS
+#undef BLAKE_ROUND
+#undef BLAKE_G64
+#undef BLAKE_G32
+#undef BLAKE_ROTR64
+#undef BLAKE_ROTR32
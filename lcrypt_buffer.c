@@ -0,0 +1,102 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+typedef struct {
+  size_t size;
+  unsigned char data[1];
+} lcrypt_buffer_t;
+
+static lcrypt_buffer_t *lcrypt_new_buffer (lua_State *L, size_t size) {
+  lcrypt_buffer_t *buffer = lua_newuserdata(L, offsetof(lcrypt_buffer_t, data) + size);
+  memset(buffer, 0, offsetof(lcrypt_buffer_t, data) + size);
+  buffer->size = size;
+  luaL_getmetatable(L, "LCRYPT_BUFFER");
+  (void)lua_setmetatable(L, -2);
+  return buffer;
+}
+
+/* returns a pointer to length bytes at offset, raising a Lua error when they are out of bounds */
+static unsigned char *lcrypt_buffer_range (lua_State *L, int index, lua_Integer offset, size_t length) {
+  lcrypt_buffer_t *buffer = luaL_checkudata(L, index, "LCRYPT_BUFFER");
+  if (offset < 0 || (size_t)offset > buffer->size || length > buffer->size - (size_t)offset)
+    (void)luaL_error(L, "Buffer range out of bounds");
+  return buffer->data + offset;
+}
+
+/* a number is the size of a zeroed buffer, a string, even one of digits, is copied in */
+static int lcrypt_buffer (lua_State *L) {
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    lua_Integer size = luaL_checkinteger(L, 1);
+    if (size < 0) RETURN_STRING_ERROR(L, "Buffer size must not be negative");
+    (void)lcrypt_new_buffer(L, (size_t)size);
+  } else {
+    size_t in_length = 0;
+    const char *in = luaL_checklstring(L, 1, &in_length);
+    lcrypt_buffer_t *buffer = lcrypt_new_buffer(L, in_length);
+    memcpy(buffer->data, in, in_length);
+  }
+  return 1;
+}
+
+static int lcrypt_buffer_read (lua_State *L) {
+  lcrypt_buffer_t *buffer = luaL_checkudata(L, 1, "LCRYPT_BUFFER");
+  lua_Integer offset = luaL_optinteger(L, 2, 0);
+  lua_Integer length = luaL_optinteger(L, 3, (lua_Integer)buffer->size - offset);
+  if (length < 0) RETURN_STRING_ERROR(L, "Buffer range out of bounds");
+  lua_pushlstring(L, (char*)lcrypt_buffer_range(L, 1, offset, (size_t)length), (size_t)length);
+  return 1;
+}
+
+static int lcrypt_buffer_write (lua_State *L) {
+  lua_Integer offset = luaL_checkinteger(L, 2);
+  size_t in_length = 0;
+  const char *in = luaL_checklstring(L, 3, &in_length);
+  memcpy(lcrypt_buffer_range(L, 1, offset, in_length), in, in_length);
+  lua_pushinteger(L, (lua_Integer)in_length);
+  return 1;
+}
+
+static int lcrypt_buffer_fill (lua_State *L) {
+  lcrypt_buffer_t *buffer = luaL_checkudata(L, 1, "LCRYPT_BUFFER");
+  memset(buffer->data, luaL_optint(L, 2, 0) & 0xff, buffer->size);
+  return 0;
+}
+
+static int lcrypt_buffer_tostring (lua_State *L) {
+  lcrypt_buffer_t *buffer = luaL_checkudata(L, 1, "LCRYPT_BUFFER");
+  lua_pushlstring(L, (char*)buffer->data, buffer->size);
+  return 1;
+}
+
+static int lcrypt_buffer_size (lua_State *L) {
+  lcrypt_buffer_t *buffer = luaL_checkudata(L, 1, "LCRYPT_BUFFER");
+  lua_pushinteger(L, (lua_Integer)buffer->size);
+  return 1;
+}
+
+static const struct luaL_Reg lcrypt_buffer_methods[] = {
+  {"read",  &lcrypt_buffer_read},
+  {"write", &lcrypt_buffer_write},
+  {"fill",  &lcrypt_buffer_fill},
+  {NULL,    NULL}
+};
+
+static const struct luaL_Reg lcrypt_buffer_flib[] = {
+  {"__tostring", &lcrypt_buffer_tostring},
+  {"__len",      &lcrypt_buffer_size},
+  {NULL,         NULL}
+};
+
+static void lcrypt_start_buffer (lua_State *L) {
+  ADD_FUNCTION(L, buffer);
+  (void)luaL_newmetatable(L, "LCRYPT_BUFFER");
+  (void)luaL_register(L, NULL, lcrypt_buffer_flib);
+  lcrypt_set_index(L, lcrypt_buffer_methods, NULL);
+  lua_pop(L, 1);
+}
@@ -0,0 +1,468 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+/*
+ * ChaCha20 (RFC 8439, and the original 8 byte nonce / 64 bit counter variant) and
+ * Poly1305. libtomcrypt 1.17 has neither, so they live here with a portable block
+ * function and SSE2 (4 blocks) / AVX2 (8 blocks) kernels picked at load time.
+ */
+
+typedef struct {
+  uint32_t state[16];           /* constants, key, counter and nonce words */
+  unsigned char keystream[64];
+  unsigned long available;      /* unused bytes at the end of keystream */
+  unsigned long nonce_length;   /* 8 carries the counter into state[13], 12 does not */
+  ulong64 origin;               /* counter the iv set, seek works from it */
+  int exhausted;                /* a 12 byte nonce used counter 2^32 - 1, the keystream must not wrap */
+} lcrypt_chacha20_t;
+
+typedef struct {
+  uint32_t r[5], h[5], pad[4];
+  unsigned char buffer[16];
+  unsigned long leftover;
+} lcrypt_poly1305_t;
+
+typedef struct {
+  lcrypt_chacha20_t chacha;
+  lcrypt_poly1305_t poly;
+  ulong64 aad_length, text_length;
+  int phase;                    /* 0 aad, 1 text, 2 done */
+} lcrypt_chacha20_poly1305_t;
+
+typedef void (*lcrypt_chacha20_kernel_t)(lcrypt_chacha20_t *c, const unsigned char *in, unsigned char *out, unsigned long blocks);
+
+#define CHACHA20_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA20_QR(a, b, c, d)                                   \
+  a += b; d ^= a; d = CHACHA20_ROTL(d, 16);                       \
+  c += d; b ^= c; b = CHACHA20_ROTL(b, 12);                       \
+  a += b; d ^= a; d = CHACHA20_ROTL(d, 8);                        \
+  c += d; b ^= c; b = CHACHA20_ROTL(b, 7);
+
+static void _lcrypt_chacha20_block (const uint32_t *state, unsigned char *out) {
+  uint32_t x[16];
+  int i;
+  memcpy(x, state, sizeof(x));
+  for (i = 0; i < 10; ++i) {
+    CHACHA20_QR(x[0], x[4], x[8],  x[12]);  CHACHA20_QR(x[1], x[5], x[9],  x[13]);
+    CHACHA20_QR(x[2], x[6], x[10], x[14]);  CHACHA20_QR(x[3], x[7], x[11], x[15]);
+    CHACHA20_QR(x[0], x[5], x[10], x[15]);  CHACHA20_QR(x[1], x[6], x[11], x[12]);
+    CHACHA20_QR(x[2], x[7], x[8],  x[13]);  CHACHA20_QR(x[3], x[4], x[9],  x[14]);
+  }
+  for (i = 0; i < 16; ++i) STORE32L(x[i] + state[i], out + 4 * i);
+  zeromem(x, sizeof(x));
+}
+
+#undef CHACHA20_QR
+#undef CHACHA20_ROTL
+
+/* moves the block counter forward, a 12 byte nonce keeps it to 32 bits like RFC 8439 */
+static void lcrypt_chacha20_advance (lcrypt_chacha20_t *c, ulong64 blocks) {
+  if (c->nonce_length == 8) {
+    ulong64 counter = ((ulong64)c->state[13] << 32 | c->state[12]) + blocks;
+    c->state[12] = (uint32_t)(counter & 0xffffffffUL);
+    c->state[13] = (uint32_t)(counter >> 32);
+  } else {
+    ulong64 counter = (ulong64)c->state[12] + blocks;
+    if (counter > 0xffffffffUL) c->exhausted = 1;
+    c->state[12] = (uint32_t)(counter & 0xffffffffUL);
+  }
+}
+
+/* CRYPT_INVALID_ARG when length more bytes would run a 12 byte nonce's counter past 2^32 - 1 */
+static int lcrypt_chacha20_check (const lcrypt_chacha20_t *c, ulong64 length) {
+  ulong64 blocks;
+  if (c->nonce_length == 8 || length <= c->available) return CRYPT_OK;
+  blocks = (length - c->available + 63) / 64;
+  if (c->exhausted || (ulong64)c->state[12] + blocks > 0x100000000ULL) return CRYPT_INVALID_ARG;
+  return CRYPT_OK;
+}
+
+static void _lcrypt_chacha20_portable (lcrypt_chacha20_t *c, const unsigned char *in, unsigned char *out, unsigned long blocks) {
+  unsigned char keystream[64];
+  int i;
+  for (; blocks > 0; --blocks, in += 64, out += 64) {
+    _lcrypt_chacha20_block(c->state, keystream);
+    lcrypt_chacha20_advance(c, 1);
+    for (i = 0; i < 64; ++i) out[i] = in[i] ^ keystream[i];
+  }
+  zeromem(keystream, sizeof(keystream));
+}
+
+#ifdef LCRYPT_X86
+
+/*
+ * The SIMD kernels keep word i of every block in lane j of x[i], block j using counter + j, and transpose
+ * back to whole blocks after the rounds. They only take a batch when the low counter word cannot wrap
+ * inside it, so carrying into the nonce is left to the portable code.
+ */
+
+#define CHACHA20_SSE2_ROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define CHACHA20_SSE2_QR(a, b, c, d)                                                            \
+  a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA20_SSE2_ROTL(d, 16);              \
+  c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA20_SSE2_ROTL(b, 12);              \
+  a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA20_SSE2_ROTL(d, 8);               \
+  c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA20_SSE2_ROTL(b, 7);
+
+#define CHACHA20_XOR_STORE(in, out, offset, v)                                                  \
+  _mm_storeu_si128((__m128i*)((out) + (offset)),                                                \
+    _mm_xor_si128(v, _mm_loadu_si128((const __m128i*)((in) + (offset)))));
+
+LCRYPT_TARGET("sse2") static void _lcrypt_chacha20_sse2 (lcrypt_chacha20_t *c, const unsigned char *in, unsigned char *out, unsigned long blocks) {
+  uint32_t *s = c->state;
+  for (; blocks >= 4 && s[12] <= 0xffffffffUL - 4; blocks -= 4, in += 256, out += 256) {
+    __m128i x[16], o[16];
+    int i;
+    for (i = 0; i < 16; ++i) o[i] = _mm_set1_epi32((int)s[i]);
+    o[12] = _mm_add_epi32(o[12], _mm_set_epi32(3, 2, 1, 0));
+    for (i = 0; i < 16; ++i) x[i] = o[i];
+    for (i = 0; i < 10; ++i) {
+      CHACHA20_SSE2_QR(x[0], x[4], x[8],  x[12]);  CHACHA20_SSE2_QR(x[1], x[5], x[9],  x[13]);
+      CHACHA20_SSE2_QR(x[2], x[6], x[10], x[14]);  CHACHA20_SSE2_QR(x[3], x[7], x[11], x[15]);
+      CHACHA20_SSE2_QR(x[0], x[5], x[10], x[15]);  CHACHA20_SSE2_QR(x[1], x[6], x[11], x[12]);
+      CHACHA20_SSE2_QR(x[2], x[7], x[8],  x[13]);  CHACHA20_SSE2_QR(x[3], x[4], x[9],  x[14]);
+    }
+    for (i = 0; i < 16; i += 4) {
+      __m128i a = _mm_add_epi32(x[i], o[i]),         b = _mm_add_epi32(x[i + 1], o[i + 1]);
+      __m128i d = _mm_add_epi32(x[i + 2], o[i + 2]), e = _mm_add_epi32(x[i + 3], o[i + 3]);
+      __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(d, e);
+      __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(d, e);
+      CHACHA20_XOR_STORE(in, out, 4 * i,       _mm_unpacklo_epi64(t0, t1));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 64,  _mm_unpackhi_epi64(t0, t1));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 128, _mm_unpacklo_epi64(t2, t3));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 192, _mm_unpackhi_epi64(t2, t3));
+    }
+    s[12] += 4;
+  }
+  _lcrypt_chacha20_portable(c, in, out, blocks);
+}
+
+#define CHACHA20_AVX2_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define CHACHA20_AVX2_QR(a, b, c, d)                                                                    \
+  a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = CHACHA20_AVX2_ROTL(d, 16);                \
+  c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA20_AVX2_ROTL(b, 12);                \
+  a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = CHACHA20_AVX2_ROTL(d, 8);                 \
+  c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA20_AVX2_ROTL(b, 7);
+
+LCRYPT_TARGET("avx2") static void _lcrypt_chacha20_avx2 (lcrypt_chacha20_t *c, const unsigned char *in, unsigned char *out, unsigned long blocks) {
+  uint32_t *s = c->state;
+  for (; blocks >= 8 && s[12] <= 0xffffffffUL - 8; blocks -= 8, in += 512, out += 512) {
+    __m256i x[16], o[16];
+    int i;
+    for (i = 0; i < 16; ++i) o[i] = _mm256_set1_epi32((int)s[i]);
+    o[12] = _mm256_add_epi32(o[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    for (i = 0; i < 16; ++i) x[i] = o[i];
+    for (i = 0; i < 10; ++i) {
+      CHACHA20_AVX2_QR(x[0], x[4], x[8],  x[12]);  CHACHA20_AVX2_QR(x[1], x[5], x[9],  x[13]);
+      CHACHA20_AVX2_QR(x[2], x[6], x[10], x[14]);  CHACHA20_AVX2_QR(x[3], x[7], x[11], x[15]);
+      CHACHA20_AVX2_QR(x[0], x[5], x[10], x[15]);  CHACHA20_AVX2_QR(x[1], x[6], x[11], x[12]);
+      CHACHA20_AVX2_QR(x[2], x[7], x[8],  x[13]);  CHACHA20_AVX2_QR(x[3], x[4], x[9],  x[14]);
+    }
+    for (i = 0; i < 16; i += 4) {
+      /* the unpacks work within 128 bit halves, so the low half holds blocks 0-3 and the high half 4-7 */
+      __m256i a = _mm256_add_epi32(x[i], o[i]),         b = _mm256_add_epi32(x[i + 1], o[i + 1]);
+      __m256i d = _mm256_add_epi32(x[i + 2], o[i + 2]), e = _mm256_add_epi32(x[i + 3], o[i + 3]);
+      __m256i t0 = _mm256_unpacklo_epi32(a, b), t1 = _mm256_unpacklo_epi32(d, e);
+      __m256i t2 = _mm256_unpackhi_epi32(a, b), t3 = _mm256_unpackhi_epi32(d, e);
+      __m256i r0 = _mm256_unpacklo_epi64(t0, t1), r1 = _mm256_unpackhi_epi64(t0, t1);
+      __m256i r2 = _mm256_unpacklo_epi64(t2, t3), r3 = _mm256_unpackhi_epi64(t2, t3);
+      CHACHA20_XOR_STORE(in, out, 4 * i,       _mm256_castsi256_si128(r0));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 64,  _mm256_castsi256_si128(r1));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 128, _mm256_castsi256_si128(r2));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 192, _mm256_castsi256_si128(r3));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 256, _mm256_extracti128_si256(r0, 1));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 320, _mm256_extracti128_si256(r1, 1));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 384, _mm256_extracti128_si256(r2, 1));
+      CHACHA20_XOR_STORE(in, out, 4 * i + 448, _mm256_extracti128_si256(r3, 1));
+    }
+    s[12] += 8;
+  }
+  _lcrypt_chacha20_sse2(c, in, out, blocks);
+}
+
+#undef CHACHA20_AVX2_QR
+#undef CHACHA20_AVX2_ROTL
+#undef CHACHA20_XOR_STORE
+#undef CHACHA20_SSE2_QR
+#undef CHACHA20_SSE2_ROTL
+
+#endif
+
+static lcrypt_chacha20_kernel_t lcrypt_chacha20_kernel = _lcrypt_chacha20_portable;
+
+/* picks the widest kernel the cpu has, lcrypt_cpu must be filled in */
+static const char *lcrypt_chacha20_select (void) {
+  #ifdef LCRYPT_X86
+    if (lcrypt_cpu.avx2) {
+      lcrypt_chacha20_kernel = _lcrypt_chacha20_avx2;
+      return "avx2";
+    }
+    if (lcrypt_cpu.sse2) {
+      lcrypt_chacha20_kernel = _lcrypt_chacha20_sse2;
+      return "sse2";
+    }
+  #endif
+  lcrypt_chacha20_kernel = _lcrypt_chacha20_portable;
+  return "portable";
+}
+
+static int lcrypt_chacha20_setiv (lcrypt_chacha20_t *c, const unsigned char *nonce, unsigned long nonce_length, ulong64 counter) {
+  int i;
+  if (nonce_length != 8 && nonce_length != 12) return CRYPT_INVALID_ARG;
+  c->state[12] = (uint32_t)(counter & 0xffffffffUL);
+  if (nonce_length == 8) {
+    c->state[13] = (uint32_t)(counter >> 32);
+    LOAD32L(c->state[14], nonce);
+    LOAD32L(c->state[15], nonce + 4);
+  } else {
+    if (counter > 0xffffffffUL) return CRYPT_INVALID_ARG;
+    for (i = 0; i < 3; ++i) LOAD32L(c->state[13 + i], nonce + 4 * i);
+  }
+  c->nonce_length = nonce_length;
+  c->origin       = counter;
+  c->available    = 0;
+  c->exhausted    = 0;
+  zeromem(c->keystream, sizeof(c->keystream));
+  return CRYPT_OK;
+}
+
+static int lcrypt_chacha20_setup (
+    lcrypt_chacha20_t *c, const unsigned char *key, unsigned long key_length,
+    const unsigned char *nonce, unsigned long nonce_length, ulong64 counter
+  ) {
+  static const unsigned char sigma[16] = "expand 32-byte k";
+  int i;
+  if (key_length != 32) return CRYPT_INVALID_KEYSIZE;
+  for (i = 0; i < 4; ++i) LOAD32L(c->state[i], sigma + 4 * i);
+  for (i = 0; i < 8; ++i) LOAD32L(c->state[4 + i], key + 4 * i);
+  return lcrypt_chacha20_setiv(c, nonce, nonce_length, counter);
+}
+
+/* moves the keystream to offset bytes past the counter the iv set, a 12 byte nonce cannot go past its last block */
+static int lcrypt_chacha20_seek (lcrypt_chacha20_t *c, ulong64 offset) {
+  if (c->nonce_length == 12 && c->origin + (offset + 63) / 64 > 0x100000000ULL) return CRYPT_INVALID_ARG;
+  c->exhausted = 0;
+  c->state[12] = (uint32_t)(c->origin & 0xffffffffUL);
+  if (c->nonce_length == 8) c->state[13] = (uint32_t)(c->origin >> 32);
+  lcrypt_chacha20_advance(c, offset / 64);
+  c->available = 0;
+  if (offset % 64 != 0) {
+    _lcrypt_chacha20_block(c->state, c->keystream);
+    lcrypt_chacha20_advance(c, 1);
+    c->available = 64 - (unsigned long)(offset % 64);
+  }
+  return CRYPT_OK;
+}
+
+/* xors length bytes of keystream in, whole blocks go to the selected kernel */
+static int lcrypt_chacha20_crypt (lcrypt_chacha20_t *c, const unsigned char *in, unsigned char *out, unsigned long length) {
+  unsigned long blocks, i;
+  int err;
+  if ((err = lcrypt_chacha20_check(c, length)) != CRYPT_OK) return err;
+  for (; length > 0 && c->available > 0; --length, --c->available)
+    *out++ = *in++ ^ c->keystream[64 - c->available];
+
+  if ((blocks = length / 64) > 0) {
+    lcrypt_chacha20_kernel(c, in, out, blocks);
+    in += 64 * blocks; out += 64 * blocks; length -= 64 * blocks;
+  }
+
+  if (length > 0) {
+    _lcrypt_chacha20_block(c->state, c->keystream);
+    lcrypt_chacha20_advance(c, 1);
+    for (i = 0; i < length; ++i) out[i] = in[i] ^ c->keystream[i];
+    c->available = 64 - length;
+  }
+  return CRYPT_OK;
+}
+
+/* Poly1305 with 26 bit limbs, after poly1305-donna */
+static void _lcrypt_poly1305_blocks (lcrypt_poly1305_t *p, const unsigned char *m, unsigned long length, uint32_t hibit) {
+  uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+  uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+  uint32_t t0, t1, t2, t3;
+  ulong64 d0, d1, d2, d3, d4, c;
+
+  for (; length >= 16; length -= 16, m += 16) {
+    LOAD32L(t0, m); LOAD32L(t1, m + 4); LOAD32L(t2, m + 8); LOAD32L(t3, m + 12);
+    h0 += t0 & 0x3ffffff;
+    h1 += ((t0 >> 26) | (t1 << 6)) & 0x3ffffff;
+    h2 += ((t1 >> 20) | (t2 << 12)) & 0x3ffffff;
+    h3 += ((t2 >> 14) | (t3 << 18)) & 0x3ffffff;
+    h4 += (t3 >> 8) | hibit;
+
+    d0 = (ulong64)h0 * r0 + (ulong64)h1 * s4 + (ulong64)h2 * s3 + (ulong64)h3 * s2 + (ulong64)h4 * s1;
+    d1 = (ulong64)h0 * r1 + (ulong64)h1 * r0 + (ulong64)h2 * s4 + (ulong64)h3 * s3 + (ulong64)h4 * s2;
+    d2 = (ulong64)h0 * r2 + (ulong64)h1 * r1 + (ulong64)h2 * r0 + (ulong64)h3 * s4 + (ulong64)h4 * s3;
+    d3 = (ulong64)h0 * r3 + (ulong64)h1 * r2 + (ulong64)h2 * r1 + (ulong64)h3 * r0 + (ulong64)h4 * s4;
+    d4 = (ulong64)h0 * r4 + (ulong64)h1 * r3 + (ulong64)h2 * r2 + (ulong64)h3 * r1 + (ulong64)h4 * r0;
+
+    c = d0 >> 26; h0 = (uint32_t)d0 & 0x3ffffff;
+    d1 += c; c = d1 >> 26; h1 = (uint32_t)d1 & 0x3ffffff;
+    d2 += c; c = d2 >> 26; h2 = (uint32_t)d2 & 0x3ffffff;
+    d3 += c; c = d3 >> 26; h3 = (uint32_t)d3 & 0x3ffffff;
+    d4 += c; c = d4 >> 26; h4 = (uint32_t)d4 & 0x3ffffff;
+    h0 += (uint32_t)c * 5;  c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += (uint32_t)c;
+  }
+
+  p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+
+static void lcrypt_poly1305_init (lcrypt_poly1305_t *p, const unsigned char *key) {
+  uint32_t t0, t1, t2, t3;
+  int i;
+  memset(p, 0, sizeof(*p));
+  /* r is clamped as the spec requires */
+  LOAD32L(t0, key); LOAD32L(t1, key + 4); LOAD32L(t2, key + 8); LOAD32L(t3, key + 12);
+  p->r[0] = t0 & 0x3ffffff;
+  p->r[1] = ((t0 >> 26) | (t1 << 6)) & 0x3ffff03;
+  p->r[2] = ((t1 >> 20) | (t2 << 12)) & 0x3ffc0ff;
+  p->r[3] = ((t2 >> 14) | (t3 << 18)) & 0x3f03fff;
+  p->r[4] = (t3 >> 8) & 0x00fffff;
+  for (i = 0; i < 4; ++i) LOAD32L(p->pad[i], key + 16 + 4 * i);
+}
+
+static void lcrypt_poly1305_update (lcrypt_poly1305_t *p, const unsigned char *m, unsigned long length) {
+  if (p->leftover > 0) {
+    unsigned long want = 16 - p->leftover;
+    if (want > length) want = length;
+    memcpy(p->buffer + p->leftover, m, want);
+    p->leftover += want;
+    m += want; length -= want;
+    if (p->leftover < 16) return;
+    _lcrypt_poly1305_blocks(p, p->buffer, 16, 1UL << 24);
+    p->leftover = 0;
+  }
+  if (length >= 16) {
+    _lcrypt_poly1305_blocks(p, m, length & ~15UL, 1UL << 24);
+    m += length & ~15UL; length &= 15;
+  }
+  if (length > 0) {
+    memcpy(p->buffer, m, length);
+    p->leftover = length;
+  }
+}
+
+static void lcrypt_poly1305_finish (lcrypt_poly1305_t *p, unsigned char *mac) {
+  uint32_t h0, h1, h2, h3, h4, g0, g1, g2, g3, g4, c, mask;
+  ulong64 f;
+
+  if (p->leftover > 0) {
+    p->buffer[p->leftover] = 1;
+    memset(p->buffer + p->leftover + 1, 0, 16 - p->leftover - 1);
+    _lcrypt_poly1305_blocks(p, p->buffer, 16, 0);
+  }
+
+  /* fully carry h */
+  h0 = p->h[0]; h1 = p->h[1]; h2 = p->h[2]; h3 = p->h[3]; h4 = p->h[4];
+  c = h1 >> 26; h1 &= 0x3ffffff;
+  h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+  h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+  h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+  h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+  h1 += c;
+
+  /* h - p, picked without branches when it does not go negative */
+  g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  g4 = (h4 + c - (1UL << 26)) & 0xffffffffUL;
+  mask = ((g4 >> 31) - 1) & 0xffffffffUL;
+  g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+  mask = ~mask & 0xffffffffUL;
+  h0 = (h0 & mask) | g0; h1 = (h1 & mask) | g1; h2 = (h2 & mask) | g2;
+  h3 = (h3 & mask) | g3; h4 = (h4 & mask) | g4;
+
+  /* h = (h + pad) % 2^128 */
+  h0 = (h0 | (h1 << 26)) & 0xffffffffUL;
+  h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffffUL;
+  h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffffUL;
+  h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffffUL;
+  f = (ulong64)h0 + p->pad[0];             h0 = (uint32_t)f;
+  f = (ulong64)h1 + p->pad[1] + (f >> 32); h1 = (uint32_t)f;
+  f = (ulong64)h2 + p->pad[2] + (f >> 32); h2 = (uint32_t)f;
+  f = (ulong64)h3 + p->pad[3] + (f >> 32); h3 = (uint32_t)f;
+  STORE32L(h0, mac); STORE32L(h1, mac + 4); STORE32L(h2, mac + 8); STORE32L(h3, mac + 12);
+
+  zeromem(p, sizeof(*p));
+}
+
+/* ChaCha20-Poly1305 AEAD as in RFC 8439, aad first and then the text, both streamed */
+static int lcrypt_chacha20_poly1305_setiv (lcrypt_chacha20_poly1305_t *a, const unsigned char *nonce, unsigned long nonce_length) {
+  unsigned char block[64];
+  int err;
+  if (nonce_length != 12) return CRYPT_INVALID_ARG;
+  if ((err = lcrypt_chacha20_setiv(&a->chacha, nonce, nonce_length, 0)) != CRYPT_OK) return err;
+  /* block 0 keys the MAC, the text starts at block 1 */
+  _lcrypt_chacha20_block(a->chacha.state, block);
+  lcrypt_chacha20_advance(&a->chacha, 1);
+  lcrypt_poly1305_init(&a->poly, block);
+  zeromem(block, sizeof(block));
+  a->aad_length = a->text_length = 0;
+  a->phase = 0;
+  return CRYPT_OK;
+}
+
+static int lcrypt_chacha20_poly1305_setup (
+    lcrypt_chacha20_poly1305_t *a, const unsigned char *key, unsigned long key_length,
+    const unsigned char *nonce, unsigned long nonce_length
+  ) {
+  int err;
+  if (nonce_length != 12) return CRYPT_INVALID_ARG;
+  if ((err = lcrypt_chacha20_setup(&a->chacha, key, key_length, nonce, nonce_length, 0)) != CRYPT_OK) return err;
+  return lcrypt_chacha20_poly1305_setiv(a, nonce, nonce_length);
+}
+
+static void _lcrypt_poly1305_pad16 (lcrypt_poly1305_t *p, ulong64 length) {
+  static const unsigned char zeros[16] = { 0 };
+  if (length % 16 != 0) lcrypt_poly1305_update(p, zeros, 16 - (unsigned long)(length % 16));
+}
+
+static int lcrypt_chacha20_poly1305_aad (lcrypt_chacha20_poly1305_t *a, const unsigned char *aad, unsigned long length) {
+  if (a->phase != 0) return CRYPT_INVALID_ARG;
+  lcrypt_poly1305_update(&a->poly, aad, length);
+  a->aad_length += length;
+  return CRYPT_OK;
+}
+
+static int lcrypt_chacha20_poly1305_crypt (
+    lcrypt_chacha20_poly1305_t *a, const unsigned char *in, unsigned char *out, unsigned long length, int decrypt
+  ) {
+  int err;
+  if (a->phase == 2) return CRYPT_INVALID_ARG;
+  if ((err = lcrypt_chacha20_check(&a->chacha, length)) != CRYPT_OK) return err;
+  if (a->phase == 0) {
+    _lcrypt_poly1305_pad16(&a->poly, a->aad_length);
+    a->phase = 1;
+  }
+  /* the MAC is over the ciphertext, read before in is overwritten when decrypting in place */
+  if (decrypt) lcrypt_poly1305_update(&a->poly, in, length);
+  (void)lcrypt_chacha20_crypt(&a->chacha, in, out, length);
+  if (!decrypt) lcrypt_poly1305_update(&a->poly, out, length);
+  a->text_length += length;
+  return CRYPT_OK;
+}
+
+static int lcrypt_chacha20_poly1305_done (lcrypt_chacha20_poly1305_t *a, unsigned char *tag) {
+  unsigned char lengths[16];
+  if (a->phase == 2) return CRYPT_INVALID_ARG;
+  if (a->phase == 0) _lcrypt_poly1305_pad16(&a->poly, a->aad_length);
+  _lcrypt_poly1305_pad16(&a->poly, a->text_length);
+  STORE64L(a->aad_length, lengths);
+  STORE64L(a->text_length, lengths + 8);
+  lcrypt_poly1305_update(&a->poly, lengths, 16);
+  lcrypt_poly1305_finish(&a->poly, tag);
+  a->phase = 2;
+  return CRYPT_OK;
+}
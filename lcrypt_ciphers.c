@@ -11,15 +11,250 @@
 
 static int lcrypt_max_ciphers = 0;
 
+/* bytes of symmetric_key the schedule of each registered cipher uses, 0 when unknown */
+static size_t lcrypt_cipher_schedule_sizes[TAB_SIZE];
+
+/* every live key, across all Lua states */
+static size_t lcrypt_key_memory_bytes = 0, lcrypt_key_memory_count = 0;
+
+/* a mode state ending in its schedule only needs as much of symmetric_key as the cipher uses */
+#define LCRYPT_KEY_TRIM(type, member, schedule)                                                   \
+  ((offsetof(type, member) + sizeof(symmetric_key) == sizeof(type) && (schedule) != 0)              \
+    ? offsetof(type, member) + (schedule) : sizeof(type))
+
+static size_t _lcrypt_key_data_size (int cipher, int mode) {
+  size_t schedule = (cipher >= 0 && cipher < TAB_SIZE) ? lcrypt_cipher_schedule_sizes[cipher] : 0;
+  switch (mode) {
+    case LCRYPT_MODE_ECB: return LCRYPT_KEY_TRIM(symmetric_ECB, key, schedule);
+    case LCRYPT_MODE_CBC: return LCRYPT_KEY_TRIM(symmetric_CBC, key, schedule);
+    case LCRYPT_MODE_CTR:
+      if (offsetof(lcrypt_ctr_t, state) + sizeof(symmetric_CTR) != sizeof(lcrypt_ctr_t)) return sizeof(lcrypt_ctr_t);
+      return offsetof(lcrypt_ctr_t, state) + LCRYPT_KEY_TRIM(symmetric_CTR, key, schedule);
+    case LCRYPT_MODE_CFB: return LCRYPT_KEY_TRIM(symmetric_CFB, key, schedule);
+    case LCRYPT_MODE_OFB: return LCRYPT_KEY_TRIM(symmetric_OFB, key, schedule);
+    case LCRYPT_MODE_LRW: return sizeof(symmetric_LRW);
+    case LCRYPT_MODE_F8:  return sizeof(symmetric_F8);
+    case LCRYPT_MODE_GCM: return sizeof(gcm_state);
+    case LCRYPT_MODE_CCM: return LCRYPT_KEY_TRIM(lcrypt_ccm_t, key, schedule);
+    case LCRYPT_MODE_EAX: return sizeof(lcrypt_eax_t);
+    case LCRYPT_MODE_OCB: return sizeof(lcrypt_ocb_t);
+    case LCRYPT_MODE_CHACHA20:          return sizeof(lcrypt_chacha20_t);
+    case LCRYPT_MODE_CHACHA20_POLY1305: return sizeof(lcrypt_chacha20_poly1305_t);
+    case LCRYPT_MODE_XTS: return sizeof(lcrypt_xts_t);
+  }
+  return sizeof(((lcrypt_key_t*)NULL)->data);
+}
+
+#undef LCRYPT_KEY_TRIM
+
+/**
+ * Each mode has its own metatable, so its __index only holds the methods of that mode. The registry table
+ * "LCRYPT_KEY" maps every mode to its metatable and every metatable back to its mode.
+ */
+static lcrypt_key_t *_lcrypt_key_test (lua_State *L, int index) {
+  lcrypt_key_t *key = lua_touserdata(L, index);
+  int is_key;
+  if (key == NULL || !lua_getmetatable(L, index)) return NULL;
+  luaL_getmetatable(L, "LCRYPT_KEY");
+  lua_insert(L, -2);
+  lua_rawget(L, -2);
+  is_key = lua_isnumber(L, -1);
+  lua_pop(L, 2);
+  return is_key ? key : NULL;
+}
+
+static lcrypt_key_t *_lcrypt_key_arg (lua_State *L, int index) {
+  lcrypt_key_t *key = _lcrypt_key_test(L, index);
+  if (key == NULL) (void)luaL_typerror(L, index, "LCRYPT_KEY");
+  return key;
+}
+
+/* pushes a zeroed key sized for cipher and mode, its mode is set once the state is ready */
+static lcrypt_key_t *_lcrypt_key_new (lua_State *L, int cipher, int mode) {
+  size_t size = offsetof(lcrypt_key_t, data) + _lcrypt_key_data_size(cipher, mode);
+  lcrypt_key_t *k = lua_newuserdata(L, size);
+  memset(k, 0, size);
+  luaL_getmetatable(L, "LCRYPT_KEY");
+  lua_rawgeti(L, -1, mode);
+  (void)lua_setmetatable(L, -3);
+  lua_pop(L, 1);
+  k->size   = size;
+  k->cipher = cipher;
+  (void)__sync_fetch_and_add(&lcrypt_key_memory_bytes, size);
+  (void)__sync_fetch_and_add(&lcrypt_key_memory_count, 1);
+  return k;
+}
+
+/* 'none', 'pkcs7', 'iso7816' or 'zero' at index, nil meaning none */
+static int _lcrypt_padding (lua_State *L, int index) {
+  const char *padding;
+  if (lua_isnoneornil(L, index)) return LCRYPT_PADDING_NONE;
+  padding = luaL_checkstring(L, index);
+  if (strcmp(padding, "none") == 0)    return LCRYPT_PADDING_NONE;
+  if (strcmp(padding, "pkcs7") == 0)   return LCRYPT_PADDING_PKCS7;
+  if (strcmp(padding, "iso7816") == 0) return LCRYPT_PADDING_ISO7816;
+  if (strcmp(padding, "zero") == 0)    return LCRYPT_PADDING_ZERO;
+  RETURN_STRING_ERROR(L, "Unknown padding");
+}
+
+#define LCRYPT_KEY_CACHE_MAX     4096
+#define LCRYPT_KEY_CACHE_KEY_MAX 128
+
+/**
+ * Process wide cache of keys fresh from their mode's start, before anything depends on the iv, so a hit only
+ * has to set the iv. It is off until lcrypt.key_cache(entries) and shared by every Lua state, hence the lock.
+ */
+typedef struct {
+  int cipher;
+  int mode;
+  unsigned long key_length;
+  unsigned char key[LCRYPT_KEY_CACHE_KEY_MAX];
+  lcrypt_key_t state;
+} lcrypt_key_cache_t;
+
+/* the table and its counters are shared by every Lua state in the process, only touch them under the lock */
+static pthread_mutex_t lcrypt_key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static lcrypt_key_cache_t *lcrypt_key_cache_table = NULL;
+static int lcrypt_key_cache_size = 0, lcrypt_key_cache_used = 0, lcrypt_key_cache_next = 0;
+
+static int _lcrypt_key_cacheable (int mode, unsigned long key_length) {
+  if (key_length > LCRYPT_KEY_CACHE_KEY_MAX) return 0;
+  switch (mode) {
+    case LCRYPT_MODE_ECB: case LCRYPT_MODE_CBC: case LCRYPT_MODE_CTR:
+    case LCRYPT_MODE_CFB: case LCRYPT_MODE_OFB: case LCRYPT_MODE_GCM:
+      return 1;
+  }
+  return 0;
+}
+
+/* copies the cached state of (cipher, mode, key) into k, ctr_mode also has to match for CTR */
+static int _lcrypt_key_cache_get (
+    lcrypt_key_t *k, int cipher, int mode, const unsigned char *key, unsigned long key_length, int ctr_mode
+  ) {
+  int i, found = 0;
+  if (!_lcrypt_key_cacheable(mode, key_length)) return 0;
+  (void)pthread_mutex_lock(&lcrypt_key_cache_lock);
+  for (i = 0; i < lcrypt_key_cache_used && !found; ++i) {
+    lcrypt_key_cache_t *entry = &lcrypt_key_cache_table[i];
+    if (entry->cipher != cipher || entry->mode != mode || entry->key_length != key_length) continue;
+    if (mode == LCRYPT_MODE_CTR && entry->state.data.ctr.state.mode != ctr_mode) continue;
+    if (memcmp(entry->key, key, key_length) != 0) continue;
+    memcpy(&k->data, &entry->state.data, k->size - offsetof(lcrypt_key_t, data));
+    found = 1;
+  }
+  (void)pthread_mutex_unlock(&lcrypt_key_cache_lock);
+  return found;
+}
+
+/* remembers k, replacing the oldest entry once the cache is full */
+static void _lcrypt_key_cache_put (
+    const lcrypt_key_t *k, int cipher, int mode, const unsigned char *key, unsigned long key_length
+  ) {
+  lcrypt_key_cache_t *entry;
+  if (!_lcrypt_key_cacheable(mode, key_length)) return;
+  (void)pthread_mutex_lock(&lcrypt_key_cache_lock);
+  if (lcrypt_key_cache_size > 0) {
+    entry = &lcrypt_key_cache_table[lcrypt_key_cache_next];
+    lcrypt_key_cache_next = (lcrypt_key_cache_next + 1) % lcrypt_key_cache_size;
+    if (lcrypt_key_cache_used < lcrypt_key_cache_size) lcrypt_key_cache_used++;
+    entry->cipher     = cipher;
+    entry->mode       = mode;
+    entry->key_length = key_length;
+    memcpy(entry->key, key, key_length);
+    memcpy(&entry->state, k, k->size);
+  }
+  (void)pthread_mutex_unlock(&lcrypt_key_cache_lock);
+}
+
+/* entries = lcrypt.key_cache([entries]), 0 turns the cache off and wipes it */
+static int lcrypt_key_cache (lua_State *L) {
+  int size;
+  if (lua_isnumber(L, 1) == 1) {
+    int entries = luaL_checkint(L, 1);
+    lcrypt_key_cache_t *cache = NULL;
+    if (entries < 0 || entries > LCRYPT_KEY_CACHE_MAX) RETURN_STRING_ERROR(L, "Cache size must be 0 to %d", LCRYPT_KEY_CACHE_MAX);
+    if (entries > 0) cache = lcrypt_malloc(L, sizeof(lcrypt_key_cache_t) * (size_t)entries);
+    (void)pthread_mutex_lock(&lcrypt_key_cache_lock);
+    if (lcrypt_key_cache_table != NULL) {
+      zeromem(lcrypt_key_cache_table, sizeof(lcrypt_key_cache_t) * (size_t)lcrypt_key_cache_size);
+      free(lcrypt_key_cache_table);
+    }
+    lcrypt_key_cache_table = cache;
+    lcrypt_key_cache_size = entries;
+    lcrypt_key_cache_used = lcrypt_key_cache_next = 0;
+    (void)pthread_mutex_unlock(&lcrypt_key_cache_lock);
+  }
+  (void)pthread_mutex_lock(&lcrypt_key_cache_lock);
+  size = lcrypt_key_cache_size;
+  (void)pthread_mutex_unlock(&lcrypt_key_cache_lock);
+  lua_pushinteger(L, (lua_Integer)size);
+  return 1;
+}
+
+static int _lcrypt_key_setiv (lcrypt_key_t *key, const unsigned char *iv, unsigned long length);
+
+/* lcrypt.key('chacha20', 'stream', key, nonce [, counter]), lcrypt.key('chacha20', 'poly1305', key, nonce [, aad [, tag_length]]) */
+static int _lcrypt_key_chacha20 (lua_State *L) {
+  int mode = LCRYPT_MODE_NONE;
+  size_t key_length = 0, iv_length = 0;
+  const unsigned char *key, *iv;
+  lcrypt_key_t *k;
+
+  if (lua_isnumber(L, 2) == 1) {
+    mode = luaL_checkint(L, 2);
+  } else {
+    const char *m = luaL_checkstring(L, 2);
+    if (strcmp(m, "stream") == 0)
+      mode = LCRYPT_MODE_CHACHA20;
+    else if (strcmp(m, "poly1305") == 0)
+      mode = LCRYPT_MODE_CHACHA20_POLY1305;
+  }
+  if (mode != LCRYPT_MODE_CHACHA20 && mode != LCRYPT_MODE_CHACHA20_POLY1305) RETURN_STRING_ERROR(L, "Unknown mode");
+
+  key = (const unsigned char*)luaL_checklstring(L, 3, &key_length);
+  iv  = (const unsigned char*)luaL_checklstring(L, 4, &iv_length);
+  if (key_length != 32) RETURN_STRING_ERROR(L, "Key must be 32 characters long");
+
+  k = _lcrypt_key_new(L, LCRYPT_CIPHER_CHACHA20, mode);
+  k->key_size   = 32;
+  k->tag_length = 16;
+
+  if (mode == LCRYPT_MODE_CHACHA20) {
+    lua_Number counter = luaL_optnumber(L, 5, 0);
+    if (iv_length != 8 && iv_length != 12) RETURN_STRING_ERROR(L, "Nonce must be 8 or 12 characters long");
+    if (counter < 0 || (iv_length == 12 && counter > 4294967295.0)) RETURN_STRING_ERROR(L, "Counter out of range");
+    (void)lcrypt_check(
+      L, lcrypt_chacha20_setup(&k->data.chacha, key, (unsigned long)key_length, iv, (unsigned long)iv_length, (ulong64)counter)
+    );
+  } else {
+    size_t aad_length = 0;
+    const unsigned char *aad = (const unsigned char*)luaL_optlstring(L, 5, "", &aad_length);
+    lua_Integer tag_length = luaL_optinteger(L, 6, 16);
+    if (iv_length != 12) RETURN_STRING_ERROR(L, "Nonce must be 12 characters long");
+    if (tag_length < 1 || tag_length > 16) RETURN_STRING_ERROR(L, "Tag wrong length");
+    k->tag_length = (unsigned long)tag_length;
+    (void)lcrypt_check(
+      L, lcrypt_chacha20_poly1305_setup(&k->data.chacha_poly, key, (unsigned long)key_length, iv, (unsigned long)iv_length)
+    );
+    (void)lcrypt_check(L, lcrypt_chacha20_poly1305_aad(&k->data.chacha_poly, aad, (unsigned long)aad_length));
+  }
+  k->mode = mode;
+  return 1;
+}
+
 static int lcrypt_key (lua_State *L) {
   int cipher = -1, mode = LCRYPT_MODE_NONE;
   /* get cipher */
   if (lua_isnumber(L, 1) == 1) {
     cipher = luaL_checkint(L, 1);
+  } else if (strcmp(luaL_checkstring(L, 1), "chacha20") == 0) {
+    cipher = LCRYPT_CIPHER_CHACHA20;
   } else {
     cipher = find_cipher(luaL_checkstring(L, 1));
   }
 
+  if (cipher == LCRYPT_CIPHER_CHACHA20) return _lcrypt_key_chacha20(L);
+
   if (cipher < 0 || cipher > lcrypt_max_ciphers) RETURN_STRING_ERROR(L, "Unknown cipher");
 
   /* get mode */
@@ -41,31 +276,66 @@ static int lcrypt_key (lua_State *L) {
       mode = LCRYPT_MODE_LRW;
     else if (strcmp(m, "f8") == 0)
       mode = LCRYPT_MODE_F8;
+    else if (strcmp(m, "gcm") == 0)
+      mode = LCRYPT_MODE_GCM;
+    else if (strcmp(m, "ccm") == 0)
+      mode = LCRYPT_MODE_CCM;
+    else if (strcmp(m, "eax") == 0)
+      mode = LCRYPT_MODE_EAX;
+    else if (strcmp(m, "ocb") == 0)
+      mode = LCRYPT_MODE_OCB;
+    else if (strcmp(m, "xts") == 0)
+      mode = LCRYPT_MODE_XTS;
   }
 
   if(mode <= 0 || mode > LCRYPT_MODE_MAX) RETURN_STRING_ERROR(L, "Unknown mode");
+  if (mode == LCRYPT_MODE_CHACHA20 || mode == LCRYPT_MODE_CHACHA20_POLY1305)
+    RETURN_STRING_ERROR(L, "Mode needs the chacha20 cipher");
 
   {
     size_t key_length = 0, iv_length = 0, extra_length = 0;
     const unsigned char *key = (const unsigned char*)luaL_checklstring(L, 3, &key_length);
     const unsigned char *iv = (const unsigned char*)luaL_optlstring(L, 4, "", &iv_length);
     const unsigned char *extra = (const unsigned char*)luaL_optlstring(L, 5, "", &extra_length);
+    lua_Integer tag_length = luaL_optinteger(L, 6, (lua_Integer)cipher_descriptor[cipher].block_length);
+    int padding = _lcrypt_padding(L, 7);
 
     int klen = key_length;
+    /* XTS takes the data key and the tweak key concatenated */
+    if (mode == LCRYPT_MODE_XTS) klen = (int)(key_length / 2);
     (void)lcrypt_check(L, cipher_descriptor[cipher].keysize(&klen));
+    if (mode == LCRYPT_MODE_XTS && (size_t)klen * 2 != key_length)
+      RETURN_STRING_ERROR(L, "XTS key must be two keys of the same size");
     key_length = klen;
 
     /* prepare result */
-    lcrypt_key_t *k = lua_newuserdata(L, sizeof(lcrypt_key_t));
-    memset(k, 0, sizeof(lcrypt_key_t));
-    luaL_getmetatable(L, "LCRYPT_KEY");
-    (void)lua_setmetatable(L, -2);
-    k->key_size = klen;
+    lcrypt_key_t *k = _lcrypt_key_new(L, cipher, mode);
+    k->key_size   = klen;
+    k->tag_length = (unsigned long)tag_length;
+
+    if (tag_length < 1 || tag_length > (lua_Integer)cipher_descriptor[cipher].block_length)
+      RETURN_STRING_ERROR(L, "Tag wrong length");
+    if (padding != LCRYPT_PADDING_NONE && mode != LCRYPT_MODE_ECB && mode != LCRYPT_MODE_CBC)
+      RETURN_STRING_ERROR(L, "Only ecb and cbc take a padding");
+    k->padding = padding;
 
     #define IV_CHECK(name)                                                          \
       if (iv_length != cipher_descriptor[cipher].block_length)                      \
         RETURN_STRING_ERROR(L, "IV wrong length");                                  \
 
+    /* a cached key already went through the schedule, only the iv (and GCM's aad) are left */
+    {
+      int ctr_mode = (strcmp((char*)extra, "le") == 0) ? CTR_COUNTER_LITTLE_ENDIAN : CTR_COUNTER_BIG_ENDIAN;
+      if ((mode != LCRYPT_MODE_CTR || strcmp((char*)extra, "le") == 0 || strcmp((char*)extra, "be") == 0)
+          && _lcrypt_key_cache_get(k, cipher, mode, key, (unsigned long)key_length, ctr_mode)) {
+        k->mode = mode;
+        if (mode != LCRYPT_MODE_ECB && mode != LCRYPT_MODE_GCM) { IV_CHECK(cached); }
+        if (mode != LCRYPT_MODE_ECB) (void)lcrypt_check(L, _lcrypt_key_setiv(k, iv, (unsigned long)iv_length));
+        if (mode == LCRYPT_MODE_GCM) (void)lcrypt_check(L, gcm_add_aad(&k->data.gcm, extra, (unsigned long)extra_length));
+        return 1;
+      }
+    }
+
     switch (mode) {
       case LCRYPT_MODE_ECB:
         (void) lcrypt_check(L, ecb_start(cipher, key, key_length, 0, &k->data.ecb)); break;
@@ -77,15 +347,16 @@ static int lcrypt_key (lua_State *L) {
         IV_CHECK(ctr);
         if (strcmp((char*)extra, "le") == 0)
           (void) lcrypt_check(
-            L, ctr_start(cipher, iv, key, key_length, 0, CTR_COUNTER_LITTLE_ENDIAN, &k->data.ctr)
+            L, ctr_start(cipher, iv, key, key_length, 0, CTR_COUNTER_LITTLE_ENDIAN, &k->data.ctr.state)
           );
         else if (strcmp((char*)extra, "be") == 0)
           (void) lcrypt_check(
-            L, ctr_start(cipher, iv, key, key_length, 0, CTR_COUNTER_BIG_ENDIAN,    &k->data.ctr)
+            L, ctr_start(cipher, iv, key, key_length, 0, CTR_COUNTER_BIG_ENDIAN,    &k->data.ctr.state)
           );
         else {
           RETURN_STRING_ERROR(L, "Unknown endian");
         }
+        memcpy(k->data.ctr.origin, iv, iv_length);
       } break;
       case LCRYPT_MODE_CFB: {
         IV_CHECK(cfb);
@@ -106,7 +377,46 @@ static int lcrypt_key (lua_State *L) {
           L, f8_start(cipher, iv, key, key_length, extra, extra_length, 0, &k->data.f8)
         );
       } break;
+      case LCRYPT_MODE_GCM: {
+        (void)lcrypt_check(L, gcm_init(&k->data.gcm, cipher, key, (int)key_length));
+        _lcrypt_key_cache_put(k, cipher, mode, key, (unsigned long)key_length);
+        (void)lcrypt_check(L, gcm_add_iv(&k->data.gcm, iv, (unsigned long)iv_length));
+        (void)lcrypt_check(L, gcm_add_aad(&k->data.gcm, extra, (unsigned long)extra_length));
+      } break;
+      case LCRYPT_MODE_CCM: {
+        if (iv_length < 7 || iv_length > 13) RETURN_STRING_ERROR(L, "Nonce must be 7 to 13 characters long");
+        (void)lcrypt_check(L, cipher_descriptor[cipher].setup(key, (int)key_length, 0, &k->data.ccm.key));
+        memcpy(k->data.ccm.nonce, iv, iv_length);
+        k->data.ccm.nonce_length = (unsigned long)iv_length;
+        if (extra_length > 0) {
+          k->data.ccm.aad = lcrypt_malloc(L, extra_length);
+          memcpy(k->data.ccm.aad, extra, extra_length);
+          k->data.ccm.aad_length = (unsigned long)extra_length;
+        }
+      } break;
+      case LCRYPT_MODE_EAX: {
+        if (key_length > LCRYPT_RAW_KEY_MAX) RETURN_STRING_ERROR(L, "Key too long");
+        (void)lcrypt_check(
+          L, eax_init(&k->data.eax.state, cipher, key, key_length, iv, iv_length, extra, extra_length)
+        );
+        memcpy(k->data.eax.key, key, key_length);
+      } break;
+      case LCRYPT_MODE_OCB: {
+        IV_CHECK(ocb);
+        if (extra_length != 0) RETURN_STRING_ERROR(L, "OCB does not take additional data");
+        if (key_length > LCRYPT_RAW_KEY_MAX) RETURN_STRING_ERROR(L, "Key too long");
+        (void)lcrypt_check(L, ocb_init(&k->data.ocb.state, cipher, key, key_length, iv));
+        memcpy(k->data.ocb.key, key, key_length);
+      } break;
+      case LCRYPT_MODE_XTS: {
+        if (iv_length != 0) {
+          IV_CHECK(xts);
+          memcpy(k->data.xts.tweak, iv, iv_length);
+        }
+        (void)lcrypt_check(L, xts_start(cipher, key, key + key_length, key_length, 0, &k->data.xts.xts));
+      } break;
     }
+    if (mode != LCRYPT_MODE_GCM) _lcrypt_key_cache_put(k, cipher, mode, key, (unsigned long)key_length);
     k->mode = mode;
   }
 
@@ -114,82 +424,1256 @@ static int lcrypt_key (lua_State *L) {
   return 1;
 }
 
-static int lcrypt_key_encrypt (lua_State *L) {
-  lcrypt_key_t *key = luaL_checkudata(L, 1, "LCRYPT_KEY");
-  size_t in_length  = 0;
-  const unsigned char *in = (const unsigned char *)luaL_checklstring(L, 2, &in_length);
-  #define STD_CHECK(name)                                                               \
-    if (in_length % cipher_descriptor[key->data.name.cipher].block_length != 0) {       \
-      RETURN_STRING_ERROR(L, "Data length must be a multiple of block size");           \
+static unsigned long _lcrypt_key_block_length (const lcrypt_key_t *key) {
+  if (key->cipher == LCRYPT_CIPHER_CHACHA20) return 64;
+  return (unsigned long)cipher_descriptor[key->cipher].block_length;
+}
+
+static const char *_lcrypt_key_cipher_name (const lcrypt_key_t *key) {
+  if (key->cipher == LCRYPT_CIPHER_CHACHA20) return "chacha20";
+  return cipher_descriptor[key->cipher].name;
+}
+
+static int _lcrypt_key_check (lua_State *L, lcrypt_key_t *key, size_t length) {
+  if ((key->mode == LCRYPT_MODE_ECB || key->mode == LCRYPT_MODE_CBC)
+      && length % cipher_descriptor[key->cipher].block_length != 0)
+    RETURN_STRING_ERROR(L, "Data length must be a multiple of block size");
+  if (key->mode == LCRYPT_MODE_XTS && length < 16)
+    RETURN_STRING_ERROR(L, "Data must be at least one block long");
+  if ((key->mode == LCRYPT_MODE_CCM && key->data.ccm.done) || (key->mode == LCRYPT_MODE_OCB && key->data.ocb.done)
+      || (key->mode == LCRYPT_MODE_CHACHA20_POLY1305 && key->data.chacha_poly.phase == 2))
+    RETURN_STRING_ERROR(L, "Message already processed, set a new iv first");
+  return 0;
+}
+
+/* the AEAD modes tag one message per iv, batches and files would run several records under the same one */
+static int _lcrypt_key_aead (const lcrypt_key_t *key) {
+  switch (key->mode) {
+    case LCRYPT_MODE_GCM: case LCRYPT_MODE_CCM: case LCRYPT_MODE_EAX: case LCRYPT_MODE_OCB:
+    case LCRYPT_MODE_CHACHA20_POLY1305:
+      return 1;
+  }
+  return 0;
+}
+
+/* CCM and OCB finish the message, and compute its tag, in the same call */
+static int _lcrypt_key_ccm (lcrypt_key_t *key, unsigned char *pt, unsigned char *ct, unsigned long length, int direction) {
+  lcrypt_ccm_t *ccm = &key->data.ccm;
+  unsigned long tag_length = key->tag_length;
+  int err;
+  if (ccm->done) return CRYPT_INVALID_ARG;
+  /* the raw key is only read by ccm_memory when no schedule is passed */
+  err = ccm_memory(
+    key->cipher, (const unsigned char*)&ccm->key, (unsigned long)key->key_size, &ccm->key,
+    ccm->nonce, ccm->nonce_length, ccm->aad, ccm->aad_length, pt, length, ct, ccm->tag, &tag_length, direction
+  );
+  if (err == CRYPT_OK) ccm->done = 1;
+  return err;
+}
+
+static int _lcrypt_key_ocb (lcrypt_key_t *key, const unsigned char *in, unsigned char *out, unsigned long length, int decrypt) {
+  lcrypt_ocb_t *ocb = &key->data.ocb;
+  unsigned long block_length = (unsigned long)ocb->state.block_len, tag_length = key->tag_length;
+  int err = CRYPT_OK;
+  if (ocb->done) return CRYPT_INVALID_ARG;
+  for (; length > block_length; length -= block_length, in += block_length, out += block_length) {
+    err = decrypt ? ocb_decrypt(&ocb->state, in, out) : ocb_encrypt(&ocb->state, in, out);
+    if (err != CRYPT_OK) return err;
+  }
+  if (decrypt)
+    err = s_ocb_done(&ocb->state, in, length, out, ocb->tag, &tag_length, 1);
+  else
+    err = ocb_done_encrypt(&ocb->state, in, length, out, ocb->tag, &tag_length);
+  if (err == CRYPT_OK) ocb->done = 1;
+  return err;
+}
+
+static int _lcrypt_key_encrypt (lcrypt_key_t *key, const unsigned char *in, unsigned char *out, unsigned long length) {
+  switch (key->mode) {
+    case LCRYPT_MODE_ECB: return ecb_encrypt(in, out, length, &key->data.ecb);
+    case LCRYPT_MODE_CBC: return cbc_encrypt(in, out, length, &key->data.cbc);
+    case LCRYPT_MODE_CTR: return ctr_encrypt(in, out, length, &key->data.ctr.state);
+    case LCRYPT_MODE_CFB: return cfb_encrypt(in, out, length, &key->data.cfb);
+    case LCRYPT_MODE_OFB: return ofb_encrypt(in, out, length, &key->data.ofb);
+    case LCRYPT_MODE_LRW: return lrw_encrypt(in, out, length, &key->data.lrw);
+    case LCRYPT_MODE_F8:  return f8_encrypt(in, out, length, &key->data.f8);
+    case LCRYPT_MODE_GCM: return gcm_process(&key->data.gcm, (unsigned char*)in, length, out, GCM_ENCRYPT);
+    case LCRYPT_MODE_CCM: return _lcrypt_key_ccm(key, (unsigned char*)in, out, length, CCM_ENCRYPT);
+    case LCRYPT_MODE_EAX: return eax_encrypt(&key->data.eax.state, in, out, length);
+    case LCRYPT_MODE_OCB: return _lcrypt_key_ocb(key, in, out, length, 0);
+    case LCRYPT_MODE_CHACHA20: return lcrypt_chacha20_crypt(&key->data.chacha, in, out, length);
+    case LCRYPT_MODE_CHACHA20_POLY1305: return lcrypt_chacha20_poly1305_crypt(&key->data.chacha_poly, in, out, length, 0);
+    case LCRYPT_MODE_XTS: {
+      unsigned char tweak[16];
+      memcpy(tweak, key->data.xts.tweak, sizeof(tweak));
+      return xts_encrypt(in, length, out, tweak, &key->data.xts.xts);
     }
-  #define STD_ENCRYPT(name)                                                             \
-  {                                                                                     \
-    unsigned char *out = lcrypt_malloc(L, in_length);                                   \
-    int err = name ## _encrypt(in, out, in_length, &key->data.name);                    \
-    if (err != CRYPT_OK) {                                                              \
-      free(out);                                                                        \
-      RETURN_CRYPT_ERROR(L, err);                                                       \
-    }                                                                                   \
-    lua_pushlstring(L, (char*)out, in_length);                                          \
-    free(out);                                                                          \
-    return 1;                                                                           \
   }
+  return CRYPT_INVALID_ARG;
+}
 
+static int _lcrypt_key_decrypt (lcrypt_key_t *key, const unsigned char *in, unsigned char *out, unsigned long length) {
   switch (key->mode) {
-    case LCRYPT_MODE_ECB: STD_CHECK(ecb); STD_ENCRYPT(ecb); break;
-    case LCRYPT_MODE_CBC: STD_CHECK(cbc); STD_ENCRYPT(cbc); break;
-    case LCRYPT_MODE_CTR:                 STD_ENCRYPT(ctr); break;
-    case LCRYPT_MODE_CFB:                 STD_ENCRYPT(cfb); break;
-    case LCRYPT_MODE_OFB:                 STD_ENCRYPT(ofb); break;
-    case LCRYPT_MODE_LRW:                 STD_ENCRYPT(lrw); break;
-    case LCRYPT_MODE_F8:                  STD_ENCRYPT(f8);  break;
-  }
-  #undef STD_CHECK
-  #undef STD_ENCRYPT
+    case LCRYPT_MODE_ECB: return ecb_decrypt(in, out, length, &key->data.ecb);
+    case LCRYPT_MODE_CBC: return cbc_decrypt(in, out, length, &key->data.cbc);
+    case LCRYPT_MODE_CTR: return ctr_decrypt(in, out, length, &key->data.ctr.state);
+    case LCRYPT_MODE_CFB: return cfb_decrypt(in, out, length, &key->data.cfb);
+    case LCRYPT_MODE_OFB: return ofb_decrypt(in, out, length, &key->data.ofb);
+    case LCRYPT_MODE_LRW: return lrw_decrypt(in, out, length, &key->data.lrw);
+    case LCRYPT_MODE_F8:  return f8_decrypt(in, out, length, &key->data.f8);
+    case LCRYPT_MODE_GCM: return gcm_process(&key->data.gcm, out, length, (unsigned char*)in, GCM_DECRYPT);
+    case LCRYPT_MODE_CCM: return _lcrypt_key_ccm(key, out, (unsigned char*)in, length, CCM_DECRYPT);
+    case LCRYPT_MODE_EAX: return eax_decrypt(&key->data.eax.state, in, out, length);
+    case LCRYPT_MODE_OCB: return _lcrypt_key_ocb(key, in, out, length, 1);
+    case LCRYPT_MODE_CHACHA20: return lcrypt_chacha20_crypt(&key->data.chacha, in, out, length);
+    case LCRYPT_MODE_CHACHA20_POLY1305: return lcrypt_chacha20_poly1305_crypt(&key->data.chacha_poly, in, out, length, 1);
+    case LCRYPT_MODE_XTS: {
+      unsigned char tweak[16];
+      memcpy(tweak, key->data.xts.tweak, sizeof(tweak));
+      return xts_decrypt(in, length, out, tweak, &key->data.xts.xts);
+    }
+  }
+  return CRYPT_INVALID_ARG;
+}
+
+typedef int (*lcrypt_key_crypt_t)(lcrypt_key_t*, const unsigned char*, unsigned char*, unsigned long);
+
+typedef struct {
+  lcrypt_key_t *key;
+  lcrypt_key_crypt_t crypt;
+  symmetric_CTR ctr;
+  lcrypt_chacha20_t chacha;
+  const unsigned char *prev;
+  const unsigned char *in;
+  unsigned char *out;
+  unsigned long length;
+  int err;
+} lcrypt_key_job_t;
+
+/* runs blocks through the bare cipher, in one call when it has a multi block (interleaved) implementation */
+static int _lcrypt_ecb_blocks (
+    int cipher, int decrypt, const unsigned char *in, unsigned char *out, unsigned long blocks, symmetric_key *skey
+  ) {
+  unsigned long i, block_length = (unsigned long)cipher_descriptor[cipher].block_length;
+  int err = CRYPT_OK;
+  if (decrypt && cipher_descriptor[cipher].accel_ecb_decrypt != NULL)
+    return cipher_descriptor[cipher].accel_ecb_decrypt(in, out, blocks, skey);
+  if (!decrypt && cipher_descriptor[cipher].accel_ecb_encrypt != NULL)
+    return cipher_descriptor[cipher].accel_ecb_encrypt(in, out, blocks, skey);
+  for (i = 0; i < blocks && err == CRYPT_OK; ++i, in += block_length, out += block_length)
+    err = decrypt ? cipher_descriptor[cipher].ecb_decrypt(in, out, skey) : cipher_descriptor[cipher].ecb_encrypt(in, out, skey);
+  return err;
+}
+
+/* out ^= first block, followed by rest */
+static void _lcrypt_xor_blocks (
+    unsigned char *out, const unsigned char *first, const unsigned char *rest, unsigned long length, unsigned long block_length
+  ) {
+  unsigned long i;
+  for (i = 0; i < block_length && i < length; ++i) out[i] ^= first[i];
+  for (; i < length; ++i) out[i] ^= rest[i - block_length];
+}
+
+/**
+ * CBC and CFB decryption of a whole block slice: every plaintext block only needs two ciphertext blocks,
+ * prev being the one before the slice. The cipher runs over the slice first and the chaining xor after.
+ */
+static int _lcrypt_key_decrypt_slice (lcrypt_key_job_t *job) {
+  lcrypt_key_t *key = job->key;
+  unsigned long block_length = (unsigned long)cipher_descriptor[key->cipher].block_length;
+  unsigned long blocks = job->length / block_length;
+  int err;
+
+  if (key->mode == LCRYPT_MODE_CBC) {
+    if ((err = _lcrypt_ecb_blocks(key->cipher, 1, job->in, job->out, blocks, &key->data.cbc.key)) != CRYPT_OK) return err;
+    _lcrypt_xor_blocks(job->out, job->prev, job->in, job->length, block_length);
+  } else {
+    if ((err = cipher_descriptor[key->cipher].ecb_encrypt(job->prev, job->out, &key->data.cfb.key)) != CRYPT_OK) return err;
+    err = _lcrypt_ecb_blocks(key->cipher, 0, job->in, job->out + block_length, blocks - 1, &key->data.cfb.key);
+    if (err != CRYPT_OK) return err;
+    _lcrypt_xor_blocks(job->out, job->in, job->in + block_length, job->length, block_length);
+  }
+  return CRYPT_OK;
+}
+
+static void *_lcrypt_key_job (void *arg) {
+  lcrypt_key_job_t *job = arg;
+  switch (job->key->mode) {
+    case LCRYPT_MODE_CTR: job->err = ctr_encrypt(job->in, job->out, job->length, &job->ctr); break;
+    case LCRYPT_MODE_CHACHA20: job->err = lcrypt_chacha20_crypt(&job->chacha, job->in, job->out, job->length); break;
+    case LCRYPT_MODE_CBC:
+    case LCRYPT_MODE_CFB: job->err = _lcrypt_key_decrypt_slice(job); break;
+    default:              job->err = job->crypt(job->key, job->in, job->out, job->length); break;
+  }
+  return NULL;
+}
+
+/* moves the counter forward by blocks, carrying exactly like ctr_encrypt increments it */
+static void _lcrypt_ctr_advance (symmetric_CTR *ctr, ulong64 blocks) {
+  int x;
+  if (ctr->mode == CTR_COUNTER_LITTLE_ENDIAN) {
+    for (x = 0; x < ctr->ctrlen && blocks != 0; ++x, blocks >>= 8) {
+      blocks     += ctr->ctr[x];
+      ctr->ctr[x] = (unsigned char)(blocks & 255);
+    }
+  } else {
+    for (x = ctr->blocklen - 1; x >= ctr->ctrlen && blocks != 0; --x, blocks >>= 8) {
+      blocks     += ctr->ctr[x];
+      ctr->ctr[x] = (unsigned char)(blocks & 255);
+    }
+  }
+}
+
+/**
+ * ECB, CTR, ChaCha20 and CBC/CFB decryption have no chaining between blocks, so the data is cut into
+ * block aligned slices run on their own threads. CTR and ChaCha20 slices get a copy of the state with the
+ * counter moved to their first block, CBC/CFB slices chain from the last ciphertext block of the slice before. Afterwards the
+ * key state is exactly what the serial libtomcrypt call would have left.
+ */
+static int _lcrypt_key_run (
+    lcrypt_key_t *key, lcrypt_key_crypt_t crypt, const unsigned char *in, unsigned char *out,
+    unsigned long length, int threads
+  ) {
+  unsigned long block_length = _lcrypt_key_block_length(key), blocks, tail = 0;
+  size_t ctr_size = key->size - offsetof(lcrypt_key_t, data.ctr.state);
+  int i, err = CRYPT_OK, chained = 0;
+  lcrypt_key_job_t *jobs;
+
+  /* a CTR key ends where its cipher's schedule does */
+  if (ctr_size > sizeof(symmetric_CTR)) ctr_size = sizeof(symmetric_CTR);
+  if (threads <= 1) return crypt(key, in, out, length);
+
+  switch (key->mode) {
+    case LCRYPT_MODE_ECB: break;
+    case LCRYPT_MODE_CTR: {
+      /* use up what is left of the current pad so every slice starts on a fresh counter */
+      unsigned long head = (unsigned long)(key->data.ctr.state.blocklen - key->data.ctr.state.padlen);
+      if (head > length) head = length;
+      if (head > 0 && (err = ctr_encrypt(in, out, head, &key->data.ctr.state)) != CRYPT_OK) return err;
+      in += head; out += head; length -= head;
+    } break;
+    case LCRYPT_MODE_CHACHA20: {
+      unsigned long head = key->data.chacha.available;
+      /* checked as a whole, the slices could not report it before the head was used */
+      if ((err = lcrypt_chacha20_check(&key->data.chacha, length)) != CRYPT_OK) return err;
+      if (head > length) head = length;
+      if (head > 0 && (err = lcrypt_chacha20_crypt(&key->data.chacha, in, out, head)) != CRYPT_OK) return err;
+      in += head; out += head; length -= head;
+    } break;
+    case LCRYPT_MODE_CBC:
+      if (crypt != _lcrypt_key_decrypt || in == out) return crypt(key, in, out, length);
+      chained = 1;
+      break;
+    case LCRYPT_MODE_CFB: {
+      /* finish the current register so that slices start with a whole ciphertext block in pad */
+      unsigned long head = (unsigned long)(key->data.cfb.blocklen - key->data.cfb.padlen);
+      if (crypt != _lcrypt_key_decrypt || in == out) return crypt(key, in, out, length);
+      if (key->data.cfb.padlen == 0) head = block_length;
+      if (head > length) head = length;
+      if ((err = cfb_decrypt(in, out, head, &key->data.cfb)) != CRYPT_OK) return err;
+      in += head; out += head; length -= head;
+      tail    = length % block_length;
+      length -= tail;
+      chained = 1;
+    } break;
+    default:
+      return crypt(key, in, out, length);
+  }
+
+  blocks = length / block_length / (unsigned long)threads;
+  if (blocks == 0 || (jobs = malloc(sizeof(lcrypt_key_job_t) * (size_t)threads)) == NULL) {
+    if (!chained || length == 0) return crypt(key, in, out, length + tail);
+    blocks  = length / block_length;
+    threads = 1;
+    if ((jobs = malloc(sizeof(lcrypt_key_job_t))) == NULL) return CRYPT_MEM;
+  }
+
+  for (i = 0; i < threads; ++i) {
+    unsigned long offset = (unsigned long)i * blocks * block_length;
+    jobs[i].key    = key;
+    jobs[i].crypt  = crypt;
+    jobs[i].in     = in + offset;
+    jobs[i].out    = out + offset;
+    jobs[i].length = (i == threads - 1) ? length - offset : blocks * block_length;
+    jobs[i].prev   = (i == 0) ? NULL : in + offset - block_length;
+    if (key->mode == LCRYPT_MODE_CTR) {
+      memcpy(&jobs[i].ctr, &key->data.ctr.state, ctr_size);
+      _lcrypt_ctr_advance(&jobs[i].ctr, (ulong64)i * blocks);
+    }
+    if (key->mode == LCRYPT_MODE_CHACHA20) {
+      jobs[i].chacha = key->data.chacha;
+      lcrypt_chacha20_advance(&jobs[i].chacha, (ulong64)i * blocks);
+    }
+  }
+  if (key->mode == LCRYPT_MODE_CBC) jobs[0].prev = key->data.cbc.IV;
+  if (key->mode == LCRYPT_MODE_CFB) jobs[0].prev = key->data.cfb.pad;
+
+  lcrypt_parallel(_lcrypt_key_job, jobs, sizeof(lcrypt_key_job_t), threads);
+
+  for (i = 0; i < threads && err == CRYPT_OK; ++i) err = jobs[i].err;
+  if (err == CRYPT_OK && key->mode == LCRYPT_MODE_CTR) memcpy(&key->data.ctr.state, &jobs[threads - 1].ctr, ctr_size);
+  if (err == CRYPT_OK && key->mode == LCRYPT_MODE_CHACHA20) key->data.chacha = jobs[threads - 1].chacha;
+  zeromem(jobs, sizeof(lcrypt_key_job_t) * (size_t)threads);
+  free(jobs);
+  if (err != CRYPT_OK) return err;
+
+  switch (key->mode) {
+    case LCRYPT_MODE_CBC: memcpy(key->data.cbc.IV, in + length - block_length, block_length); break;
+    case LCRYPT_MODE_CFB: {
+      /* IV holds the keystream of the last block, pad the last ciphertext block */
+      unsigned long x, last = length - block_length;
+      for (x = 0; x < block_length; ++x) key->data.cfb.IV[x] = out[last + x] ^ in[last + x];
+      memcpy(key->data.cfb.pad, in + last, block_length);
+      key->data.cfb.padlen = (int)block_length;
+      if (tail > 0) err = cfb_decrypt(in + length, out + length, tail, &key->data.cfb);
+    } break;
+  }
+  return err;
+}
+
+/* moves the keystream to offset bytes past the counter the iv set, as if those bytes had been processed */
+static int _lcrypt_ctr_seek (lcrypt_ctr_t *ctr, ulong64 offset) {
+  symmetric_CTR *state = &ctr->state;
+  memcpy(state->ctr, ctr->origin, (size_t)state->blocklen);
+  _lcrypt_ctr_advance(state, offset / (ulong64)state->blocklen);
+  state->padlen = (int)(offset % (ulong64)state->blocklen);
+  return cipher_descriptor[state->cipher].ecb_encrypt(state->ctr, state->pad, &state->key);
+}
+
+/* length of the padding that ends the last decrypted block, or -1 when it is malformed */
+static long _lcrypt_unpad (int padding, const unsigned char *block, unsigned long block_length) {
+  unsigned long i, n = block[block_length - 1];
+  unsigned char diff = 0;
+  switch (padding) {
+    case LCRYPT_PADDING_PKCS7:
+      if (n == 0 || n > block_length) return -1;
+      for (i = block_length - n; i < block_length; ++i) diff |= block[i] ^ (unsigned char)n;
+      return (diff == 0) ? (long)n : -1;
+    case LCRYPT_PADDING_ISO7816:
+      for (n = block_length; n > 0 && block[n - 1] == 0; --n);
+      if (n == 0 || block[n - 1] != 0x80) return -1;
+      return (long)(block_length - n + 1);
+    case LCRYPT_PADDING_ZERO:
+      for (n = block_length; n > 0 && block[n - 1] == 0; --n);
+      return (long)(block_length - n);
+  }
   return 0;
 }
 
-static int lcrypt_key_decrypt (lua_State *L) {
-  lcrypt_key_t *key = luaL_checkudata(L, 1, "LCRYPT_KEY");
+/* the padding a call uses, options.padding over the key's own, modes other than ECB and CBC have none */
+static int _lcrypt_key_padding (lua_State *L, const lcrypt_key_t *key, int options) {
+  int padding = key->padding;
+  if (lua_istable(L, options)) {
+    lua_getfield(L, options, "padding");
+    if (!lua_isnil(L, -1)) padding = _lcrypt_padding(L, -1);
+    lua_pop(L, 1);
+  }
+  if (key->mode != LCRYPT_MODE_ECB && key->mode != LCRYPT_MODE_CBC) return LCRYPT_PADDING_NONE;
+  return padding;
+}
+
+/* how many bytes crypt writes for in_length bytes, padding included */
+static size_t _lcrypt_padded_length (const lcrypt_key_t *key, lcrypt_key_crypt_t crypt, int padding, size_t in_length) {
+  size_t block_length, whole;
+  if (padding == LCRYPT_PADDING_NONE || crypt == _lcrypt_key_decrypt) return in_length;
+  block_length = (size_t)_lcrypt_key_block_length(key);
+  whole        = in_length - in_length % block_length;
+  /* zero padding leaves aligned data alone, the others always add a block */
+  return (padding != LCRYPT_PADDING_ZERO || whole != in_length) ? whole + block_length : in_length;
+}
+
+/* _lcrypt_padded_length once key is checked for in_length bytes, raising when it cannot take them */
+static size_t _lcrypt_key_padded_length (
+    lua_State *L, lcrypt_key_t *key, lcrypt_key_crypt_t crypt, int padding, size_t in_length
+  ) {
+  if (padding == LCRYPT_PADDING_NONE || crypt == _lcrypt_key_decrypt) (void)_lcrypt_key_check(L, key, in_length);
+  if (padding != LCRYPT_PADDING_NONE && crypt == _lcrypt_key_decrypt && in_length == 0 && padding != LCRYPT_PADDING_ZERO)
+    (void)luaL_error(L, "Invalid padding");
+  return _lcrypt_padded_length(key, crypt, padding, in_length);
+}
+
+/* pads the length bytes at data up to padded_length, in place */
+static void _lcrypt_pad (int padding, unsigned char *data, size_t length, size_t padded_length) {
+  memset(data + length, (padding == LCRYPT_PADDING_PKCS7) ? (int)(padded_length - length) : 0, padded_length - length);
+  if (padding == LCRYPT_PADDING_ISO7816 && padded_length > length) data[length] = 0x80;
+}
+
+/**
+ * Runs in through key into the out_length bytes _lcrypt_key_padded_length gave. The whole blocks go straight
+ * from in to out and only the last, partial, block is padded on the stack, so the message is never copied.
+ */
+static int _lcrypt_key_run_padded (
+    lcrypt_key_t *key, lcrypt_key_crypt_t crypt, int padding, const unsigned char *in, size_t in_length,
+    unsigned char *out, size_t out_length, int threads
+  ) {
+  unsigned long block_length = _lcrypt_key_block_length(key), whole = (unsigned long)in_length, tail;
+  unsigned char last[MAXBLOCKSIZE];
+  int err;
+
+  if (out_length > in_length) whole -= whole % block_length;
+  if ((err = _lcrypt_key_run(key, crypt, in, out, whole, threads)) != CRYPT_OK || out_length == whole) return err;
+  tail = (unsigned long)in_length - whole;
+  memcpy(last, in + whole, tail);
+  _lcrypt_pad(padding, last, tail, block_length);
+  err = crypt(key, last, out + whole, block_length);
+  zeromem(last, sizeof(last));
+  return err;
+}
+
+/* what is left of length decrypted bytes at out once the padding is stripped, -1 when it is malformed */
+static long _lcrypt_key_unpadded_length (
+    const lcrypt_key_t *key, lcrypt_key_crypt_t crypt, int padding, const unsigned char *out, size_t length
+  ) {
+  unsigned long block_length = _lcrypt_key_block_length(key);
+  long n;
+  if (crypt != _lcrypt_key_decrypt || padding == LCRYPT_PADDING_NONE || length == 0) return (long)length;
+  if ((n = _lcrypt_unpad(padding, out + length - block_length, block_length)) < 0) return -1;
+  return (long)length - n;
+}
+
+/* decryption strips the padding by shortening the result, neither direction makes a copy of the message */
+static int _lcrypt_key_crypt (lua_State *L, lcrypt_key_crypt_t crypt) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
+  size_t in_length  = 0, out_length;
+  const unsigned char *in = (const unsigned char *)luaL_checklstring(L, 2, &in_length);
+  int threads = lcrypt_threads_option(L, 3, in_length), padding = _lcrypt_key_padding(L, key, 3);
+  unsigned char *out;
+  long length;
+  int err;
+
+  out_length = _lcrypt_key_padded_length(L, key, crypt, padding, in_length);
+  out = lcrypt_malloc(L, out_length);
+  err = _lcrypt_key_run_padded(key, crypt, padding, in, in_length, out, out_length, threads);
+  if (err != CRYPT_OK) {
+    free(out);
+    RETURN_CRYPT_ERROR(L, err);
+  }
+  if ((length = _lcrypt_key_unpadded_length(key, crypt, padding, out, out_length)) < 0) {
+    zeromem(out, out_length);
+    free(out);
+    RETURN_STRING_ERROR(L, "Invalid padding");
+  }
+  lua_pushlstring(L, (char*)out, (size_t)length);
+  free(out);
+  return 1;
+}
+
+/**
+ * Writes straight into a caller owned LCRYPT_BUFFER, so no temporary is allocated, and returns how many bytes
+ * the result is. The range must hold the padded length, decryption wipes the padding it strips.
+ */
+static int _lcrypt_key_crypt_into (lua_State *L, lcrypt_key_crypt_t crypt) {
+  lcrypt_key_t *key  = _lcrypt_key_arg(L, 1);
+  lua_Integer offset = luaL_checkinteger(L, 3);
+  size_t in_length   = 0, out_length;
+  const unsigned char *in = (const unsigned char *)luaL_checklstring(L, 4, &in_length);
+  int threads = lcrypt_threads_option(L, 5, in_length), padding = _lcrypt_key_padding(L, key, 5);
+  unsigned char *out;
+  long length;
+  out_length = _lcrypt_key_padded_length(L, key, crypt, padding, in_length);
+  out        = lcrypt_buffer_range(L, 2, offset, out_length);
+  (void)lcrypt_check(L, _lcrypt_key_run_padded(key, crypt, padding, in, in_length, out, out_length, threads));
+  if ((length = _lcrypt_key_unpadded_length(key, crypt, padding, out, out_length)) < 0)
+    RETURN_STRING_ERROR(L, "Invalid padding");
+  zeromem(out + length, out_length - (size_t)length);
+  lua_pushinteger(L, (lua_Integer)length);
+  return 1;
+}
+
+static int _lcrypt_key_setiv (lcrypt_key_t *key, const unsigned char *iv, unsigned long length) {
+  switch (key->mode) {
+    case LCRYPT_MODE_CBC: return cbc_setiv(iv, length, &key->data.cbc);
+    case LCRYPT_MODE_CTR: {
+      int err = ctr_setiv(iv, length, &key->data.ctr.state);
+      if (err == CRYPT_OK) memcpy(key->data.ctr.origin, iv, length);
+      return err;
+    }
+    case LCRYPT_MODE_CFB: return cfb_setiv(iv, length, &key->data.cfb);
+    case LCRYPT_MODE_OFB: return ofb_setiv(iv, length, &key->data.ofb);
+    case LCRYPT_MODE_LRW: return lrw_setiv(iv, length, &key->data.lrw);
+    case LCRYPT_MODE_F8:  return f8_setiv(iv,  length, &key->data.f8);
+    case LCRYPT_MODE_GCM: {
+      int err;
+      if ((err = gcm_reset(&key->data.gcm)) != CRYPT_OK) return err;
+      if ((err = gcm_add_iv(&key->data.gcm, iv, length)) != CRYPT_OK) return err;
+      return gcm_add_aad(&key->data.gcm, NULL, 0);
+    }
+    case LCRYPT_MODE_CCM: {
+      if (length < 7 || length > 13) return CRYPT_INVALID_ARG;
+      memcpy(key->data.ccm.nonce, iv, length);
+      key->data.ccm.nonce_length = length;
+      key->data.ccm.aad_length   = 0;
+      key->data.ccm.done         = 0;
+      return CRYPT_OK;
+    }
+    /* the header given at setup belongs to the old nonce, like GCM's aad */
+    case LCRYPT_MODE_EAX:
+      return eax_init(&key->data.eax.state, key->cipher, key->data.eax.key, (unsigned long)key->key_size, iv, length, NULL, 0);
+    case LCRYPT_MODE_OCB: {
+      int err;
+      if (length != (unsigned long)cipher_descriptor[key->cipher].block_length) return CRYPT_INVALID_ARG;
+      if ((err = ocb_init(&key->data.ocb.state, key->cipher, key->data.ocb.key, (unsigned long)key->key_size, iv)) != CRYPT_OK)
+        return err;
+      key->data.ocb.done = 0;
+      return CRYPT_OK;
+    }
+    case LCRYPT_MODE_CHACHA20: return lcrypt_chacha20_setiv(&key->data.chacha, iv, length, 0);
+    case LCRYPT_MODE_XTS: {
+      if (length != sizeof(key->data.xts.tweak)) return CRYPT_INVALID_ARG;
+      memcpy(key->data.xts.tweak, iv, length);
+      return CRYPT_OK;
+    }
+    case LCRYPT_MODE_CHACHA20_POLY1305: return lcrypt_chacha20_poly1305_setiv(&key->data.chacha_poly, iv, length);
+  }
+  return CRYPT_INVALID_ARG;
+}
+
+/**
+ * results = key:encrypt_batch(records [, ivs]), offsets, next_offset = key:encrypt_batch(records, ivs, buffer [, offset]).
+ * Each record is padded on its own, decrypted records follow each other in the buffer without their padding.
+ */
+static int _lcrypt_key_crypt_batch (lua_State *L, lcrypt_key_crypt_t crypt) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
+  int i, count, has_ivs, has_buffer, err = CRYPT_OK, bad_padding = 0;
+  size_t length = 0, out_length, max_length = 1, total = 0;
+  lua_Integer offset = 0;
+  unsigned char *out = NULL, *scratch = NULL;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if ((has_ivs = !lua_isnoneornil(L, 3))) luaL_checktype(L, 3, LUA_TTABLE);
+  has_buffer = !lua_isnoneornil(L, 4);
+  count = (int)lua_objlen(L, 2);
+  if (_lcrypt_key_aead(key)) RETURN_STRING_ERROR(L, "Mode authenticates one message at a time, use encrypt and done");
+
+  /* validate everything first, so a bad record raises before the key has changed */
+  for (i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 2, i);
+    if (lua_type(L, -1) != LUA_TSTRING) RETURN_STRING_ERROR(L, "Record %d is not a string", i);
+    length = lua_objlen(L, -1);
+    lua_pop(L, 1);
+    out_length = _lcrypt_key_padded_length(L, key, crypt, key->padding, length);
+    if (has_ivs) {
+      lua_rawgeti(L, 3, i);
+      if (lua_type(L, -1) != LUA_TSTRING) RETURN_STRING_ERROR(L, "IV %d is not a string", i);
+      lua_pop(L, 1);
+    }
+    if (out_length > max_length) max_length = out_length;
+    total += out_length;
+  }
+
+  if (has_buffer) {
+    offset = luaL_optinteger(L, 5, 0);
+    out    = lcrypt_buffer_range(L, 4, offset, total);
+  } else {
+    /* a userdata, so the collector takes it back when one of the pushes below raises */
+    out = scratch = lua_newuserdata(L, max_length);
+  }
+
+  lua_createtable(L, count, 0);
+  for (i = 1; i <= count; ++i) {
+    /* the strings stay referenced by their tables, so they outlive the pops */
+    const unsigned char *in;
+    long result;
+    lua_rawgeti(L, 2, i);
+    in = (const unsigned char*)lua_tolstring(L, -1, &length);
+    lua_pop(L, 1);
+
+    if (has_ivs) {
+      size_t iv_length = 0;
+      const unsigned char *iv;
+      lua_rawgeti(L, 3, i);
+      iv = (const unsigned char*)lua_tolstring(L, -1, &iv_length);
+      lua_pop(L, 1);
+      if ((err = _lcrypt_key_setiv(key, iv, (unsigned long)iv_length)) != CRYPT_OK) break;
+    }
+
+    out_length = _lcrypt_padded_length(key, crypt, key->padding, length);
+    if ((err = _lcrypt_key_run_padded(key, crypt, key->padding, in, length, out, out_length, 1)) != CRYPT_OK) break;
+    if ((result = _lcrypt_key_unpadded_length(key, crypt, key->padding, out, out_length)) < 0) {
+      bad_padding = i;
+      break;
+    }
+
+    if (has_buffer) {
+      zeromem(out + result, out_length - (size_t)result);
+      lua_pushinteger(L, offset);
+      offset += (lua_Integer)result;
+      out    += result;
+    } else {
+      lua_pushlstring(L, (char*)out, (size_t)result);
+    }
+    lua_rawseti(L, -2, i);
+  }
+
+  if (scratch != NULL) zeromem(scratch, max_length);
+  if (err != CRYPT_OK) RETURN_CRYPT_ERROR(L, err);
+  if (bad_padding) RETURN_STRING_ERROR(L, "Invalid padding in record %d", bad_padding);
+  if (has_buffer) {
+    lua_pushinteger(L, offset);
+    return 2;
+  }
+  return 1;
+}
+
+typedef struct {
+  lcrypt_key_t *key;
+  const unsigned char *in;
+  unsigned char *out;
+  unsigned long sector_size;
+  unsigned long sectors;
+  ulong64 first_sector;
+  int decrypt;
+  int err;
+} lcrypt_xts_job_t;
+
+/* each sector is its own XTS data unit, its number little endian in the tweak (IEEE 1619) */
+static void *_lcrypt_xts_job (void *arg) {
+  lcrypt_xts_job_t *job = arg;
+  unsigned char tweak[16];
+  unsigned long i;
+  int x;
+  job->err = CRYPT_OK;
+  for (i = 0; i < job->sectors && job->err == CRYPT_OK; ++i) {
+    ulong64 sector = job->first_sector + i;
+    memset(tweak, 0, sizeof(tweak));
+    for (x = 0; x < 8; ++x, sector >>= 8) tweak[x] = (unsigned char)(sector & 255);
+    if (job->decrypt)
+      job->err = xts_decrypt(job->in, job->sector_size, job->out, tweak, &job->key->data.xts.xts);
+    else
+      job->err = xts_encrypt(job->in, job->sector_size, job->out, tweak, &job->key->data.xts.xts);
+    job->in  += job->sector_size;
+    job->out += job->sector_size;
+  }
+  return NULL;
+}
+
+/* out = key:encrypt_sectors(data, sector_size, first_sector [, options]), sectors are spread over the threads */
+static int _lcrypt_key_crypt_sectors (lua_State *L, int decrypt) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
   size_t in_length  = 0;
   const unsigned char *in = (const unsigned char *)luaL_checklstring(L, 2, &in_length);
-  #define STD_CHECK(name)                                                               \
-    if (in_length % cipher_descriptor[key->data.name.cipher].block_length != 0) {       \
-      RETURN_STRING_ERROR(L, "Data length must be a multiple of block size");           \
+  lua_Integer sector_size = luaL_checkinteger(L, 3);
+  lua_Number first_sector = luaL_checknumber(L, 4);
+  int i, threads = lcrypt_threads_option(L, 5, in_length), err = CRYPT_OK;
+  unsigned long sectors, per_thread;
+  lcrypt_xts_job_t jobs[LCRYPT_THREADS_MAX];
+  unsigned char *out;
+
+  if (key->mode != LCRYPT_MODE_XTS) RETURN_STRING_ERROR(L, "Sectors need an XTS key");
+  if (sector_size < 16) RETURN_STRING_ERROR(L, "Sector size must be at least one block");
+  if (in_length % (size_t)sector_size != 0) RETURN_STRING_ERROR(L, "Data length must be a multiple of sector size");
+  if (first_sector < 0) RETURN_STRING_ERROR(L, "Sector number must not be negative");
+
+  sectors = (unsigned long)(in_length / (size_t)sector_size);
+  if ((unsigned long)threads > sectors) threads = (sectors > 0) ? (int)sectors : 1;
+  per_thread = sectors / (unsigned long)threads;
+  out = lcrypt_malloc(L, in_length + 1);
+
+  for (i = 0; i < threads; ++i) {
+    unsigned long first = (unsigned long)i * per_thread;
+    jobs[i].key          = key;
+    jobs[i].in           = in + (size_t)first * (size_t)sector_size;
+    jobs[i].out          = out + (size_t)first * (size_t)sector_size;
+    jobs[i].sector_size  = (unsigned long)sector_size;
+    jobs[i].sectors      = (i == threads - 1) ? sectors - first : per_thread;
+    jobs[i].first_sector = (ulong64)first_sector + first;
+    jobs[i].decrypt      = decrypt;
+  }
+  lcrypt_parallel(_lcrypt_xts_job, jobs, sizeof(lcrypt_xts_job_t), threads);
+
+  for (i = 0; i < threads && err == CRYPT_OK; ++i) err = jobs[i].err;
+  if (err != CRYPT_OK) {
+    free(out);
+    RETURN_CRYPT_ERROR(L, err);
+  }
+  lua_pushlstring(L, (char*)out, in_length);
+  free(out);
+  return 1;
+}
+
+static int lcrypt_key_encrypt_sectors (lua_State *L) {
+  return _lcrypt_key_crypt_sectors(L, 0);
+}
+
+static int lcrypt_key_decrypt_sectors (lua_State *L) {
+  return _lcrypt_key_crypt_sectors(L, 1);
+}
+
+#define LCRYPT_FILE_CHUNK (1024 * 1024)
+
+/* the crypt job runs a chunk through the key, the io job writes the previous chunk and reads the next one */
+typedef struct {
+  int io;
+  lcrypt_key_t *key;
+  lcrypt_key_crypt_t crypt;
+  int threads;
+  const unsigned char *crypt_in;
+  unsigned char *crypt_out;
+  size_t crypt_length;
+  FILE *in, *out;
+  unsigned char *read_buffer;
+  size_t read_size, read_length;
+  const unsigned char *write_buffer;
+  size_t write_length;
+  int err;      /* libtomcrypt error of the crypt job, errno of the io job */
+} lcrypt_file_job_t;
+
+static void *_lcrypt_file_job (void *arg) {
+  lcrypt_file_job_t *job = arg;
+  if (!job->io) {
+    job->err = CRYPT_OK;
+    if (job->crypt_length > 0)
+      job->err = _lcrypt_key_run(job->key, job->crypt, job->crypt_in, job->crypt_out, (unsigned long)job->crypt_length, job->threads);
+    return NULL;
+  }
+  job->err = 0;
+  job->read_length = 0;
+  if (job->write_length > 0 && fwrite(job->write_buffer, 1, job->write_length, job->out) != job->write_length) {
+    job->err = (errno != 0) ? errno : EIO;
+    return NULL;
+  }
+  if (job->read_buffer != NULL) {
+    job->read_length = fread(job->read_buffer, 1, job->read_size, job->in);
+    if (job->read_length < job->read_size && ferror(job->in)) job->err = (errno != 0) ? errno : EIO;
+  }
+  return NULL;
+}
+
+/* a path is opened with mode, a Lua file handle is used as it is */
+static FILE *_lcrypt_file_open (lua_State *L, int index, const char *mode, int *opened) {
+  FILE *fp;
+  *opened = 0;
+  if (lua_type(L, index) == LUA_TSTRING) {
+    if ((fp = fopen(lua_tostring(L, index), mode)) == NULL) return NULL;
+    /* reads and writes are whole chunks already, stdio buffering would only add a copy */
+    (void)setvbuf(fp, NULL, _IONBF, 0);
+    *opened = 1;
+    return fp;
+  }
+  if ((fp = lgetfile(L, index)) == NULL) errno = EBADF;
+  return fp;
+}
+
+/**
+ * total = key:encrypt_file(in, out [, chunk_size [, options]]), in and out are paths or file handles.
+ * The file goes through four chunk sized buffers however large it is. With options.io_thread the next
+ * chunk is read and the last one written on a second thread while the current one is encrypted.
+ * The last chunk is padded in place, decryption strips the padding before writing it. total is what was written.
+ */
+static int _lcrypt_key_crypt_file (lua_State *L, lcrypt_key_crypt_t crypt) {
+  lcrypt_key_t *key  = _lcrypt_key_arg(L, 1);
+  lua_Integer chunk  = luaL_optinteger(L, 4, LCRYPT_FILE_CHUNK);
+  size_t block_length = 1, length = 0, pending = 0, chunk_size;
+  int in_opened = 0, out_opened = 0, io_thread = 0, threads, cur = 0, err = 0, crypt_err = CRYPT_OK;
+  int padding = _lcrypt_key_padding(L, key, 5), padded = 0, more;
+  const char *message = NULL;
+  unsigned char *memory = NULL, *in_buffer[2], *out_buffer[2];
+  lcrypt_file_job_t jobs[2];
+  lua_Number total = 0;
+  FILE *in, *out;
+
+  if (_lcrypt_key_aead(key)) RETURN_STRING_ERROR(L, "Mode authenticates one message at a time, use encrypt and done");
+  if (key->mode == LCRYPT_MODE_XTS) RETURN_STRING_ERROR(L, "Mode needs the whole message at once and cannot stream");
+  (void)_lcrypt_key_check(L, key, 0);
+  if (chunk < 1 || (size_t)chunk > ((size_t)-1) / 8) RETURN_STRING_ERROR(L, "Chunk size out of range");
+  if (key->mode == LCRYPT_MODE_ECB || key->mode == LCRYPT_MODE_CBC) block_length = _lcrypt_key_block_length(key);
+  chunk_size = (size_t)chunk - (size_t)chunk % block_length;
+  if (chunk_size == 0) chunk_size = block_length;
+
+  if (lua_istable(L, 5)) {
+    lua_getfield(L, 5, "io_thread");
+    io_thread = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  threads = lcrypt_threads_option(L, 5, chunk_size);
+
+  if ((in = _lcrypt_file_open(L, 2, "rb", &in_opened)) == NULL) RETURN_LIBC_ERROR(L);
+  if ((out = _lcrypt_file_open(L, 3, "wb", &out_opened)) == NULL) {
+    err = errno;
+    if (in_opened) (void)fclose(in);
+    RETURN_STRING_ERROR(L, "%s", strerror(err));
+  }
+  #ifdef POSIX_FADV_SEQUENTIAL
+    (void)posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+  #endif
+
+  if (posix_memalign((void**)&memory, 4096, 4 * chunk_size) != 0) {
+    memory = NULL;
+    err = ENOMEM;
+  } else {
+    in_buffer[0]  = memory;                   in_buffer[1]  = memory + chunk_size;
+    out_buffer[0] = memory + 2 * chunk_size;  out_buffer[1] = memory + 3 * chunk_size;
+    length = fread(in_buffer[0], 1, chunk_size, in);
+    if (length < chunk_size && ferror(in)) err = (errno != 0) ? errno : EIO;
+  }
+
+  while (err == 0 && crypt_err == CRYPT_OK && (length > 0 || pending > 0 || (padding != LCRYPT_PADDING_NONE && !padded))) {
+    /* a short read means the end of the input */
+    more = length == chunk_size;
+    if (padding != LCRYPT_PADDING_NONE && !padded && crypt == _lcrypt_key_encrypt && !more) {
+      /* chunk_size is whole blocks, so a short chunk has room for its padding */
+      size_t padded_length = _lcrypt_padded_length(key, crypt, padding, length);
+      _lcrypt_pad(padding, in_buffer[cur], length, padded_length);
+      length = padded_length;
+      padded = 1;
+    }
+    if (padding != LCRYPT_PADDING_NONE && !padded && crypt == _lcrypt_key_decrypt && length == 0) {
+      /* nothing is left to decrypt, so the chunk waiting to be written is the last one */
+      long result = _lcrypt_key_unpadded_length(key, crypt, padding, out_buffer[cur ^ 1], pending);
+      if (result < 0 || (pending == 0 && padding != LCRYPT_PADDING_ZERO)) {
+        message = "Invalid padding";
+        break;
+      }
+      total  -= (lua_Number)(pending - (size_t)result);
+      pending = (size_t)result;
+      padded  = 1;
+    }
+    if (length % block_length != 0) {
+      message = "Data length must be a multiple of block size";
+      break;
+    }
+    memset(jobs, 0, sizeof(jobs));
+    jobs[0].key          = key;
+    jobs[0].crypt        = crypt;
+    jobs[0].threads      = threads;
+    jobs[0].crypt_in     = in_buffer[cur];
+    jobs[0].crypt_out    = out_buffer[cur];
+    jobs[0].crypt_length = length;
+    jobs[1].io           = 1;
+    jobs[1].in           = in;
+    jobs[1].out          = out;
+    jobs[1].write_buffer = out_buffer[cur ^ 1];
+    jobs[1].write_length = pending;
+    jobs[1].read_buffer  = more ? in_buffer[cur ^ 1] : NULL;
+    jobs[1].read_size    = chunk_size;
+
+    if (io_thread) {
+      lcrypt_parallel(_lcrypt_file_job, jobs, sizeof(lcrypt_file_job_t), 2);
+    } else {
+      (void)_lcrypt_file_job(&jobs[0]);
+      if (jobs[0].err == CRYPT_OK) (void)_lcrypt_file_job(&jobs[1]);
+    }
+
+    crypt_err = jobs[0].err;
+    err       = jobs[1].err;
+    total    += (lua_Number)length;
+    pending   = length;
+    length    = jobs[1].read_length;
+    cur      ^= 1;
+  }
+
+  if (memory != NULL) {
+    zeromem(memory, 4 * chunk_size);
+    free(memory);
+  }
+  if (in_opened) (void)fclose(in);
+  if (out_opened) {
+    if (fclose(out) != 0 && err == 0) err = errno;
+  } else if (fflush(out) != 0 && err == 0) {
+    err = errno;
+  }
+
+  if (message != NULL) RETURN_STRING_ERROR(L, "%s", message);
+  if (crypt_err != CRYPT_OK) RETURN_CRYPT_ERROR(L, crypt_err);
+  if (err != 0) RETURN_STRING_ERROR(L, "%s", strerror(err));
+  lua_pushnumber(L, total);
+  return 1;
+}
+
+static int lcrypt_key_encrypt_file (lua_State *L) {
+  return _lcrypt_key_crypt_file(L, _lcrypt_key_encrypt);
+}
+
+static int lcrypt_key_decrypt_file (lua_State *L) {
+  return _lcrypt_key_crypt_file(L, _lcrypt_key_decrypt);
+}
+
+static int lcrypt_key_encrypt (lua_State *L) {
+  return _lcrypt_key_crypt(L, _lcrypt_key_encrypt);
+}
+
+static int lcrypt_key_decrypt (lua_State *L) {
+  return _lcrypt_key_crypt(L, _lcrypt_key_decrypt);
+}
+
+static int lcrypt_key_encrypt_into (lua_State *L) {
+  return _lcrypt_key_crypt_into(L, _lcrypt_key_encrypt);
+}
+
+static int lcrypt_key_decrypt_into (lua_State *L) {
+  return _lcrypt_key_crypt_into(L, _lcrypt_key_decrypt);
+}
+
+static int lcrypt_key_encrypt_batch (lua_State *L) {
+  return _lcrypt_key_crypt_batch(L, _lcrypt_key_encrypt);
+}
+
+static int lcrypt_key_decrypt_batch (lua_State *L) {
+  return _lcrypt_key_crypt_batch(L, _lcrypt_key_decrypt);
+}
+
+/* one record of lcrypt.encrypt_many / decrypt_many */
+typedef struct {
+  lcrypt_key_t *key;
+  symmetric_key *skey;
+  const unsigned char *in;
+  unsigned char *out;
+  unsigned long length;
+  unsigned long blocks;
+  unsigned char *result;
+  unsigned long result_length;
+  int group;
+  int streamed;
+} lcrypt_key_many_t;
+
+#ifdef LCRYPT_X86
+/* CTR first uses up what is left of the current pad, the streams then take the whole blocks */
+static int _lcrypt_key_many_start (lcrypt_key_many_t *m) {
+  if (m->key->mode == LCRYPT_MODE_CTR) {
+    symmetric_CTR *ctr = &m->key->data.ctr.state;
+    unsigned long head = (unsigned long)(ctr->blocklen - ctr->padlen);
+    int err;
+    if (head > m->length) head = m->length;
+    if (head > 0 && (err = ctr_encrypt(m->in, m->out, head, ctr)) != CRYPT_OK) return err;
+    m->in += head; m->out += head; m->length -= head;
+  }
+  m->blocks  = m->length / 16;
+  m->length -= m->blocks * 16;
+  return CRYPT_OK;
+}
+
+/**
+ * Runs every record of group on the AES-NI streams, a free stream taking the next record as soon as one ends.
+ * Only the block cipher is shared, each record's chaining stays in its own key exactly as libtomcrypt keeps it.
+ */
+static int _lcrypt_key_many_streams (lcrypt_key_many_t *records, int count, int group) {
+  lcrypt_key_many_t *stream[LCRYPT_AESNI_STREAMS];
+  symmetric_key *keys[LCRYPT_AESNI_STREAMS];
+  unsigned char x[LCRYPT_AESNI_STREAMS][16], y[LCRYPT_AESNI_STREAMS][16];
+  int active = 0, next = 0, i, j, err;
+
+  for (;;) {
+    while (active < LCRYPT_AESNI_STREAMS && next < count) {
+      lcrypt_key_many_t *m = &records[next++];
+      if (m->group != group) continue;
+      m->group = 0;
+      if ((err = _lcrypt_key_many_start(m)) != CRYPT_OK) return err;
+      if (m->blocks == 0) {
+        if (m->length > 0 && (err = ctr_encrypt(m->in, m->out, m->length, &m->key->data.ctr.state)) != CRYPT_OK) return err;
+        continue;
+      }
+      stream[active] = m;
+      keys[active]   = m->skey;
+      ++active;
+    }
+    if (active == 0) return CRYPT_OK;
+
+    for (i = 0; i < active; ++i) {
+      lcrypt_key_t *key = stream[i]->key;
+      switch (key->mode) {
+        case LCRYPT_MODE_CBC:
+          if (group & 1) {
+            memcpy(x[i], stream[i]->in, 16);
+          } else {
+            for (j = 0; j < 16; ++j) x[i][j] = stream[i]->in[j] ^ key->data.cbc.IV[j];
+          }
+          break;
+        case LCRYPT_MODE_CTR:
+          _lcrypt_ctr_advance(&key->data.ctr.state, 1);
+          memcpy(x[i], key->data.ctr.state.ctr, 16);
+          break;
+        default:
+          memcpy(x[i], stream[i]->in, 16);
+      }
+    }
+
+    lcrypt_aesni_crypt_streams(x, y, keys, active, group >> 1, group & 1);
+
+    for (i = 0; i < active; ++i) {
+      lcrypt_key_many_t *m = stream[i];
+      lcrypt_key_t *key = m->key;
+      switch (key->mode) {
+        case LCRYPT_MODE_CBC:
+          if (group & 1) {
+            for (j = 0; j < 16; ++j) m->out[j] = y[i][j] ^ key->data.cbc.IV[j];
+            memcpy(key->data.cbc.IV, m->in, 16);
+          } else {
+            memcpy(m->out, y[i], 16);
+            memcpy(key->data.cbc.IV, y[i], 16);
+          }
+          break;
+        case LCRYPT_MODE_CTR:
+          memcpy(key->data.ctr.state.pad, y[i], 16);
+          key->data.ctr.state.padlen = 16;
+          for (j = 0; j < 16; ++j) m->out[j] = m->in[j] ^ y[i][j];
+          break;
+        default:
+          memcpy(m->out, y[i], 16);
+      }
+      m->in += 16; m->out += 16;
+      if (--m->blocks > 0) continue;
+      /* done with the whole blocks, a CTR tail goes through libtomcrypt and the stream is free again */
+      if (m->length > 0 && (err = ctr_encrypt(m->in, m->out, m->length, &key->data.ctr.state)) != CRYPT_OK) return err;
+      stream[i] = stream[--active];
+      keys[i]   = keys[active];
+      memcpy(y[i], y[active], 16);
+      --i;
+    }
+  }
+}
+#endif
+
+/**
+ * results = lcrypt.encrypt_many(keys, records [, ivs]), records[i] through keys[i] after setting ivs[i].
+ * A record whose key has a padding is padded in its output first and then encrypted in place there.
+ */
+static int _lcrypt_key_crypt_many (lua_State *L, int decrypt) {
+  lcrypt_key_crypt_t crypt = decrypt ? _lcrypt_key_decrypt : _lcrypt_key_encrypt;
+  lcrypt_key_many_t *records;
+  lcrypt_key_t *key;
+  unsigned char *out;
+  size_t length = 0, out_length, total = 0;
+  int i, count, has_ivs, err = CRYPT_OK, bad_padding = 0;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if ((has_ivs = !lua_isnoneornil(L, 3))) luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+  count = (int)lua_objlen(L, 2);
+
+  /* validate everything first, so a bad record raises before any key has changed */
+  for (i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i);
+    if ((key = _lcrypt_key_test(L, -1)) == NULL) RETURN_STRING_ERROR(L, "Key %d is not a key", i);
+    if (_lcrypt_key_aead(key)) RETURN_STRING_ERROR(L, "Key %d authenticates one message at a time, use encrypt and done", i);
+    lua_rawgeti(L, 2, i);
+    if (lua_type(L, -1) != LUA_TSTRING) RETURN_STRING_ERROR(L, "Record %d is not a string", i);
+    length     = lua_objlen(L, -1);
+    out_length = _lcrypt_key_padded_length(L, key, crypt, key->padding, length);
+    lua_pop(L, 2);
+    if (has_ivs) {
+      lua_rawgeti(L, 3, i);
+      if (lua_type(L, -1) != LUA_TSTRING) RETURN_STRING_ERROR(L, "IV %d is not a string", i);
+      lua_pop(L, 1);
+    }
+    total += out_length;
+  }
+
+  /* the keys seen so far at 4, the records and their output at 5, a userdata the collector frees if a push raises */
+  lua_newtable(L);
+  records = lua_newuserdata(L, sizeof(lcrypt_key_many_t) * (size_t)count + total + 1);
+  out     = (unsigned char*)(records + count);
+
+  /* a key used more than once keeps its order, only its first record may go on the streams */
+  for (i = 0; i < count; ++i) {
+    lcrypt_key_many_t *m = &records[i];
+    int rounds = 0, first;
+    lua_rawgeti(L, 1, i + 1);
+    m->key = lua_touserdata(L, -1);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, 4);
+    first = lua_isnil(L, -1);
+    lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, 4);
+    lua_rawgeti(L, 2, i + 1);
+    m->in = (const unsigned char*)lua_tolstring(L, -1, &length);
+    lua_pop(L, 1);
+    out_length = _lcrypt_padded_length(m->key, crypt, m->key->padding, length);
+    if (out_length != length) {
+      memcpy(out, m->in, length);
+      _lcrypt_pad(m->key->padding, out, length, out_length);
+      m->in = out;
+    }
+    m->out    = m->result = out;
+    m->length = m->result_length = (unsigned long)out_length;
+    out      += out_length;
+    switch (m->key->mode) {
+      case LCRYPT_MODE_ECB: m->skey = &m->key->data.ecb.key;       break;
+      case LCRYPT_MODE_CBC: m->skey = &m->key->data.cbc.key;       break;
+      case LCRYPT_MODE_CTR: m->skey = &m->key->data.ctr.state.key; break;
+      default:              m->skey = NULL;
+    }
+    if (first && m->skey != NULL) rounds = lcrypt_aesni_rounds(m->key->cipher, m->skey);
+    /* streams are grouped by round count and by whether they run the inverse cipher */
+    m->group    = (rounds == 0) ? 0 : rounds * 2 + (decrypt && m->key->mode != LCRYPT_MODE_CTR);
+    m->streamed = m->group != 0;
+  }
+
+  for (i = 0; i < count && err == CRYPT_OK; ++i) {
+    lcrypt_key_many_t *m = &records[i];
+    if (has_ivs && m->key->mode != LCRYPT_MODE_ECB && m->streamed) {
+      size_t iv_length = 0;
+      const unsigned char *iv;
+      lua_rawgeti(L, 3, i + 1);
+      iv = (const unsigned char*)lua_tolstring(L, -1, &iv_length);
+      lua_pop(L, 1);
+      err = _lcrypt_key_setiv(m->key, iv, (unsigned long)iv_length);
+    }
+  }
+
+  #ifdef LCRYPT_X86
+    for (i = 0; i < count && err == CRYPT_OK; ++i)
+      if (records[i].group != 0) err = _lcrypt_key_many_streams(records + i, count - i, records[i].group);
+  #endif
+
+  /* everything else runs one record at a time, in order */
+  for (i = 0; i < count && err == CRYPT_OK; ++i) {
+    lcrypt_key_many_t *m = &records[i];
+    if (m->streamed) continue;
+    if (has_ivs && m->key->mode != LCRYPT_MODE_ECB) {
+      size_t iv_length = 0;
+      const unsigned char *iv;
+      lua_rawgeti(L, 3, i + 1);
+      iv = (const unsigned char*)lua_tolstring(L, -1, &iv_length);
+      lua_pop(L, 1);
+      if ((err = _lcrypt_key_setiv(m->key, iv, (unsigned long)iv_length)) != CRYPT_OK) break;
     }
-  #define STD_DECRYPT(name)                                                             \
-  {                                                                                     \
-    unsigned char *out = lcrypt_malloc(L, in_length);                                   \
-    int err = name ## _decrypt(in, out, in_length, &key->data.name);                    \
-    if (err != CRYPT_OK) {                                                              \
-      free(out);                                                                        \
-      RETURN_CRYPT_ERROR(L, err);                                                       \
-    }                                                                                   \
-    lua_pushlstring(L, (char*)out, in_length);                                          \
-    free(out);                                                                          \
-    return 1;                                                                           \
+    err = crypt(m->key, m->in, m->out, m->length);
   }
 
+  for (i = 0; i < count && err == CRYPT_OK && !bad_padding; ++i) {
+    lcrypt_key_many_t *m = &records[i];
+    long result = _lcrypt_key_unpadded_length(m->key, crypt, m->key->padding, m->result, m->result_length);
+    if (result < 0) bad_padding = i + 1;
+    else m->result_length = (unsigned long)result;
+  }
+
+  if (err != CRYPT_OK || bad_padding) {
+    zeromem(records, sizeof(lcrypt_key_many_t) * (size_t)count + total);
+    if (bad_padding) RETURN_STRING_ERROR(L, "Invalid padding in record %d", bad_padding);
+    RETURN_CRYPT_ERROR(L, err);
+  }
+  lua_createtable(L, count, 0);
+  for (i = 0; i < count; ++i) {
+    lua_pushlstring(L, (char*)records[i].result, (size_t)records[i].result_length);
+    lua_rawseti(L, -2, i + 1);
+  }
+  zeromem(records, sizeof(lcrypt_key_many_t) * (size_t)count + total);
+  return 1;
+}
+
+static int lcrypt_encrypt_many (lua_State *L) {
+  return _lcrypt_key_crypt_many(L, 0);
+}
+
+static int lcrypt_decrypt_many (lua_State *L) {
+  return _lcrypt_key_crypt_many(L, 1);
+}
+
+/* key:seek(offset), random access into a CTR or ChaCha20 stream, F8 chains its blocks and cannot seek */
+static int lcrypt_key_seek (lua_State *L) {
+  lcrypt_key_t *key   = _lcrypt_key_arg(L, 1);
+  lua_Number offset   = luaL_checknumber(L, 2);
+  if (offset < 0) RETURN_STRING_ERROR(L, "Offset must not be negative");
   switch (key->mode) {
-    case LCRYPT_MODE_ECB: STD_CHECK(ecb); STD_DECRYPT(ecb); break;
-    case LCRYPT_MODE_CBC: STD_CHECK(cbc); STD_DECRYPT(cbc); break;
-    case LCRYPT_MODE_CTR:                 STD_DECRYPT(ctr); break;
-    case LCRYPT_MODE_CFB:                 STD_DECRYPT(cfb); break;
-    case LCRYPT_MODE_OFB:                 STD_DECRYPT(ofb); break;
-    case LCRYPT_MODE_LRW:                 STD_DECRYPT(lrw); break;
-    case LCRYPT_MODE_F8:                  STD_DECRYPT(f8);  break;
+    case LCRYPT_MODE_CTR:
+      (void)lcrypt_check(L, _lcrypt_ctr_seek(&key->data.ctr, (ulong64)offset)); break;
+    case LCRYPT_MODE_CHACHA20:
+      (void)lcrypt_check(L, lcrypt_chacha20_seek(&key->data.chacha, (ulong64)offset)); break;
+    default:
+      RETURN_STRING_ERROR(L, "Mode does not support seek");
   }
+  return 0;
+}
 
-  #undef STD_CHECK
-  #undef STD_DECRYPT
+static int lcrypt_key_aad (lua_State *L) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
+  size_t in_length  = 0;
+  const unsigned char *in = (const unsigned char *)luaL_checklstring(L, 2, &in_length);
+  switch (key->mode) {
+    case LCRYPT_MODE_GCM:
+      (void)lcrypt_check(L, gcm_add_aad(&key->data.gcm, in, (unsigned long)in_length)); break;
+    case LCRYPT_MODE_EAX:
+      (void)lcrypt_check(L, eax_addheader(&key->data.eax.state, in, (unsigned long)in_length)); break;
+    case LCRYPT_MODE_CCM: {
+      lcrypt_ccm_t *ccm = &key->data.ccm;
+      unsigned char *aad;
+      if (ccm->done) RETURN_STRING_ERROR(L, "Message already processed, set a new iv first");
+      if ((aad = realloc(ccm->aad, ccm->aad_length + in_length + 1)) == NULL) RETURN_STRING_ERROR(L, "Out of memory");
+      memcpy(aad + ccm->aad_length, in, in_length);
+      ccm->aad         = aad;
+      ccm->aad_length += (unsigned long)in_length;
+    } break;
+    case LCRYPT_MODE_CHACHA20_POLY1305:
+      if (key->data.chacha_poly.phase != 0) RETURN_STRING_ERROR(L, "Additional data must come before the message");
+      (void)lcrypt_check(L, lcrypt_chacha20_poly1305_aad(&key->data.chacha_poly, in, (unsigned long)in_length));
+      break;
+    default:
+      RETURN_STRING_ERROR(L, "Mode does not take additional data");
+  }
   return 0;
 }
 
-static int lcrypt_key_index (lua_State *L) {
-  lcrypt_key_t *key = luaL_checkudata(L, 1, "LCRYPT_KEY");
+/* finishes the message and writes its tag_length bytes of tag */
+static int _lcrypt_key_tag (lua_State *L, lcrypt_key_t *key, unsigned char *tag) {
+  unsigned long tag_length = key->tag_length;
+  switch (key->mode) {
+    case LCRYPT_MODE_GCM: (void)lcrypt_check(L, gcm_done(&key->data.gcm, tag, &tag_length)); break;
+    case LCRYPT_MODE_EAX: (void)lcrypt_check(L, eax_done(&key->data.eax.state, tag, &tag_length)); break;
+    case LCRYPT_MODE_CCM:
+      if (!key->data.ccm.done) RETURN_STRING_ERROR(L, "No message processed");
+      memcpy(tag, key->data.ccm.tag, tag_length);
+      break;
+    case LCRYPT_MODE_OCB:
+      if (!key->data.ocb.done) RETURN_STRING_ERROR(L, "No message processed");
+      memcpy(tag, key->data.ocb.tag, tag_length);
+      break;
+    case LCRYPT_MODE_CHACHA20_POLY1305: {
+      unsigned char full[16];
+      if (key->data.chacha_poly.phase == 2) RETURN_STRING_ERROR(L, "Tag already computed, set a new iv first");
+      (void)lcrypt_check(L, lcrypt_chacha20_poly1305_done(&key->data.chacha_poly, full));
+      memcpy(tag, full, tag_length);
+    } break;
+    default:
+      RETURN_STRING_ERROR(L, "Mode does not produce a tag");
+  }
+  return (int)tag_length;
+}
+
+static int lcrypt_key_done (lua_State *L) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
+  unsigned char tag[MAXBLOCKSIZE];
+  int tag_length = _lcrypt_key_tag(L, key, tag);
+  lua_pushlstring(L, (char*)tag, (size_t)tag_length);
+  return 1;
+}
+
+static int lcrypt_key_verify (lua_State *L) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
+  size_t in_length  = 0;
+  const unsigned char *in = (const unsigned char *)luaL_checklstring(L, 2, &in_length);
+  unsigned char tag[MAXBLOCKSIZE], diff = 0;
+  int i, tag_length = _lcrypt_key_tag(L, key, tag);
+  /* constant time compare */
+  for (i = 0; i < tag_length && (size_t)i < in_length; ++i) diff |= tag[i] ^ in[i];
+  lua_pushboolean(L, diff == 0 && in_length == (size_t)tag_length);
+  return 1;
+}
+
+/* copy = key:clone([iv]), the copy shares nothing, so a new iv for it leaves key where it was */
+static int lcrypt_key_clone (lua_State *L) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
+  size_t iv_length  = 0;
+  const unsigned char *iv = (const unsigned char *)luaL_optlstring(L, 2, NULL, &iv_length);
+  lcrypt_key_t *k;
+  if (iv != NULL && key->mode == LCRYPT_MODE_ECB) RETURN_STRING_ERROR(L, "Mode does not take an iv");
+  k = _lcrypt_key_new(L, key->cipher, key->mode);
+  memcpy(k, key, key->size);
+  if (key->mode == LCRYPT_MODE_CCM) k->data.ccm.aad = NULL;
+  if (key->mode == LCRYPT_MODE_CCM && key->data.ccm.aad != NULL) {
+    k->data.ccm.aad = lcrypt_malloc(L, key->data.ccm.aad_length + 1);
+    memcpy(k->data.ccm.aad, key->data.ccm.aad, key->data.ccm.aad_length);
+  }
+  if (iv != NULL) (void)lcrypt_check(L, _lcrypt_key_setiv(k, iv, (unsigned long)iv_length));
+  return 1;
+}
+
+/* the computed fields of a key, lcrypt_index tries the methods of its mode first */
+static int lcrypt_key_properties (lua_State *L) {
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
   const char *index = luaL_checkstring(L, 2);
-  if (strcmp(index, "encrypt") == 0)  { lua_pushcfunction(L, lcrypt_key_encrypt);       return 1; }
-  if (strcmp(index, "decrypt") == 0)  { lua_pushcfunction(L, lcrypt_key_decrypt);       return 1; }
+  if (strcmp(index, "memory") == 0)   { lua_pushinteger(L, (lua_Integer)key->size);    return 1; }
   if (strcmp(index, "key_size") == 0) { lua_pushinteger(L, (lua_Integer)key->key_size); return 1; }
 
   #define STD_INDEX(_name)                                                                         \
@@ -198,90 +1682,162 @@ static int lcrypt_key_index (lua_State *L) {
       return 1;                                                                                    \
     }                                                                                              \
     if (strcmp(index, "block_size") == 0) {                                                        \
-      lua_pushinteger(L, (lua_Integer)cipher_descriptor[key->data._name.cipher].block_length);     \
+      lua_pushinteger(L, (lua_Integer)_lcrypt_key_block_length(key));                              \
       return 1;                                                                                    \
     }                                                                                              \
     if (strcmp(index, "cipher") == 0) {                                                            \
-      lua_pushstring(L, cipher_descriptor[key->data._name.cipher].name);                           \
+      lua_pushstring(L, _lcrypt_key_cipher_name(key));                                             \
       return 1;                                                                                    \
     }                                                                                              \
 
-  #define IV_INDEX(name)                                                                           \
+  #define IV_INDEX(name) IV_INDEX_OF(name, name)
+  #define IV_INDEX_OF(name, member)                                                                \
     if(strcmp(index, "iv") == 0) {                                                                 \
       unsigned char iv[MAXBLOCKSIZE];                                                              \
       unsigned long length = MAXBLOCKSIZE;                                                         \
       memset(iv, 0, sizeof(iv));                                                                   \
-      (void)lcrypt_check(L, name ## _getiv(iv, &length, &key->data.name));                         \
+      (void)lcrypt_check(L, name ## _getiv(iv, &length, &key->data.member));                       \
       lua_pushlstring(L, (char*)iv, (size_t)length);                                               \
       return 1;                                                                                    \
     }                                                                                              \
 
+  #define AEAD_INDEX                                                                               \
+    if (strcmp(index, "tag_size") == 0)   { lua_pushinteger(L, (lua_Integer)key->tag_length); return 1; } \
+
+  #define PADDING_INDEX                                                                            \
+    if (strcmp(index, "padding") == 0) {                                                           \
+      static const char *paddings[] = {"none", "pkcs7", "iso7816", "zero"};                        \
+      lua_pushstring(L, paddings[key->padding]);                                                   \
+      return 1;                                                                                    \
+    }                                                                                              \
+
   switch (key->mode) {
-    case LCRYPT_MODE_ECB: STD_INDEX(ecb);                break;
-    case LCRYPT_MODE_CBC: STD_INDEX(cbc); IV_INDEX(cbc); break;
-    case LCRYPT_MODE_CTR: STD_INDEX(ctr); IV_INDEX(ctr); break;
+    case LCRYPT_MODE_ECB: STD_INDEX(ecb);                PADDING_INDEX; break;
+    case LCRYPT_MODE_CBC: STD_INDEX(cbc); IV_INDEX(cbc); PADDING_INDEX; break;
+    case LCRYPT_MODE_CTR: STD_INDEX(ctr); IV_INDEX_OF(ctr, ctr.state); break;
     case LCRYPT_MODE_CFB: STD_INDEX(cfb); IV_INDEX(cfb); break;
     case LCRYPT_MODE_OFB: STD_INDEX(ofb); IV_INDEX(ofb); break;
     case LCRYPT_MODE_LRW: STD_INDEX(lrw); IV_INDEX(lrw); break;
     case LCRYPT_MODE_F8:  STD_INDEX(f8);  IV_INDEX(f8);  break;
+    case LCRYPT_MODE_GCM: STD_INDEX(gcm); AEAD_INDEX;    break;
+    case LCRYPT_MODE_CCM: STD_INDEX(ccm); AEAD_INDEX;    break;
+    case LCRYPT_MODE_EAX: STD_INDEX(eax); AEAD_INDEX;    break;
+    case LCRYPT_MODE_OCB: STD_INDEX(ocb); AEAD_INDEX;    break;
+    case LCRYPT_MODE_CHACHA20:          STD_INDEX(stream);   break;
+    case LCRYPT_MODE_CHACHA20_POLY1305: STD_INDEX(poly1305); AEAD_INDEX; break;
+    case LCRYPT_MODE_XTS: {
+      STD_INDEX(xts);
+      if (strcmp(index, "iv") == 0) {
+        lua_pushlstring(L, (char*)key->data.xts.tweak, sizeof(key->data.xts.tweak));
+        return 1;
+      }
+    } break;
   }
 
+  #undef PADDING_INDEX
+  #undef AEAD_INDEX
   #undef STD_INDEX
   #undef IV_INDEX
+  #undef IV_INDEX_OF
   return 0;
 }
 
+/* bytes, count = lcrypt.key_memory(), what every live key takes, key.memory is the size of one */
+static int lcrypt_key_memory (lua_State *L) {
+  lua_pushnumber(L, (lua_Number)lcrypt_key_memory_bytes);
+  lua_pushnumber(L, (lua_Number)lcrypt_key_memory_count);
+  return 2;
+}
+
+static const struct luaL_Reg lcrypt_key_methods[] = {
+  {"encrypt",       &lcrypt_key_encrypt},
+  {"decrypt",       &lcrypt_key_decrypt},
+  {"encrypt_into",  &lcrypt_key_encrypt_into},
+  {"decrypt_into",  &lcrypt_key_decrypt_into},
+  {"encrypt_batch", &lcrypt_key_encrypt_batch},
+  {"decrypt_batch", &lcrypt_key_decrypt_batch},
+  {"encrypt_file",  &lcrypt_key_encrypt_file},
+  {"decrypt_file",  &lcrypt_key_decrypt_file},
+  {"clone",         &lcrypt_key_clone},
+  {NULL,            NULL}
+};
+
+static const struct luaL_Reg lcrypt_key_aead_methods[] = {
+  {"aad",    &lcrypt_key_aad},
+  {"done",   &lcrypt_key_done},
+  {"verify", &lcrypt_key_verify},
+  {NULL,     NULL}
+};
+
+static const struct luaL_Reg lcrypt_key_seek_methods[] = {
+  {"seek", &lcrypt_key_seek},
+  {NULL,   NULL}
+};
+
+static const struct luaL_Reg lcrypt_key_xts_methods[] = {
+  {"encrypt_sectors", &lcrypt_key_encrypt_sectors},
+  {"decrypt_sectors", &lcrypt_key_decrypt_sectors},
+  {NULL,              NULL}
+};
+
 static int lcrypt_key_newindex (lua_State *L) {
-  lcrypt_key_t *key = luaL_checkudata(L, 1, "LCRYPT_KEY");
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
   const char *index = luaL_checkstring(L, 2);
   size_t v_length = 0;
-  const unsigned char *v = (const unsigned char *)luaL_checklstring(L, 3, &v_length);
-
-  if (strcmp(index, "iv") == 0) {
-    switch (key->mode) {
-      case LCRYPT_MODE_CBC:
-        (void) lcrypt_check(L, cbc_setiv(v, (unsigned long)v_length, &key->data.cbc)); break;
-      case LCRYPT_MODE_CTR:
-        (void) lcrypt_check(L, ctr_setiv(v, (unsigned long)v_length, &key->data.ctr)); break;
-      case LCRYPT_MODE_CFB:
-        (void) lcrypt_check(L, cfb_setiv(v, (unsigned long)v_length, &key->data.cfb)); break;
-      case LCRYPT_MODE_OFB:
-        (void) lcrypt_check(L, ofb_setiv(v, (unsigned long)v_length, &key->data.ofb)); break;
-      case LCRYPT_MODE_LRW:
-        (void) lcrypt_check(L, lrw_setiv(v, (unsigned long)v_length, &key->data.lrw)); break;
-      case LCRYPT_MODE_F8:
-        (void) lcrypt_check(L, f8_setiv(v,  (unsigned long)v_length, &key->data.f8));  break;
-    }
+  const unsigned char *v;
+
+  if (strcmp(index, "padding") == 0) {
+    int padding = _lcrypt_padding(L, 3);
+    if (key->mode != LCRYPT_MODE_ECB && key->mode != LCRYPT_MODE_CBC) RETURN_STRING_ERROR(L, "Only ecb and cbc take a padding");
+    key->padding = padding;
+    return 0;
   }
 
+  v = (const unsigned char *)luaL_checklstring(L, 3, &v_length);
+  if (strcmp(index, "iv") == 0 && key->mode != LCRYPT_MODE_ECB)
+    (void)lcrypt_check(L, _lcrypt_key_setiv(key, v, (unsigned long)v_length));
+
   return 0;
 }
 
 static int lcrypt_key_gc (lua_State *L) {
-  lcrypt_key_t *key = luaL_checkudata(L, 1, "LCRYPT_KEY");
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
+  if (key->size != 0) {
+    (void)__sync_fetch_and_sub(&lcrypt_key_memory_bytes, key->size);
+    (void)__sync_fetch_and_sub(&lcrypt_key_memory_count, 1);
+  }
   switch (key->mode) {
     case LCRYPT_MODE_ECB: (void)lcrypt_check(L, ecb_done(&key->data.ecb)); break;
     case LCRYPT_MODE_CBC: (void)lcrypt_check(L, cbc_done(&key->data.cbc)); break;
-    case LCRYPT_MODE_CTR: (void)lcrypt_check(L, ctr_done(&key->data.ctr)); break;
+    case LCRYPT_MODE_CTR: (void)lcrypt_check(L, ctr_done(&key->data.ctr.state)); break;
     case LCRYPT_MODE_CFB: (void)lcrypt_check(L, cfb_done(&key->data.cfb)); break;
     case LCRYPT_MODE_OFB: (void)lcrypt_check(L, ofb_done(&key->data.ofb)); break;
     case LCRYPT_MODE_LRW: (void)lcrypt_check(L, lrw_done(&key->data.lrw)); break;
     case LCRYPT_MODE_F8:  (void)lcrypt_check(L, f8_done(&key->data.f8));   break;
+    case LCRYPT_MODE_GCM: cipher_descriptor[key->cipher].done(&key->data.gcm.K); break;
+    case LCRYPT_MODE_CCM: {
+      cipher_descriptor[key->cipher].done(&key->data.ccm.key);
+      free(key->data.ccm.aad);
+    } break;
+    case LCRYPT_MODE_EAX: (void)lcrypt_check(L, ctr_done(&key->data.eax.state.ctr)); break;
+    case LCRYPT_MODE_OCB: cipher_descriptor[key->cipher].done(&key->data.ocb.state.key); break;
+    case LCRYPT_MODE_XTS: xts_done(&key->data.xts.xts); break;
   }
 
+  if (key->mode >= LCRYPT_MODE_GCM) zeromem(&key->data, key->size - offsetof(lcrypt_key_t, data));
   key->mode     = LCRYPT_MODE_NONE;
   key->key_size = 0;
+  key->size     = 0;
   return 0;
 }
 
 static int lcrypt_key_size (lua_State *L) {
-  lcrypt_key_t *key = luaL_checkudata(L, 1, "LCRYPT_KEY");
+  lcrypt_key_t *key = _lcrypt_key_arg(L, 1);
   lua_pushinteger(L, key->key_size);
   return 0;
 }
 
 static const struct luaL_Reg lcrypt_key_flib[] = {
-  {"__index",    &lcrypt_key_index},
   {"__newindex", &lcrypt_key_newindex},
   {"__gc",       &lcrypt_key_gc},
   {"__len",      &lcrypt_key_size},
@@ -289,27 +1845,65 @@ static const struct luaL_Reg lcrypt_key_flib[] = {
 };
 
 static void lcrypt_start_ciphers (lua_State *L) {
+  const char *aes_implementation = NULL, *chacha20_implementation = lcrypt_chacha20_select();
+  const struct ltc_cipher_descriptor *aes_cipher = lcrypt_aes_desc(&aes_implementation);
+  int mode;
   ADD_FUNCTION(L, key);
+  ADD_FUNCTION(L, key_cache);
+  ADD_FUNCTION(L, key_memory);
+  ADD_FUNCTION(L, encrypt_many);
+  ADD_FUNCTION(L, decrypt_many);
   (void)luaL_newmetatable(L, "LCRYPT_KEY");
-  (void)luaL_register(L, NULL, lcrypt_key_flib);
+  for (mode = LCRYPT_MODE_ECB; mode <= LCRYPT_MODE_MAX; ++mode) {
+    lua_newtable(L);
+    (void)luaL_register(L, NULL, lcrypt_key_flib);
+    lua_pushliteral(L, "__index");
+    lua_newtable(L);
+    lcrypt_add_methods(L, lcrypt_key_methods);
+    switch (mode) {
+      case LCRYPT_MODE_GCM: case LCRYPT_MODE_CCM: case LCRYPT_MODE_EAX:
+      case LCRYPT_MODE_OCB: case LCRYPT_MODE_CHACHA20_POLY1305:
+        lcrypt_add_methods(L, lcrypt_key_aead_methods); break;
+      case LCRYPT_MODE_CTR: case LCRYPT_MODE_CHACHA20:
+        lcrypt_add_methods(L, lcrypt_key_seek_methods); break;
+      case LCRYPT_MODE_XTS:
+        lcrypt_add_methods(L, lcrypt_key_xts_methods); break;
+    }
+    lua_pushcfunction(L, lcrypt_key_properties);
+    lua_pushcclosure(L, lcrypt_index, 2);
+    lua_rawset(L, -3);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, mode);
+    lua_pushinteger(L, mode);
+    lua_rawset(L, -3);
+  }
   lua_pop(L, 1);
   lua_pushstring(L, "ciphers");
   lua_newtable(L);
-  #define ADD_CIPHER(L, name)                                     \
+  #define ADD_CIPHER_DESC(L, name, desc, schedule)                \
   {                                                               \
-    int c = register_cipher(&name ## _desc);                      \
+    int c = register_cipher(desc);                                \
     if(c > lcrypt_max_ciphers) lcrypt_max_ciphers = c;            \
+    if(c >= 0 && c < TAB_SIZE)                                    \
+      lcrypt_cipher_schedule_sizes[c] = schedule;                 \
     lua_pushstring(L, #name);                                     \
     lua_pushinteger(L, c);                                        \
     lua_settable(L, -3);                                          \
   }
+  #define ADD_CIPHER(L, name) ADD_CIPHER_DESC(L, name, &name ## _desc, sizeof(struct name ## _key))
   ADD_CIPHER(L, blowfish);  ADD_CIPHER(L, xtea);    ADD_CIPHER(L, rc2);     ADD_CIPHER(L, rc5);
-  ADD_CIPHER(L, rc6);       ADD_CIPHER(L, saferp);  ADD_CIPHER(L, aes);     ADD_CIPHER(L, twofish);
+  ADD_CIPHER(L, rc6);       ADD_CIPHER(L, saferp);  ADD_CIPHER_DESC(L, aes, aes_cipher, sizeof(struct rijndael_key));  ADD_CIPHER(L, twofish);
   ADD_CIPHER(L, des);       ADD_CIPHER(L, des3);    ADD_CIPHER(L, cast5);   ADD_CIPHER(L, noekeon);
   ADD_CIPHER(L, skipjack);  ADD_CIPHER(L, anubis);  ADD_CIPHER(L, khazad);  ADD_CIPHER(L, kseed);
   ADD_CIPHER(L, kasumi);
+  lua_pushstring(L, "chacha20");
+  lua_pushinteger(L, LCRYPT_CIPHER_CHACHA20);
+  lua_settable(L, -3);
   #undef ADD_CIPHER
+  #undef ADD_CIPHER_DESC
   lua_settable(L, -3);
+  lcrypt_set_implementation(L, "aes", aes_implementation);
+  lcrypt_set_implementation(L, "chacha20", chacha20_implementation);
 
   #define ADD_MODE(name, value)                                   \
   {                                                               \
@@ -321,7 +1915,10 @@ static void lcrypt_start_ciphers (lua_State *L) {
   lua_newtable(L);
   ADD_MODE(ecb, LCRYPT_MODE_ECB);  ADD_MODE(cbc, LCRYPT_MODE_CBC);  ADD_MODE(ctr, LCRYPT_MODE_CTR);
   ADD_MODE(cfb, LCRYPT_MODE_CFB);  ADD_MODE(ofb, LCRYPT_MODE_OFB);  ADD_MODE(f8,  LCRYPT_MODE_F8);
-  ADD_MODE(lrw, LCRYPT_MODE_LRW);
+  ADD_MODE(lrw, LCRYPT_MODE_LRW);  ADD_MODE(gcm, LCRYPT_MODE_GCM);  ADD_MODE(ccm, LCRYPT_MODE_CCM);
+  ADD_MODE(eax, LCRYPT_MODE_EAX);  ADD_MODE(ocb, LCRYPT_MODE_OCB);
+  ADD_MODE(xts, LCRYPT_MODE_XTS);
+  ADD_MODE(stream, LCRYPT_MODE_CHACHA20);  ADD_MODE(poly1305, LCRYPT_MODE_CHACHA20_POLY1305);
   #undef ADD_MODE
   lua_settable(L, -3);
 }
@@ -15,20 +15,89 @@
 #define LCRYPT_MODE_OFB   5
 #define LCRYPT_MODE_LRW   6
 #define LCRYPT_MODE_F8    7
+#define LCRYPT_MODE_GCM   8
+#define LCRYPT_MODE_CCM   9
+#define LCRYPT_MODE_EAX   10
+#define LCRYPT_MODE_OCB   11
+#define LCRYPT_MODE_CHACHA20          12
+#define LCRYPT_MODE_CHACHA20_POLY1305 13
+#define LCRYPT_MODE_XTS   14
 
-#define LCRYPT_MODE_MAX   7
+#define LCRYPT_MODE_MAX   14
 
+/* block padding of ECB and CBC encrypt/decrypt */
+#define LCRYPT_PADDING_NONE    0
+#define LCRYPT_PADDING_PKCS7   1
+#define LCRYPT_PADDING_ISO7816 2
+#define LCRYPT_PADDING_ZERO    3
+
+/* ChaCha20 is not a libtomcrypt cipher, keys using it carry this instead of a descriptor index */
+#define LCRYPT_CIPHER_CHACHA20 -2
+
+/* CCM needs the whole message up front, so the nonce and aad are kept until encrypt/decrypt */
+typedef struct {
+  unsigned char nonce[16];
+  unsigned long nonce_length;
+  unsigned char *aad;
+  unsigned long aad_length;
+  unsigned char tag[16];
+  int done;
+  symmetric_key key;
+} lcrypt_ccm_t;
+
+/* origin is the counter the iv set, seek works from it */
+typedef struct {
+  unsigned char origin[MAXBLOCKSIZE];
+  symmetric_CTR state;
+} lcrypt_ctr_t;
+
+/* eax_init and ocb_init only take the raw key, so it is kept for the next iv */
+#define LCRYPT_RAW_KEY_MAX 128
+
+typedef struct {
+  eax_state state;
+  unsigned char key[LCRYPT_RAW_KEY_MAX];
+} lcrypt_eax_t;
+
+typedef struct {
+  ocb_state state;
+  unsigned char key[LCRYPT_RAW_KEY_MAX];
+  unsigned char tag[MAXBLOCKSIZE];
+  int done;
+} lcrypt_ocb_t;
+
+/* the tweak is the iv of plain encrypt/decrypt, encrypt_sectors derives it from the sector number */
+typedef struct {
+  symmetric_xts xts;
+  unsigned char tweak[16];
+} lcrypt_xts_t;
+
+/**
+ * Keys are allocated only as large as their mode needs, and when the schedule is the last member of the mode
+ * state, as large as their cipher's schedule, so data is only valid up to size bytes into the userdata.
+ */
 typedef struct {
+  size_t size;
   int mode;
   int key_size;
+  int cipher;
+  int padding;
+  unsigned long tag_length;
   union {
     symmetric_ECB ecb;
     symmetric_CBC cbc;
-    symmetric_CTR ctr;
+    lcrypt_ctr_t  ctr;
     symmetric_CFB cfb;
     symmetric_OFB ofb;
     symmetric_LRW lrw;
     symmetric_F8  f8;
+    gcm_state     gcm;
+    lcrypt_ccm_t  ccm;
+    lcrypt_eax_t  eax;
+    lcrypt_ocb_t  ocb;
+    lcrypt_chacha20_t chacha;
+    lcrypt_chacha20_poly1305_t chacha_poly;
+    lcrypt_xts_t  xts;
   } data;
 } lcrypt_key_t;
 
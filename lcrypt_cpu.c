@@ -0,0 +1,80 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define LCRYPT_X86
+  #include <cpuid.h>
+  #include <immintrin.h>
+  #define LCRYPT_TARGET(features) __attribute__((target(features)))
+#endif
+
+typedef struct {
+  int sse2, ssse3, sse41, sse42, pclmul, aesni, avx, avx2, bmi2, sha;
+} lcrypt_cpu_t;
+
+static lcrypt_cpu_t lcrypt_cpu;
+
+static void lcrypt_cpu_detect (void) {
+  memset(&lcrypt_cpu, 0, sizeof(lcrypt_cpu));
+  #ifdef LCRYPT_X86
+  {
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0, max = __get_cpuid_max(0, NULL);
+    if (max >= 1 && __get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0) {
+      lcrypt_cpu.sse2   = (int)((edx >> 26) & 1);
+      lcrypt_cpu.pclmul = (int)((ecx >> 1)  & 1);
+      lcrypt_cpu.ssse3  = (int)((ecx >> 9)  & 1);
+      lcrypt_cpu.sse41  = (int)((ecx >> 19) & 1);
+      lcrypt_cpu.sse42  = (int)((ecx >> 20) & 1);
+      lcrypt_cpu.aesni  = (int)((ecx >> 25) & 1);
+      /* AVX needs the OS to save the ymm registers as well, see XCR0 */
+      if (((ecx >> 27) & 1) != 0 && ((ecx >> 28) & 1) != 0) {
+        unsigned int xcr0 = 0, xcr0_high = 0;
+        __asm__ volatile ("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+        lcrypt_cpu.avx = (xcr0 & 6) == 6;
+      }
+    }
+    if (max >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      lcrypt_cpu.avx2 = lcrypt_cpu.avx && ((ebx >> 5) & 1) != 0;
+      lcrypt_cpu.bmi2 = (int)((ebx >> 8) & 1);
+      lcrypt_cpu.sha  = (int)((ebx >> 29) & 1);
+    }
+  }
+  #endif
+}
+
+static void lcrypt_start_cpu (lua_State *L) {
+  lcrypt_cpu_detect();
+  lua_pushstring(L, "cpu");
+  lua_newtable(L);
+  #define ADD_FEATURE(L, name)                                    \
+  {                                                               \
+    lua_pushstring(L, #name);                                     \
+    lua_pushboolean(L, lcrypt_cpu.name);                          \
+    lua_settable(L, -3);                                          \
+  }
+  ADD_FEATURE(L, sse2);    ADD_FEATURE(L, ssse3);   ADD_FEATURE(L, sse41);   ADD_FEATURE(L, sse42);
+  ADD_FEATURE(L, pclmul);  ADD_FEATURE(L, aesni);   ADD_FEATURE(L, avx);     ADD_FEATURE(L, avx2);
+  ADD_FEATURE(L, bmi2);    ADD_FEATURE(L, sha);
+  #undef ADD_FEATURE
+  lua_settable(L, -3);
+
+  /* filled in by the cipher and hash registration with the implementation picked for each name */
+  lua_pushstring(L, "implementations");
+  lua_newtable(L);
+  lua_settable(L, -3);
+}
+
+/* records which implementation backs name in lcrypt.implementations, the module table must be on top */
+static void lcrypt_set_implementation (lua_State *L, const char *name, const char *implementation) {
+  lua_getfield(L, -1, "implementations");
+  lua_pushstring(L, implementation);
+  lua_setfield(L, -2, name);
+  lua_pop(L, 1);
+}
@@ -0,0 +1,188 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+/*
+ * CRC32C (Castagnoli, reflected polynomial 0x82f63b78) with a portable slicing by 8 kernel and an SSE4.2
+ * one. The crc32 instruction has a latency of three but can start one every cycle, so the SSE4.2 kernel
+ * runs three streams over neighbouring blocks and shifts the first two over the bytes that follow them.
+ * Shifting a crc over n zero bytes is a multiplication by x^(8n) modulo the polynomial, which is also what
+ * combining the crcs of two chunks needs.
+ */
+
+#define LCRYPT_CRC32C_POLY   0x82f63b78UL
+#define LCRYPT_CRC32C_LONG   8192     /* bytes per stream, larger blocks make the shift cheaper per byte */
+#define LCRYPT_CRC32C_SHORT  256
+
+typedef uint32_t (*lcrypt_crc32c_kernel_t)(uint32_t crc, const unsigned char *in, size_t length);
+
+static uint32_t lcrypt_crc32c_table[8][256];
+static uint32_t lcrypt_crc32c_x2n[32];                /* x^(2^n) modulo the polynomial */
+static uint32_t lcrypt_crc32c_long[4][256], lcrypt_crc32c_short[4][256];
+
+/* a * b modulo the polynomial, bit 31 is x^0 */
+static uint32_t _lcrypt_crc32c_multiply (uint32_t a, uint32_t b) {
+  uint32_t m = 0x80000000UL, p = 0;
+  for (;;) {
+    if ((a & m) != 0) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ LCRYPT_CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/* x^(8 * length) modulo the polynomial */
+static uint32_t _lcrypt_crc32c_zeros (ulong64 length) {
+  uint32_t p = 0x80000000UL;
+  int k = 3;
+  while (length != 0) {
+    if (length & 1) p = _lcrypt_crc32c_multiply(lcrypt_crc32c_x2n[k & 31], p);
+    length >>= 1;
+    ++k;
+  }
+  return p;
+}
+
+/* the crc register shifted by the bytes the tables were made for, one lookup per byte */
+static uint32_t _lcrypt_crc32c_shift (uint32_t table[4][256], uint32_t crc) {
+  return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+static void _lcrypt_crc32c_shift_table (uint32_t table[4][256], ulong64 length) {
+  uint32_t op = _lcrypt_crc32c_zeros(length);
+  int i, n;
+  for (i = 0; i < 4; ++i) {
+    for (n = 0; n < 256; ++n) table[i][n] = _lcrypt_crc32c_multiply(op, (uint32_t)n << (8 * i));
+  }
+}
+
+static uint32_t _lcrypt_crc32c_portable (uint32_t crc, const unsigned char *in, size_t length) {
+  crc = ~crc;
+  while (length >= 8) {
+    crc ^= (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+    crc = lcrypt_crc32c_table[7][crc & 0xff] ^ lcrypt_crc32c_table[6][(crc >> 8) & 0xff] ^
+          lcrypt_crc32c_table[5][(crc >> 16) & 0xff] ^ lcrypt_crc32c_table[4][crc >> 24] ^
+          lcrypt_crc32c_table[3][in[4]] ^ lcrypt_crc32c_table[2][in[5]] ^
+          lcrypt_crc32c_table[1][in[6]] ^ lcrypt_crc32c_table[0][in[7]];
+    in += 8;
+    length -= 8;
+  }
+  while (length-- > 0) crc = (crc >> 8) ^ lcrypt_crc32c_table[0][(crc ^ *in++) & 0xff];
+  return ~crc;
+}
+
+#if defined(LCRYPT_X86) && defined(__x86_64__)
+
+LCRYPT_TARGET("sse4.2") static uint32_t _lcrypt_crc32c_sse42 (uint32_t crc, const unsigned char *in, size_t length) {
+  ulong64 crc0 = ~crc, crc1, crc2, word;
+  const unsigned char *end;
+
+  while (length > 0 && ((size_t)in & 7) != 0) {
+    crc0 = _mm_crc32_u8((uint32_t)crc0, *in++);
+    --length;
+  }
+
+  #define CRC32C_STREAMS(block, table)                                                          \
+    while (length >= 3 * (block)) {                                                             \
+      crc1 = 0;                                                                                 \
+      crc2 = 0;                                                                                 \
+      end = in + (block);                                                                       \
+      do {                                                                                      \
+        memcpy(&word, in, 8);                 crc0 = _mm_crc32_u64(crc0, word);                 \
+        memcpy(&word, in + (block), 8);       crc1 = _mm_crc32_u64(crc1, word);                 \
+        memcpy(&word, in + 2 * (block), 8);   crc2 = _mm_crc32_u64(crc2, word);                 \
+        in += 8;                                                                                \
+      } while (in < end);                                                                       \
+      crc0 = _lcrypt_crc32c_shift(table, (uint32_t)crc0) ^ crc1;                                \
+      crc0 = _lcrypt_crc32c_shift(table, (uint32_t)crc0) ^ crc2;                                \
+      in += 2 * (block);                                                                        \
+      length -= 3 * (block);                                                                    \
+    }
+  CRC32C_STREAMS(LCRYPT_CRC32C_LONG, lcrypt_crc32c_long)
+  CRC32C_STREAMS(LCRYPT_CRC32C_SHORT, lcrypt_crc32c_short)
+  #undef CRC32C_STREAMS
+
+  while (length >= 8) {
+    memcpy(&word, in, 8);
+    crc0 = _mm_crc32_u64(crc0, word);
+    in += 8;
+    length -= 8;
+  }
+  while (length-- > 0) crc0 = _mm_crc32_u8((uint32_t)crc0, *in++);
+  return ~(uint32_t)crc0;
+}
+
+#endif
+
+static lcrypt_crc32c_kernel_t lcrypt_crc32c_kernel = _lcrypt_crc32c_portable;
+
+/* fills in the tables and picks the kernel, lcrypt_cpu must be filled in */
+static const char *lcrypt_crc32c_select (void) {
+  uint32_t crc;
+  int i, n;
+
+  for (n = 0; n < 256; ++n) {
+    crc = (uint32_t)n;
+    for (i = 0; i < 8; ++i) crc = (crc & 1) ? (crc >> 1) ^ LCRYPT_CRC32C_POLY : crc >> 1;
+    lcrypt_crc32c_table[0][n] = crc;
+  }
+  for (n = 0; n < 256; ++n) {
+    for (i = 1; i < 8; ++i) lcrypt_crc32c_table[i][n] = (lcrypt_crc32c_table[i - 1][n] >> 8) ^ lcrypt_crc32c_table[0][lcrypt_crc32c_table[i - 1][n] & 0xff];
+  }
+  lcrypt_crc32c_x2n[0] = 0x40000000UL;
+  for (i = 1; i < 32; ++i) lcrypt_crc32c_x2n[i] = _lcrypt_crc32c_multiply(lcrypt_crc32c_x2n[i - 1], lcrypt_crc32c_x2n[i - 1]);
+
+  #if defined(LCRYPT_X86) && defined(__x86_64__)
+    if (lcrypt_cpu.sse42) {
+      _lcrypt_crc32c_shift_table(lcrypt_crc32c_long, LCRYPT_CRC32C_LONG);
+      _lcrypt_crc32c_shift_table(lcrypt_crc32c_short, LCRYPT_CRC32C_SHORT);
+      lcrypt_crc32c_kernel = _lcrypt_crc32c_sse42;
+      return "sse42";
+    }
+  #endif
+  lcrypt_crc32c_kernel = _lcrypt_crc32c_portable;
+  return "portable";
+}
+
+/* a running crc argument, nil is the crc of no data */
+static uint32_t _lcrypt_crc_arg (lua_State *L, int index) {
+  lua_Number crc = luaL_optnumber(L, index, 0);
+  if (!(crc >= 0 && crc <= 4294967295.0) || crc != (lua_Number)(uint32_t)crc) (void)luaL_argerror(L, index, "not a crc");
+  return (uint32_t)crc;
+}
+
+/* a length argument of crc32_combine and crc32c_combine */
+static ulong64 _lcrypt_crc_length (lua_State *L, int index) {
+  lua_Number length = luaL_checknumber(L, index);
+  if (!(length >= 0 && length <= 9007199254740992.0)) (void)luaL_argerror(L, index, "length out of range");
+  return (ulong64)length;
+}
+
+/* crc = lcrypt.crc32c(data [, crc]), crc continues a previous call */
+static int lcrypt_crc32c (lua_State *L) {
+  size_t length = 0;
+  const unsigned char *in = (const unsigned char*)luaL_checklstring(L, 1, &length);
+  lua_pushnumber(L, (lua_Number)lcrypt_crc32c_kernel(_lcrypt_crc_arg(L, 2), in, length));
+  return 1;
+}
+
+/* crc = lcrypt.crc32c_combine(crc_a, crc_b, length_b), the crc of a followed by b */
+static int lcrypt_crc32c_combine (lua_State *L) {
+  uint32_t a = _lcrypt_crc_arg(L, 1), b = _lcrypt_crc_arg(L, 2);
+  lua_pushnumber(L, (lua_Number)(_lcrypt_crc32c_multiply(_lcrypt_crc32c_zeros(_lcrypt_crc_length(L, 3)), a) ^ b));
+  return 1;
+}
+
+static void lcrypt_start_crc (lua_State *L) {
+  lcrypt_set_implementation(L, "crc32c", lcrypt_crc32c_select());
+  ADD_FUNCTION(L, crc32c);
+  ADD_FUNCTION(L, crc32c_combine);
+}
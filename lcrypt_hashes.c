@@ -16,76 +16,247 @@
 
 static int lcrypt_max_hashes = 0;
 
+/* BLAKE2b, BLAKE2s and BLAKE3 are not libtomcrypt hashes, hashes using them carry these past the descriptor indexes */
+#define LCRYPT_HASH_BLAKE2B (TAB_SIZE + 0)
+#define LCRYPT_HASH_BLAKE2S (TAB_SIZE + 1)
+#define LCRYPT_HASH_BLAKE3  (TAB_SIZE + 2)
+
+typedef union {
+  hash_state tomcrypt;
+  lcrypt_blake2b_t blake2b;
+  lcrypt_blake2s_t blake2s;
+  lcrypt_blake3_t blake3;
+} lcrypt_hash_state_t;
+
 typedef struct {
+  size_t size;                  /* of the userdata, a hash only gets the state it uses */
   int mode;
   union {
     struct {
       int hash;
-      hash_state state;
+      lcrypt_hash_state_t state;
     } hash;
     hmac_state hmac;
     omac_state omac;
   } data;
 } lcrypt_hash_t;
 
-static int _lcrypt_hash_add (lua_State *L, lcrypt_hash_t *h) {
-  size_t in_length = 0;
-  const unsigned char *in = (const unsigned char*)luaL_optlstring(L, 2, "", &in_length);
+static int lcrypt_hash_valid (int hash) {
+  return (hash >= 0 && hash <= lcrypt_max_hashes) || hash == LCRYPT_HASH_BLAKE2B || hash == LCRYPT_HASH_BLAKE2S || hash == LCRYPT_HASH_BLAKE3;
+}
+
+static int _lcrypt_find_hash (const char *name) {
+  if (strcmp(name, "blake2b") == 0) return LCRYPT_HASH_BLAKE2B;
+  if (strcmp(name, "blake2s") == 0) return LCRYPT_HASH_BLAKE2S;
+  if (strcmp(name, "blake3") == 0)  return LCRYPT_HASH_BLAKE3;
+  return find_hash(name);
+}
+
+static const char *_lcrypt_hash_name (int hash) {
+  switch (hash) {
+    case LCRYPT_HASH_BLAKE2B: return "blake2b";
+    case LCRYPT_HASH_BLAKE2S: return "blake2s";
+    case LCRYPT_HASH_BLAKE3:  return "blake3";
+  }
+  return hash_descriptor[hash].name;
+}
+
+static unsigned long _lcrypt_hash_length (int hash) {
+  switch (hash) {
+    case LCRYPT_HASH_BLAKE2B: return 64;
+    case LCRYPT_HASH_BLAKE2S: return 32;
+    case LCRYPT_HASH_BLAKE3:  return 32;
+  }
+  return hash_descriptor[hash].hashsize;
+}
+
+static size_t _lcrypt_hash_state_size (int hash) {
+  switch (hash) {
+    case LCRYPT_HASH_BLAKE2B: return sizeof(lcrypt_blake2b_t);
+    case LCRYPT_HASH_BLAKE2S: return sizeof(lcrypt_blake2s_t);
+    case LCRYPT_HASH_BLAKE3:  return sizeof(lcrypt_blake3_t);
+  }
+  return sizeof(hash_state);
+}
+
+/* key is only used by the BLAKE hashes, threads only by BLAKE3 */
+static int _lcrypt_hash_init (int hash, lcrypt_hash_state_t *s, const unsigned char *key, unsigned long key_length) {
+  switch (hash) {
+    case LCRYPT_HASH_BLAKE2B: return lcrypt_blake2b_init(&s->blake2b, key, key_length);
+    case LCRYPT_HASH_BLAKE2S: return lcrypt_blake2s_init(&s->blake2s, key, key_length);
+    case LCRYPT_HASH_BLAKE3:  return lcrypt_blake3_init(&s->blake3, key, key_length);
+  }
+  return hash_descriptor[hash].init(&s->tomcrypt);
+}
+
+static int _lcrypt_hash_process (int hash, lcrypt_hash_state_t *s, const unsigned char *in, unsigned long length, int threads) {
+  switch (hash) {
+    case LCRYPT_HASH_BLAKE2B: return lcrypt_blake2b_process(&s->blake2b, in, length);
+    case LCRYPT_HASH_BLAKE2S: return lcrypt_blake2s_process(&s->blake2s, in, length);
+    case LCRYPT_HASH_BLAKE3:  return lcrypt_blake3_process(&s->blake3, in, length, threads);
+  }
+  return hash_descriptor[hash].process(&s->tomcrypt, in, length);
+}
+
+static int _lcrypt_hash_done (int hash, lcrypt_hash_state_t *s, unsigned char *out) {
+  switch (hash) {
+    case LCRYPT_HASH_BLAKE2B: return lcrypt_blake2b_done(&s->blake2b, out);
+    case LCRYPT_HASH_BLAKE2S: return lcrypt_blake2s_done(&s->blake2s, out);
+    case LCRYPT_HASH_BLAKE3:  return lcrypt_blake3_done(&s->blake3, out);
+  }
+  return hash_descriptor[hash].done(&s->tomcrypt, out);
+}
+
+/* the bytes hashed for the value at index, a number is its 8 byte big endian IEEE 754 double, NULL for other types */
+static const unsigned char *_lcrypt_hash_bytes (lua_State *L, int index, unsigned char *number, size_t *length) {
+  switch (lua_type(L, index)) {
+    case LUA_TSTRING: return (const unsigned char*)lua_tolstring(L, index, length);
+    case LUA_TNUMBER: {
+      double n = (double)lua_tonumber(L, index);
+      ulong64 bits;
+      memcpy(&bits, &n, sizeof(bits));
+      STORE64H(bits, number);
+      *length = 8;
+      return number;
+    }
+    case LUA_TNIL:
+    case LUA_TNONE:
+      *length = 0;
+      return number;
+  }
+  return NULL;
+}
+
+/* data into h, without raising so callers holding files or mappings can clean up first */
+static int _lcrypt_hash_update (lcrypt_hash_t *h, const unsigned char *in, unsigned long in_length, int threads) {
   switch (h->mode) {
-    case HASH_MODE_HASH: (void)lcrypt_check(L, hash_descriptor[h->data.hash.hash].process(&h->data.hash.state, in, (unsigned long)in_length)); break;
-    case HASH_MODE_HMAC: (void)lcrypt_check(L, hmac_process(&h->data.hmac, in, (unsigned long)in_length)); break;
-    case HASH_MODE_OMAC: (void)lcrypt_check(L, omac_process(&h->data.omac, in, (unsigned long)in_length)); break;
-    default: RETURN_STRING_ERROR(L, "Unknown mode");
+    case HASH_MODE_HASH: return _lcrypt_hash_process(h->data.hash.hash, &h->data.hash.state, in, in_length, threads);
+    case HASH_MODE_HMAC: return hmac_process(&h->data.hmac, in, in_length);
+    case HASH_MODE_OMAC: return omac_process(&h->data.omac, in, in_length);
+  }
+  return CRYPT_ERROR;
+}
+
+static void _lcrypt_hash_process_bytes (lua_State *L, lcrypt_hash_t *h, const unsigned char *in, size_t in_length, int options) {
+  (void)lcrypt_check(L, _lcrypt_hash_update(h, in, (unsigned long)in_length, lcrypt_threads_option(L, options, in_length)));
+}
+
+/* every value from index on, a table at the end is the options and may set threads */
+static int _lcrypt_hash_add (lua_State *L, lcrypt_hash_t *h, int index) {
+  int last = lua_gettop(L), options = last + 1;
+  if (h->mode == HASH_MODE_NONE) RETURN_STRING_ERROR(L, "Unknown mode");
+  if (last >= index && lua_istable(L, last)) options = last--;
+  for (; index <= last; ++index) {
+    unsigned char number[8];
+    size_t in_length = 0;
+    const unsigned char *in = _lcrypt_hash_bytes(L, index, number, &in_length);
+    if (in == NULL) return luaL_typerror(L, index, "string or number");
+    _lcrypt_hash_process_bytes(L, h, in, in_length, options);
   }
   return 0;
 }
 
+/* hash:add(data, ... [, {threads = n}]), all in one call */
 static int lcrypt_hash_add (lua_State *L) {
   lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
-  return _lcrypt_hash_add(L, h);
+  return _lcrypt_hash_add(L, h, 2);
 }
 
-static int lcrypt_hash_done (lua_State *L) {
+/* hash:add_table(tbl [, i [, j]]), the entries i to j, by default all of the sequence */
+static int lcrypt_hash_add_table (lua_State *L) {
   lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
-  (void)_lcrypt_hash_add(L, h);
+  int i, j, options;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  i = luaL_optint(L, 3, 1);
+  j = luaL_optint(L, 4, (int)lua_objlen(L, 2));
+  options = lua_gettop(L) + 1;
+  if (h->mode == HASH_MODE_NONE) RETURN_STRING_ERROR(L, "Unknown mode");
+  for (; i <= j; ++i) {
+    unsigned char number[8];
+    size_t in_length = 0;
+    const unsigned char *in;
+    lua_rawgeti(L, 2, i);
+    in = _lcrypt_hash_bytes(L, -1, number, &in_length);
+    if (in == NULL) RETURN_STRING_ERROR(L, "Entry %d is not a string or number", i);
+    _lcrypt_hash_process_bytes(L, h, in, in_length, options);
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+/* pushes the digest of h and wipes h, also when libtomcrypt fails so __gc does not finish it twice */
+static int _lcrypt_hash_finish (lua_State *L, lcrypt_hash_t *h) {
+  unsigned char out[MAXBLOCKSIZE];
+  unsigned long out_length = MAXBLOCKSIZE;
+  int err;
 
   switch (h->mode) {
-    case HASH_MODE_HASH: {
-      unsigned char out[hash_descriptor[h->data.hash.hash].hashsize];
-      memset(out, 0, (size_t)hash_descriptor[h->data.hash.hash].hashsize);
-      (void)lcrypt_check(L, hash_descriptor[h->data.hash.hash].done(&h->data.hash.state, out));
-      lua_pushlstring(L, (char*)out, (size_t)hash_descriptor[h->data.hash.hash].hashsize);
-    } break;
-    case HASH_MODE_HMAC: {
-      unsigned long out_length = hash_descriptor[h->data.hmac.hash].hashsize;
-      unsigned char out[out_length];
-      memset(out, 0, (size_t)out_length);
-      (void)lcrypt_check(L, hmac_done(&h->data.hmac, out, &out_length));
-      lua_pushlstring(L, (char*)out, (size_t)out_length);
-    } break;
-    case HASH_MODE_OMAC: {
-      unsigned long out_length = (unsigned long)cipher_descriptor[h->data.omac.cipher_idx].block_length;
-      unsigned char out[out_length];
-      memset(out, 0, (size_t)out_length);
-      (void)lcrypt_check(L, omac_done(&h->data.omac, out, &out_length));
-      lua_pushlstring(L, (char*)out, (size_t)out_length);
-    } break;
-    default:
-      RETURN_STRING_ERROR(L, "Unknown mode");
+    case HASH_MODE_HASH:
+      out_length = _lcrypt_hash_length(h->data.hash.hash);
+      err = _lcrypt_hash_done(h->data.hash.hash, &h->data.hash.state, out);
+      break;
+    case HASH_MODE_HMAC: err = hmac_done(&h->data.hmac, out, &out_length); break;
+    case HASH_MODE_OMAC: err = omac_done(&h->data.omac, out, &out_length); break;
+    default: RETURN_STRING_ERROR(L, "Unknown mode");
   }
 
-  memset(h, 0, sizeof(lcrypt_hash_t));
+  zeromem(h, h->size);
+  (void)lcrypt_check(L, err);
+  lua_pushlstring(L, (char*)out, (size_t)out_length);
+  return 1;
+}
+
+static int lcrypt_hash_done (lua_State *L) {
+  lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
+  (void)_lcrypt_hash_add(L, h, 2);
+  return _lcrypt_hash_finish(L, h);
+}
+
+/* an hmac state owns its malloced key block, hmac_done frees it, so every copy needs its own */
+static void _lcrypt_hash_copy_key (lua_State *L, lcrypt_hash_t *to, const lcrypt_hash_t *from) {
+  unsigned long length;
+  if (from->mode != HASH_MODE_HMAC) return;
+  length = hash_descriptor[from->data.hmac.hash].blocksize;
+  to->data.hmac.key = lcrypt_malloc(L, length);
+  memcpy(to->data.hmac.key, from->data.hmac.key, length);
+}
+
+/* copy = h:clone(), both go on independently from the data added so far */
+static int lcrypt_hash_clone (lua_State *L) {
+  lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
+  lcrypt_hash_t *c;
+  if (h->mode == HASH_MODE_NONE) RETURN_STRING_ERROR(L, "Unknown mode");
+  c = lua_newuserdata(L, h->size);
+  memcpy(c, h, h->size);
+  /* without a mode until its key is its own, __gc must not free the one of h */
+  c->mode = HASH_MODE_NONE;
+  luaL_getmetatable(L, "LCRYPT_HASH");
+  (void)lua_setmetatable(L, -2);
+  _lcrypt_hash_copy_key(L, c, h);
+  c->mode = h->mode;
   return 1;
 }
 
+/* digest = h:peek([data]), the digest of a copy with data added, h itself is left as it was */
+static int lcrypt_hash_peek (lua_State *L) {
+  lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
+  lcrypt_hash_t copy;
+  /* done wiped h down to its size, there is nothing left to copy */
+  if (h->mode == HASH_MODE_NONE) RETURN_STRING_ERROR(L, "Unknown mode");
+  memcpy(&copy, h, h->size);
+  /* hmac_process does not touch the key block, so it is copied only once nothing else can fail */
+  (void)_lcrypt_hash_add(L, &copy, 2);
+  _lcrypt_hash_copy_key(L, &copy, h);
+  return _lcrypt_hash_finish(L, &copy);
+}
+
 static int lcrypt_hash_gc (lua_State *L) {
   lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
 
   switch (h->mode) {
     case HASH_MODE_HASH: {
-      unsigned char out[hash_descriptor[h->data.hash.hash].hashsize];
-      memset(out, 0, (size_t)hash_descriptor[h->data.hash.hash].hashsize);
-      (void)lcrypt_check(L, hash_descriptor[h->data.hash.hash].done(&h->data.hash.state, out));
+      unsigned char out[MAXBLOCKSIZE];
+      (void)lcrypt_check(L, _lcrypt_hash_done(h->data.hash.hash, &h->data.hash.state, out));
     } break;
     case HASH_MODE_HMAC: {
       unsigned long out_length = hash_descriptor[h->data.hmac.hash].hashsize;
@@ -104,23 +275,26 @@ static int lcrypt_hash_gc (lua_State *L) {
   return 0;
 }
 
-static int lcrypt_hash (lua_State *L) {
-  int hash = -1, mode = HASH_MODE_NONE;
-  /* get hash */
-  if(lua_isnumber(L, 1) == 1) {
-    hash = luaL_checkint(L, 1);
+/* a hash name or id at index, omac takes a cipher name there */
+static int _lcrypt_hash_id (lua_State *L, int index) {
+  int hash = -1;
+  if(lua_isnumber(L, index) == 1) {
+    hash = luaL_checkint(L, index);
   } else {
-    const char *h = luaL_checkstring(L, 1);
-    hash = find_hash(h);
+    const char *h = luaL_checkstring(L, index);
+    hash = _lcrypt_find_hash(h);
     if(hash < 0) hash = find_cipher(h);
   }
-  if (hash < 0 || hash > lcrypt_max_hashes) RETURN_STRING_ERROR(L, "Unknown hash");
+  if (!lcrypt_hash_valid(hash)) RETURN_STRING_ERROR(L, "Unknown hash");
+  return hash;
+}
 
-  /* get mode */
-  if (lua_isnumber(L, 2) == 1) {
-    mode = luaL_checkint(L, 2);
+static int _lcrypt_hash_mode (lua_State *L, int index) {
+  int mode = HASH_MODE_NONE;
+  if (lua_isnumber(L, index) == 1) {
+    mode = luaL_checkint(L, index);
   } else {
-    const char *m = luaL_checkstring(L, 2);
+    const char *m = luaL_checkstring(L, index);
     if (strcmp(m, "hash") == 0)
       mode = HASH_MODE_HASH;
     else if (strcmp(m, "hmac") == 0)
@@ -129,61 +303,272 @@ static int lcrypt_hash (lua_State *L) {
       mode = HASH_MODE_OMAC;
   }
   if (mode <= 0 || mode > HASH_MODE_MAX) RETURN_STRING_ERROR(L, "Unknown mode");
+  return mode;
+}
+
+/* pushes a hash ready for data, sized for the state of its mode */
+static lcrypt_hash_t *_lcrypt_hash_new (lua_State *L, int hash, int mode, const unsigned char *key, size_t key_length) {
+  size_t size = sizeof(lcrypt_hash_t);
+  lcrypt_hash_t *h;
+
+  switch (mode) {
+    case HASH_MODE_HASH: size = offsetof(lcrypt_hash_t, data.hash.state) + _lcrypt_hash_state_size(hash); break;
+    case HASH_MODE_HMAC: size = offsetof(lcrypt_hash_t, data) + sizeof(hmac_state); break;
+    case HASH_MODE_OMAC: size = offsetof(lcrypt_hash_t, data) + sizeof(omac_state); break;
+  }
+  h = lua_newuserdata(L, size);
+  luaL_getmetatable(L, "LCRYPT_HASH");
+  (void)lua_setmetatable(L, -2);
+  memset(h, 0, size);
+  h->size = size;
 
-  {
-    /* get optional first data chunk */
-    size_t in_length = 0, extra_length = 0;
-    const unsigned char *in    = (const unsigned char*)luaL_optlstring(L, 3, "", &in_length);
-    const unsigned char *extra = (const unsigned char*)luaL_optlstring(L, 4, "", &extra_length);
-
-    /* prepare result */
-    lcrypt_hash_t *h = lua_newuserdata(L, sizeof(lcrypt_hash_t));
-    luaL_getmetatable(L, "LCRYPT_HASH");
-    (void)lua_setmetatable(L, -2);
-    memset(h, 0, sizeof(lcrypt_hash_t));
-
-    switch (mode) {
-      case HASH_MODE_HASH: {
-        h->data.hash.hash = hash;
-        (void)lcrypt_check(L, hash_descriptor[hash].init(&h->data.hash.state));
-        h->mode = mode;
-        (void)lcrypt_check(L, hash_descriptor[hash].process(&h->data.hash.state, in, (unsigned long)in_length));
-      } break;
-      case HASH_MODE_HMAC: {
-        (void)lcrypt_check(L, hmac_init(&h->data.hmac, hash, extra, (unsigned long)extra_length));
-        h->mode = mode;
-        (void)lcrypt_check(L, hmac_process(&h->data.hmac, in, (unsigned long)in_length));
-      } break;
-      case HASH_MODE_OMAC: {
-        (void)lcrypt_check(L, omac_init(&h->data.omac, hash, extra, (unsigned long)extra_length));
-        h->mode = mode;
-        (void)lcrypt_check(L, omac_process(&h->data.omac, in, (unsigned long)in_length));
-      } break;
-      default:
-        RETURN_STRING_ERROR(L, "Unknown mode");
+  switch (mode) {
+    case HASH_MODE_HASH:
+      h->data.hash.hash = hash;
+      (void)lcrypt_check(L, _lcrypt_hash_init(hash, &h->data.hash.state, key, (unsigned long)key_length));
+      break;
+    case HASH_MODE_HMAC: (void)lcrypt_check(L, hmac_init(&h->data.hmac, hash, key, (unsigned long)key_length)); break;
+    case HASH_MODE_OMAC: (void)lcrypt_check(L, omac_init(&h->data.omac, hash, key, (unsigned long)key_length)); break;
+    default: (void)luaL_error(L, "Unknown mode"); return NULL;
+  }
+  h->mode = mode;
+  return h;
+}
+
+/**
+ * hash = lcrypt.hash(hash, mode [, data [, key [, {threads = n}]]]), key is the hmac/omac key or the BLAKE key.
+ * data is taken like hash:add takes it, so a number is its 8 byte double and not its decimal string.
+ */
+static int lcrypt_hash (lua_State *L) {
+  int hash = _lcrypt_hash_id(L, 1), mode = _lcrypt_hash_mode(L, 2);
+  unsigned char number[8];
+  size_t in_length = 0, extra_length = 0;
+  const unsigned char *in    = _lcrypt_hash_bytes(L, 3, number, &in_length);
+  const unsigned char *extra = (const unsigned char*)luaL_optlstring(L, 4, "", &extra_length);
+  lcrypt_hash_t *h;
+  if (in == NULL) return luaL_typerror(L, 3, "string or number");
+  h = _lcrypt_hash_new(L, hash, mode, extra, extra_length);
+  _lcrypt_hash_process_bytes(L, h, in, in_length, 5);
+  return 1;
+}
+
+#define LCRYPT_HASH_FILE_WINDOW (64 * 1024 * 1024)
+
+/* the rest of fp into h, mapped a window at a time when it is a regular file and read otherwise, returns an errno */
+static int _lcrypt_hash_fp (lcrypt_hash_t *h, FILE *fp, int threads, int *crypt_err) {
+  struct stat st;
+  off_t offset = ftello(fp);
+  int fd = fileno(fp), mapped = 0;
+  unsigned char *buffer;
+  size_t length;
+
+  if (offset >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    long page = sysconf(_SC_PAGESIZE);
+    while (offset < st.st_size && *crypt_err == CRYPT_OK) {
+      /* mmap wants a page aligned offset, the bytes before the position are skipped */
+      off_t start = offset - offset % page;
+      unsigned char *map;
+      length = (st.st_size - start > LCRYPT_HASH_FILE_WINDOW) ? LCRYPT_HASH_FILE_WINDOW : (size_t)(st.st_size - start);
+      map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, start);
+      if (map == MAP_FAILED) {
+        if (mapped) return errno;
+        break;                  /* not mappable at all, read it */
+      }
+      #ifdef MADV_SEQUENTIAL
+        (void)madvise(map, length, MADV_SEQUENTIAL);
+      #endif
+      #ifdef MADV_WILLNEED
+        (void)madvise(map, length, MADV_WILLNEED);
+      #endif
+      *crypt_err = _lcrypt_hash_update(h, map + (offset - start), (unsigned long)(length - (size_t)(offset - start)), threads);
+      (void)munmap(map, length);
+      offset = start + (off_t)length;
+      mapped = 1;
+    }
+    if (mapped) return (fseeko(fp, offset, SEEK_SET) == 0) ? 0 : errno;
+  }
+
+  #ifdef POSIX_FADV_SEQUENTIAL
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  #endif
+  if (posix_memalign((void**)&buffer, 4096, LCRYPT_FILE_CHUNK) != 0) return ENOMEM;
+  while (*crypt_err == CRYPT_OK && (length = fread(buffer, 1, LCRYPT_FILE_CHUNK, fp)) > 0)
+    *crypt_err = _lcrypt_hash_update(h, buffer, (unsigned long)length, threads);
+  free(buffer);
+  return ferror(fp) ? ((errno != 0) ? errno : EIO) : 0;
+}
+
+/**
+ * digest = lcrypt.hash_file(hash, path_or_handle [, mode [, key [, {threads = n}]]]), mode defaults to 'hash'.
+ * A handle is hashed from its position to its end. The content never becomes a Lua string.
+ */
+static int lcrypt_hash_file (lua_State *L) {
+  int hash = _lcrypt_hash_id(L, 1);
+  int mode = lua_isnoneornil(L, 3) ? HASH_MODE_HASH : _lcrypt_hash_mode(L, 3);
+  size_t key_length = 0;
+  const unsigned char *key = (const unsigned char*)luaL_optlstring(L, 4, "", &key_length);
+  int threads = lcrypt_threads_option(L, 5, LCRYPT_HASH_FILE_WINDOW), opened = 0, err, crypt_err = CRYPT_OK;
+  lcrypt_hash_t *h = _lcrypt_hash_new(L, hash, mode, key, key_length);
+  FILE *fp;
+
+  if ((fp = _lcrypt_file_open(L, 2, "rb", &opened)) == NULL) RETURN_LIBC_ERROR(L);
+  errno = 0;
+  err = _lcrypt_hash_fp(h, fp, threads, &crypt_err);
+  if (opened) (void)fclose(fp);
+  if (err != 0) RETURN_STRING_ERROR(L, "%s", strerror(err));
+  (void)lcrypt_check(L, crypt_err);
+  return _lcrypt_hash_finish(L, h);
+}
+
+/* a name or id to its descriptor index, names are looked up once and then remembered in the table at upvalue 1 */
+static int _lcrypt_resolve (lua_State *L, int index, int (*find)(const char *), int max, const char *error) {
+  int id = -1;
+  if (lua_isnumber(L, index) == 1) {
+    id = luaL_checkint(L, index);
+  } else {
+    (void)luaL_checkstring(L, index);
+    lua_pushvalue(L, index);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (lua_isnumber(L, -1) == 1) {
+      id = (int)lua_tointeger(L, -1);
+    } else {
+      id = find(lua_tostring(L, index));
+      if (id >= 0 && id <= max) {
+        lua_pushvalue(L, index);
+        lua_pushinteger(L, (lua_Integer)id);
+        lua_rawset(L, lua_upvalueindex(1));
+      }
     }
+    lua_pop(L, 1);
   }
+  if (id < 0 || id > max) RETURN_STRING_ERROR(L, "%s", error);
+  return id;
+}
 
+static int _lcrypt_resolve_hash (lua_State *L, int index) {
+  int hash = _lcrypt_resolve(L, index, _lcrypt_find_hash, LCRYPT_HASH_BLAKE3, "Unknown hash");
+  if (!lcrypt_hash_valid(hash)) RETURN_STRING_ERROR(L, "Unknown hash");
+  return hash;
+}
+
+/* digest = lcrypt.digest(hash, data [, {threads = n}]), the state lives on the stack so no userdata is made */
+static int lcrypt_digest (lua_State *L) {
+  int hash = _lcrypt_resolve_hash(L, 1);
+  size_t in_length = 0;
+  const unsigned char *in = (const unsigned char*)luaL_checklstring(L, 2, &in_length);
+  unsigned char out[MAXBLOCKSIZE];
+  lcrypt_hash_state_t state;
+  (void)lcrypt_check(L, _lcrypt_hash_init(hash, &state, NULL, 0));
+  (void)lcrypt_check(L, _lcrypt_hash_process(hash, &state, in, (unsigned long)in_length, lcrypt_threads_option(L, 3, in_length)));
+  (void)lcrypt_check(L, _lcrypt_hash_done(hash, &state, out));
+  lua_pushlstring(L, (char*)out, (size_t)_lcrypt_hash_length(hash));
+  return 1;
+}
+
+/* mac = lcrypt.hmac(hash, key, data) */
+static int lcrypt_hmac (lua_State *L) {
+  int hash = _lcrypt_resolve(L, 1, find_hash, lcrypt_max_hashes, "Unknown hash");
+  size_t key_length = 0, in_length = 0;
+  const unsigned char *key = (const unsigned char*)luaL_checklstring(L, 2, &key_length);
+  const unsigned char *in  = (const unsigned char*)luaL_checklstring(L, 3, &in_length);
+  unsigned long out_length = MAXBLOCKSIZE;
+  unsigned char out[MAXBLOCKSIZE];
+  hmac_state state;
+  int err = hmac_init(&state, hash, key, (unsigned long)key_length);
+  /* hmac_init allocates, so hmac_done has to run before any error is raised */
+  if (err == CRYPT_OK) {
+    int done_err;
+    err = hmac_process(&state, in, (unsigned long)in_length);
+    done_err = hmac_done(&state, out, &out_length);
+    if (err == CRYPT_OK) err = done_err;
+  }
+  (void)lcrypt_check(L, err);
+  lua_pushlstring(L, (char*)out, (size_t)out_length);
+  return 1;
+}
+
+/* mac = lcrypt.omac(cipher, key, data) */
+static int lcrypt_omac (lua_State *L) {
+  int cipher = _lcrypt_resolve(L, 1, find_cipher, lcrypt_max_ciphers, "Unknown cipher");
+  size_t key_length = 0, in_length = 0;
+  const unsigned char *key = (const unsigned char*)luaL_checklstring(L, 2, &key_length);
+  const unsigned char *in  = (const unsigned char*)luaL_checklstring(L, 3, &in_length);
+  unsigned long out_length = MAXBLOCKSIZE;
+  unsigned char out[MAXBLOCKSIZE];
+  omac_state state;
+  (void)lcrypt_check(L, omac_init(&state, cipher, key, (unsigned long)key_length));
+  (void)lcrypt_check(L, omac_process(&state, in, (unsigned long)in_length));
+  (void)lcrypt_check(L, omac_done(&state, out, &out_length));
+  lua_pushlstring(L, (char*)out, (size_t)out_length);
+  return 1;
+}
+
+/* digests = lcrypt.digest_many(hash, {data, ...}), sha256, sha224, sha1 and md5 go through lcrypt_multihash */
+static int lcrypt_digest_many (lua_State *L) {
+  int hash = _lcrypt_resolve_hash(L, 1);
+  const lcrypt_multihash_t *m = lcrypt_multihash_find(_lcrypt_hash_name(hash));
+  unsigned long digest_length = _lcrypt_hash_length(hash), count, i;
+  const unsigned char **in;
+  unsigned long *length;
+  unsigned char *out;
+  int err = CRYPT_OK;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  count = (unsigned long)lua_objlen(L, 2);
+  /* only real strings, a number converted here would not stay anchored in the table */
+  for (i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 2, (int)i);
+    if (lua_type(L, -1) != LUA_TSTRING) RETURN_STRING_ERROR(L, "Entry %d is not a string", (int)i);
+    lua_pop(L, 1);
+  }
+  /* a userdata, so the collector takes it back when one of the pushes below raises */
+  in     = lua_newuserdata(L, count * (sizeof(*in) + sizeof(*length) + digest_length));
+  length = (unsigned long *)(in + count);
+  out    = (unsigned char *)(length + count);
+  for (i = 0; i < count; ++i) {
+    size_t l = 0;
+    lua_rawgeti(L, 2, (int)i + 1);
+    in[i] = (const unsigned char *)lua_tolstring(L, -1, &l);
+    length[i] = (unsigned long)l;
+    lua_pop(L, 1);
+  }
+
+  if (m != NULL) {
+    lcrypt_multihash(m, in, length, count, out);
+  } else {
+    lcrypt_hash_state_t state;
+    for (i = 0; i < count && err == CRYPT_OK; ++i) {
+      err = _lcrypt_hash_init(hash, &state, NULL, 0);
+      if (err == CRYPT_OK) err = _lcrypt_hash_process(hash, &state, in[i], length[i], 1);
+      if (err == CRYPT_OK) err = _lcrypt_hash_done(hash, &state, out + i * digest_length);
+    }
+  }
+
+  (void)lcrypt_check(L, err);
+  lua_createtable(L, (int)count, 0);
+  for (i = 0; i < count; ++i) {
+    lua_pushlstring(L, (char*)out + i * digest_length, (size_t)digest_length);
+    lua_rawseti(L, -2, (int)i + 1);
+  }
   return 1;
 }
 
 static int lcrypt_hash_size (lua_State *L) {
   lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
   switch (h->mode) {
-    case HASH_MODE_HASH: lua_pushinteger(L, (lua_Integer)hash_descriptor[h->data.hash.hash].hashsize); return 1;
+    case HASH_MODE_HASH: lua_pushinteger(L, (lua_Integer)_lcrypt_hash_length(h->data.hash.hash)); return 1;
     case HASH_MODE_HMAC: lua_pushinteger(L, (lua_Integer)hash_descriptor[h->data.hmac.hash].hashsize); return 1;
     case HASH_MODE_OMAC: lua_pushinteger(L, (lua_Integer)cipher_descriptor[h->data.omac.cipher_idx].block_length); return 1;
   }
   return 0;
 }
 
-static int lcrypt_hash_index (lua_State *L) {
+/* the computed fields, methods are found in lcrypt_hash_methods first */
+static int lcrypt_hash_properties (lua_State *L) {
   lcrypt_hash_t *h = luaL_checkudata(L, 1, "LCRYPT_HASH");
   const char *index = luaL_checkstring(L, 2);
   int hash_index = -1, cipher_index = -1;
 
-  if (strcmp(index, "add") == 0)  { lua_pushcfunction(L, lcrypt_hash_add);  return 1; }
-  if (strcmp(index, "done") == 0) { lua_pushcfunction(L, lcrypt_hash_done); return 1; }
   if (strcmp(index, "mode") == 0) {
     switch (h->mode) {
       case HASH_MODE_HASH: lua_pushstring(L, "hash"); return 1;
@@ -199,8 +584,8 @@ static int lcrypt_hash_index (lua_State *L) {
   }
 
   if (hash_index >= 0) {
-    if (strcmp(index, "hash") == 0) { lua_pushstring(L, hash_descriptor[hash_index].name); return 1; }
-    if (strcmp(index, "size") == 0) { lua_pushinteger(L, (lua_Integer)hash_descriptor[hash_index].hashsize); return 1; }
+    if (strcmp(index, "hash") == 0) { lua_pushstring(L, _lcrypt_hash_name(hash_index)); return 1; }
+    if (strcmp(index, "size") == 0) { lua_pushinteger(L, (lua_Integer)_lcrypt_hash_length(hash_index)); return 1; }
   }
 
   if (h->mode == HASH_MODE_OMAC) cipher_index = h->data.omac.cipher_idx;
@@ -212,8 +597,16 @@ static int lcrypt_hash_index (lua_State *L) {
   return 0;
 }
 
+static const struct luaL_Reg lcrypt_hash_methods[] = {
+  {"add",       &lcrypt_hash_add},
+  {"add_table", &lcrypt_hash_add_table},
+  {"done",      &lcrypt_hash_done},
+  {"clone",     &lcrypt_hash_clone},
+  {"peek",      &lcrypt_hash_peek},
+  {NULL,        NULL}
+};
+
 static const struct luaL_Reg lcrypt_hash_flib[] = {
-  {"__index", &lcrypt_hash_index},
   {"__gc",    &lcrypt_hash_gc},
   {"__len",   &lcrypt_hash_size},
   {NULL,      NULL}
@@ -221,11 +614,25 @@ static const struct luaL_Reg lcrypt_hash_flib[] = {
 
 static void lcrypt_start_hashes(lua_State *L) {
   ADD_FUNCTION(L, hash);
+  ADD_FUNCTION(L, hash_file);
+  /* each one shot function keeps its own name to id table as upvalue */
+  #define ADD_RESOLVING_FUNCTION(L,name)                  \
+  {                                                       \
+    lua_pushstring(L, #name);                             \
+    lua_newtable(L);                                      \
+    lua_pushcclosure(L, lcrypt_ ## name, 1);              \
+    lua_settable(L, -3);                                  \
+  }
+  ADD_RESOLVING_FUNCTION(L, digest);
+  ADD_RESOLVING_FUNCTION(L, hmac);
+  ADD_RESOLVING_FUNCTION(L, omac);
+  ADD_RESOLVING_FUNCTION(L, digest_many);
+  #undef ADD_RESOLVING_FUNCTION
   lua_pushstring(L, "hashes");
   lua_newtable(L);
   #define ADD_HASH(L,name)                                \
   {                                                       \
-    int h = register_hash(&name ## _desc);                \
+    int h = register_hash(lcrypt_sha_desc(&name ## _desc)); \
     if(h > lcrypt_max_hashes) lcrypt_max_hashes = h;      \
     lua_pushstring(L, #name);                             \
     lua_pushinteger(L, (lua_Integer)h);                   \
@@ -236,7 +643,18 @@ static void lcrypt_start_hashes(lua_State *L) {
   ADD_HASH(L, sha1);       ADD_HASH(L, rmd160);  ADD_HASH(L, rmd128);  ADD_HASH(L, md5);
   ADD_HASH(L, md4);        ADD_HASH(L, md2);
   #undef ADD_HASH
+  #define ADD_OWN_HASH(L,name,value)                      \
+  {                                                       \
+    lua_pushstring(L, #name);                             \
+    lua_pushinteger(L, (lua_Integer)value);               \
+    lua_settable(L, -3);                                  \
+  }
+  ADD_OWN_HASH(L, blake2b, LCRYPT_HASH_BLAKE2B);  ADD_OWN_HASH(L, blake2s, LCRYPT_HASH_BLAKE2S);  ADD_OWN_HASH(L, blake3, LCRYPT_HASH_BLAKE3);
+  #undef ADD_OWN_HASH
   lua_settable(L, -3);
+  lcrypt_sha_set_implementations(L);
+
+  lcrypt_set_implementation(L, "digest_many", lcrypt_multihash_implementation());
 
   lua_pushstring(L, "hash_modes");
   lua_newtable(L);
@@ -252,5 +670,6 @@ static void lcrypt_start_hashes(lua_State *L) {
 
   (void)luaL_newmetatable(L, "LCRYPT_HASH");
   (void)luaL_register(L, NULL, lcrypt_hash_flib);
+  lcrypt_set_index(L, lcrypt_hash_methods, lcrypt_hash_properties);
   lua_pop(L, 1);
 }
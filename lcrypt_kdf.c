@@ -0,0 +1,349 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+/*
+ * PBKDF2 (RFC 8018), HKDF (RFC 5869) and scrypt (RFC 7914). The HMAC key is
+ * hashed into its inner and outer pad states once and every MAC starts from
+ * copies of them, pkcs_5_alg2 runs hmac_init for each iteration instead. PBKDF2
+ * output blocks and scrypt's p lanes are independent and go to lcrypt_parallel.
+ */
+
+typedef struct {
+  int hash;
+  hash_state inner, outer;      /* after the key xor ipad and opad blocks */
+} lcrypt_hmac_pads_t;
+
+static int _lcrypt_hmac_pads (lcrypt_hmac_pads_t *p, int hash, const unsigned char *key, unsigned long key_length) {
+  unsigned char block[MAXBLOCKSIZE];
+  unsigned long block_length = hash_descriptor[hash].blocksize, i;
+  int err;
+
+  if (block_length > MAXBLOCKSIZE || hash_descriptor[hash].hashsize > block_length) return CRYPT_INVALID_HASH;
+  p->hash = hash;
+  memset(block, 0, sizeof(block));
+  if (key_length > block_length) {
+    if ((err = hash_descriptor[hash].init(&p->inner)) != CRYPT_OK) return err;
+    if ((err = hash_descriptor[hash].process(&p->inner, key, key_length)) != CRYPT_OK) return err;
+    if ((err = hash_descriptor[hash].done(&p->inner, block)) != CRYPT_OK) return err;
+  } else {
+    memcpy(block, key, key_length);
+  }
+
+  for (i = 0; i < block_length; ++i) block[i] ^= 0x36;
+  if ((err = hash_descriptor[hash].init(&p->inner)) != CRYPT_OK) return err;
+  if ((err = hash_descriptor[hash].process(&p->inner, block, block_length)) != CRYPT_OK) return err;
+  for (i = 0; i < block_length; ++i) block[i] ^= 0x36 ^ 0x5c;
+  if ((err = hash_descriptor[hash].init(&p->outer)) != CRYPT_OK) return err;
+  if ((err = hash_descriptor[hash].process(&p->outer, block, block_length)) != CRYPT_OK) return err;
+  zeromem(block, sizeof(block));
+  return CRYPT_OK;
+}
+
+/* the MAC of the data processed into s since it was set to p->inner */
+static int _lcrypt_hmac_pads_done (const lcrypt_hmac_pads_t *p, hash_state *s, unsigned char *out) {
+  int err;
+  if ((err = hash_descriptor[p->hash].done(s, out)) != CRYPT_OK) return err;
+  *s = p->outer;
+  if ((err = hash_descriptor[p->hash].process(s, out, hash_descriptor[p->hash].hashsize)) != CRYPT_OK) return err;
+  return hash_descriptor[p->hash].done(s, out);
+}
+
+/* PBKDF2 */
+
+typedef struct {
+  const lcrypt_hmac_pads_t *pads;
+  const unsigned char *salt;
+  unsigned long salt_length, iterations;
+  unsigned long first, count;   /* output blocks of this job, counted from 0 */
+  unsigned char *out;           /* all blocks */
+  int err;
+} lcrypt_pbkdf2_job_t;
+
+static void *_lcrypt_pbkdf2_job (void *arg) {
+  lcrypt_pbkdf2_job_t *job = arg;
+  const lcrypt_hmac_pads_t *pads = job->pads;
+  unsigned long length = hash_descriptor[pads->hash].hashsize, block, iteration, i;
+  unsigned char u[MAXBLOCKSIZE], counter[4];
+  hash_state s;
+  int err = CRYPT_OK;
+
+  for (block = job->first; block < job->first + job->count && err == CRYPT_OK; ++block) {
+    unsigned char *t = job->out + block * length;
+    STORE32H((uint32_t)(block + 1), counter);
+    s = pads->inner;
+    err = hash_descriptor[pads->hash].process(&s, job->salt, job->salt_length);
+    if (err == CRYPT_OK) err = hash_descriptor[pads->hash].process(&s, counter, 4);
+    if (err == CRYPT_OK) err = _lcrypt_hmac_pads_done(pads, &s, u);
+    memcpy(t, u, length);
+    for (iteration = 1; iteration < job->iterations && err == CRYPT_OK; ++iteration) {
+      s = pads->inner;
+      err = hash_descriptor[pads->hash].process(&s, u, length);
+      if (err == CRYPT_OK) err = _lcrypt_hmac_pads_done(pads, &s, u);
+      for (i = 0; i < length; ++i) t[i] ^= u[i];
+    }
+  }
+  zeromem(u, sizeof(u));
+  zeromem(&s, sizeof(s));
+  job->err = err;
+  return NULL;
+}
+
+/* out is rounded up to whole hash sized blocks */
+static int _lcrypt_pbkdf2 (const lcrypt_hmac_pads_t *pads, const unsigned char *salt, unsigned long salt_length,
+                           unsigned long iterations, unsigned char *out, unsigned long blocks, int threads) {
+  lcrypt_pbkdf2_job_t jobs[LCRYPT_THREADS_MAX];
+  int i;
+
+  if ((unsigned long)threads > blocks) threads = (int)blocks;
+  if (threads < 1) threads = 1;
+  for (i = 0; i < threads; ++i) {
+    jobs[i].pads        = pads;
+    jobs[i].salt        = salt;
+    jobs[i].salt_length = salt_length;
+    jobs[i].iterations  = iterations;
+    jobs[i].first       = blocks * (unsigned long)i / (unsigned long)threads;
+    jobs[i].count       = blocks * (unsigned long)(i + 1) / (unsigned long)threads - jobs[i].first;
+    jobs[i].out         = out;
+    jobs[i].err         = CRYPT_OK;
+  }
+  lcrypt_parallel(_lcrypt_pbkdf2_job, jobs, sizeof(jobs[0]), threads);
+
+  for (i = 0; i < threads; ++i) if (jobs[i].err != CRYPT_OK) return jobs[i].err;
+  return CRYPT_OK;
+}
+
+/* key = lcrypt.pbkdf2(hash, password, salt, iterations, length [, {threads = n}]), blocks past the first go to threads */
+static int lcrypt_pbkdf2 (lua_State *L) {
+  int hash = _lcrypt_resolve(L, 1, find_hash, lcrypt_max_hashes, "Unknown hash");
+  size_t password_length = 0, salt_length = 0;
+  const unsigned char *password = (const unsigned char*)luaL_checklstring(L, 2, &password_length);
+  const unsigned char *salt     = (const unsigned char*)luaL_checklstring(L, 3, &salt_length);
+  lua_Integer iterations = luaL_checkinteger(L, 4), length = luaL_checkinteger(L, 5);
+  unsigned long hash_length = hash_descriptor[hash].hashsize, blocks;
+  lcrypt_hmac_pads_t pads;
+  unsigned char *out;
+  int err;
+
+  if (iterations < 1) RETURN_STRING_ERROR(L, "Iterations must be at least 1");
+  if (length < 0 || (ulong64)length > (ulong64)0xffffffffUL * hash_length) RETURN_STRING_ERROR(L, "Length out of range");
+  blocks = ((unsigned long)length + hash_length - 1) / hash_length;
+  (void)lcrypt_check(L, _lcrypt_hmac_pads(&pads, hash, password, (unsigned long)password_length));
+
+  out = lcrypt_malloc(L, blocks * hash_length + 1);
+  err = _lcrypt_pbkdf2(&pads, salt, (unsigned long)salt_length, (unsigned long)iterations, out, blocks, lcrypt_threads_requested(L, 6));
+  zeromem(&pads, sizeof(pads));
+  if (err == CRYPT_OK) lua_pushlstring(L, (char*)out, (size_t)length);
+  zeromem(out, blocks * hash_length);
+  free(out);
+  (void)lcrypt_check(L, err);
+  return 1;
+}
+
+/* key = lcrypt.hkdf(hash, key_material, salt, info, length), salt and info may be nil */
+static int lcrypt_hkdf (lua_State *L) {
+  int hash = _lcrypt_resolve(L, 1, find_hash, lcrypt_max_hashes, "Unknown hash");
+  size_t ikm_length = 0, salt_length = 0, info_length = 0;
+  const unsigned char *ikm  = (const unsigned char*)luaL_checklstring(L, 2, &ikm_length);
+  const unsigned char *salt = (const unsigned char*)luaL_optlstring(L, 3, "", &salt_length);
+  const unsigned char *info = (const unsigned char*)luaL_optlstring(L, 4, "", &info_length);
+  lua_Integer length = luaL_checkinteger(L, 5);
+  unsigned long hash_length = hash_descriptor[hash].hashsize, done = 0;
+  unsigned char prk[MAXBLOCKSIZE], t[MAXBLOCKSIZE], counter = 0;
+  lcrypt_hmac_pads_t pads;
+  unsigned char *out;
+  hash_state s;
+  int err;
+
+  if (length < 0 || (unsigned long)length > 255 * hash_length) RETURN_STRING_ERROR(L, "Length out of range");
+
+  out = lcrypt_malloc(L, (size_t)length + 1);
+
+  /* extract, an empty salt is the same as hash_length zero bytes */
+  err = _lcrypt_hmac_pads(&pads, hash, salt, (unsigned long)salt_length);
+  s = pads.inner;
+  if (err == CRYPT_OK) err = hash_descriptor[hash].process(&s, ikm, (unsigned long)ikm_length);
+  if (err == CRYPT_OK) err = _lcrypt_hmac_pads_done(&pads, &s, prk);
+
+  /* expand */
+  if (err == CRYPT_OK) err = _lcrypt_hmac_pads(&pads, hash, prk, hash_length);
+  while (err == CRYPT_OK && done < (unsigned long)length) {
+    unsigned long take = ((unsigned long)length - done < hash_length) ? (unsigned long)length - done : hash_length;
+    s = pads.inner;
+    if (counter > 0) err = hash_descriptor[hash].process(&s, t, hash_length);
+    ++counter;
+    if (err == CRYPT_OK) err = hash_descriptor[hash].process(&s, info, (unsigned long)info_length);
+    if (err == CRYPT_OK) err = hash_descriptor[hash].process(&s, &counter, 1);
+    if (err == CRYPT_OK) err = _lcrypt_hmac_pads_done(&pads, &s, t);
+    memcpy(out + done, t, take);
+    done += take;
+  }
+  zeromem(prk, sizeof(prk));
+  zeromem(t, sizeof(t));
+  zeromem(&pads, sizeof(pads));
+  zeromem(&s, sizeof(s));
+  if (err == CRYPT_OK) lua_pushlstring(L, (char*)out, (size_t)length);
+  zeromem(out, (size_t)length);
+  free(out);
+  (void)lcrypt_check(L, err);
+  return 1;
+}
+
+/* scrypt */
+
+#define SCRYPT_R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+static void _lcrypt_salsa20_8 (uint32_t *b) {
+  uint32_t x[16];
+  int i;
+  memcpy(x, b, sizeof(x));
+  for (i = 0; i < 8; i += 2) {
+    x[ 4] ^= SCRYPT_R(x[ 0] + x[12],  7);  x[ 8] ^= SCRYPT_R(x[ 4] + x[ 0],  9);
+    x[12] ^= SCRYPT_R(x[ 8] + x[ 4], 13);  x[ 0] ^= SCRYPT_R(x[12] + x[ 8], 18);
+    x[ 9] ^= SCRYPT_R(x[ 5] + x[ 1],  7);  x[13] ^= SCRYPT_R(x[ 9] + x[ 5],  9);
+    x[ 1] ^= SCRYPT_R(x[13] + x[ 9], 13);  x[ 5] ^= SCRYPT_R(x[ 1] + x[13], 18);
+    x[14] ^= SCRYPT_R(x[10] + x[ 6],  7);  x[ 2] ^= SCRYPT_R(x[14] + x[10],  9);
+    x[ 6] ^= SCRYPT_R(x[ 2] + x[14], 13);  x[10] ^= SCRYPT_R(x[ 6] + x[ 2], 18);
+    x[ 3] ^= SCRYPT_R(x[15] + x[11],  7);  x[ 7] ^= SCRYPT_R(x[ 3] + x[15],  9);
+    x[11] ^= SCRYPT_R(x[ 7] + x[ 3], 13);  x[15] ^= SCRYPT_R(x[11] + x[ 7], 18);
+    x[ 1] ^= SCRYPT_R(x[ 0] + x[ 3],  7);  x[ 2] ^= SCRYPT_R(x[ 1] + x[ 0],  9);
+    x[ 3] ^= SCRYPT_R(x[ 2] + x[ 1], 13);  x[ 0] ^= SCRYPT_R(x[ 3] + x[ 2], 18);
+    x[ 6] ^= SCRYPT_R(x[ 5] + x[ 4],  7);  x[ 7] ^= SCRYPT_R(x[ 6] + x[ 5],  9);
+    x[ 4] ^= SCRYPT_R(x[ 7] + x[ 6], 13);  x[ 5] ^= SCRYPT_R(x[ 4] + x[ 7], 18);
+    x[11] ^= SCRYPT_R(x[10] + x[ 9],  7);  x[ 8] ^= SCRYPT_R(x[11] + x[10],  9);
+    x[ 9] ^= SCRYPT_R(x[ 8] + x[11], 13);  x[10] ^= SCRYPT_R(x[ 9] + x[ 8], 18);
+    x[12] ^= SCRYPT_R(x[15] + x[14],  7);  x[13] ^= SCRYPT_R(x[12] + x[15],  9);
+    x[14] ^= SCRYPT_R(x[13] + x[12], 13);  x[15] ^= SCRYPT_R(x[14] + x[13], 18);
+  }
+  for (i = 0; i < 16; ++i) b[i] += x[i];
+}
+
+#undef SCRYPT_R
+
+/* BlockMix of the 2r 64 byte blocks in b, y is as large and scratch */
+static void _lcrypt_scrypt_blockmix (uint32_t *b, uint32_t *y, unsigned long r) {
+  uint32_t x[16];
+  unsigned long i, j;
+  memcpy(x, b + (2 * r - 1) * 16, sizeof(x));
+  for (i = 0; i < 2 * r; ++i) {
+    for (j = 0; j < 16; ++j) x[j] ^= b[i * 16 + j];
+    _lcrypt_salsa20_8(x);
+    memcpy(y + i * 16, x, sizeof(x));
+  }
+  /* even blocks first, then the odd ones */
+  for (i = 0; i < r; ++i) {
+    memcpy(b + i * 16,       y + 2 * i * 16,       sizeof(x));
+    memcpy(b + (i + r) * 16, y + (2 * i + 1) * 16, sizeof(x));
+  }
+}
+
+/* ROMix of one 128r byte lane, v holds n of them and xy two */
+static void _lcrypt_scrypt_romix (unsigned char *lane, unsigned long r, ulong64 n, uint32_t *v, uint32_t *xy) {
+  unsigned long words = 32 * r, i;
+  uint32_t *x = xy, *y = xy + words;
+  ulong64 k;
+
+  for (i = 0; i < words; ++i) LOAD32L(x[i], lane + 4 * i);
+  for (k = 0; k < n; ++k) {
+    memcpy(v + k * words, x, words * sizeof(uint32_t));
+    _lcrypt_scrypt_blockmix(x, y, r);
+  }
+  for (k = 0; k < n; ++k) {
+    /* Integerify, the first 8 bytes of the last block */
+    ulong64 j = (x[words - 16] | (ulong64)x[words - 15] << 32) & (n - 1);
+    const uint32_t *vj = v + j * words;
+    for (i = 0; i < words; ++i) x[i] ^= vj[i];
+    _lcrypt_scrypt_blockmix(x, y, r);
+  }
+  for (i = 0; i < words; ++i) STORE32L(x[i], lane + 4 * i);
+}
+
+typedef struct {
+  unsigned char *b;             /* all p lanes */
+  unsigned long r, first, count;
+  ulong64 n;
+  uint32_t *v, *xy;             /* this job's own scratch */
+} lcrypt_scrypt_job_t;
+
+static void *_lcrypt_scrypt_job (void *arg) {
+  lcrypt_scrypt_job_t *job = arg;
+  unsigned long lane;
+  for (lane = job->first; lane < job->first + job->count; ++lane)
+    _lcrypt_scrypt_romix(job->b + lane * 128 * job->r, job->r, job->n, job->v, job->xy);
+  return NULL;
+}
+
+/* key = lcrypt.scrypt(password, salt, N, r, p, length [, {threads = n}]), the p lanes go to threads, each needs 128 * r * N bytes */
+static int lcrypt_scrypt (lua_State *L) {
+  size_t password_length = 0, salt_length = 0, lane_size, scratch_size;
+  const unsigned char *password = (const unsigned char*)luaL_checklstring(L, 1, &password_length);
+  const unsigned char *salt     = (const unsigned char*)luaL_checklstring(L, 2, &salt_length);
+  lua_Integer n = luaL_checkinteger(L, 3), r = luaL_checkinteger(L, 4), p = luaL_checkinteger(L, 5);
+  lua_Integer length = luaL_checkinteger(L, 6);
+  int hash = find_hash("sha256"), threads = lcrypt_threads_requested(L, 7), i, err;
+  unsigned long hash_length, blocks;
+  lcrypt_scrypt_job_t jobs[LCRYPT_THREADS_MAX];
+  lcrypt_hmac_pads_t pads;
+  unsigned char *memory, *b, *out;
+
+  if (hash < 0) RETURN_STRING_ERROR(L, "Unknown hash");
+  if (n < 2 || (n & (n - 1)) != 0) RETURN_STRING_ERROR(L, "N must be a power of 2 greater than 1");
+  if (r < 1 || p < 1 || (ulong64)r * (ulong64)p >= ((ulong64)1 << 30)) RETURN_STRING_ERROR(L, "r * p must be below 2^30");
+  if (length < 0 || (ulong64)length > (ulong64)0xffffffffUL * 32) RETURN_STRING_ERROR(L, "Length out of range");
+  if (threads > p) threads = (int)p;
+
+  lane_size    = 128 * (size_t)r;
+  scratch_size = lane_size * 2;
+  if ((ulong64)n > (((size_t)-1) - scratch_size) / lane_size / (size_t)threads) RETURN_STRING_ERROR(L, "N * r too large");
+  hash_length = hash_descriptor[hash].hashsize;
+  blocks = ((unsigned long)length + hash_length - 1) / hash_length;
+  (void)lcrypt_check(L, _lcrypt_hmac_pads(&pads, hash, password, (unsigned long)password_length));
+
+  /* the lanes, the output and every thread's V and XY in one allocation */
+  memory = lcrypt_malloc(L, lane_size * (size_t)p + blocks * hash_length + 1 + (size_t)threads * (lane_size * (size_t)n + scratch_size) + 64);
+  b   = memory;
+  out = b + lane_size * (size_t)p;
+  for (i = 0; i < threads; ++i) {
+    unsigned char *scratch = out + blocks * hash_length + 1 + (size_t)i * (lane_size * (size_t)n + scratch_size);
+    scratch += (4 - (size_t)scratch % 4) % 4;
+    jobs[i].b     = b;
+    jobs[i].r     = (unsigned long)r;
+    jobs[i].n     = (ulong64)n;
+    jobs[i].first = (unsigned long)p * (unsigned long)i / (unsigned long)threads;
+    jobs[i].count = (unsigned long)p * (unsigned long)(i + 1) / (unsigned long)threads - jobs[i].first;
+    jobs[i].v     = (uint32_t*)scratch;
+    jobs[i].xy    = (uint32_t*)(scratch + lane_size * (size_t)n);
+  }
+
+  err = _lcrypt_pbkdf2(&pads, salt, (unsigned long)salt_length, 1, b, (unsigned long)(lane_size * (size_t)p / hash_length), 1);
+  if (err == CRYPT_OK) {
+    lcrypt_parallel(_lcrypt_scrypt_job, jobs, sizeof(jobs[0]), threads);
+    err = _lcrypt_pbkdf2(&pads, b, (unsigned long)(lane_size * (size_t)p), 1, out, blocks, 1);
+  }
+  if (err == CRYPT_OK) lua_pushlstring(L, (char*)out, (size_t)length);
+  zeromem(&pads, sizeof(pads));
+  zeromem(memory, lane_size * (size_t)p + blocks * hash_length);
+  free(memory);
+  (void)lcrypt_check(L, err);
+  return 1;
+}
+
+static void lcrypt_start_kdf (lua_State *L) {
+  /* pbkdf2 and hkdf resolve their hash names like lcrypt.digest */
+  #define ADD_RESOLVING_FUNCTION(L,name)                  \
+  {                                                       \
+    lua_pushstring(L, #name);                             \
+    lua_newtable(L);                                      \
+    lua_pushcclosure(L, lcrypt_ ## name, 1);              \
+    lua_settable(L, -3);                                  \
+  }
+  ADD_RESOLVING_FUNCTION(L, pbkdf2);
+  ADD_RESOLVING_FUNCTION(L, hkdf);
+  #undef ADD_RESOLVING_FUNCTION
+  ADD_FUNCTION(L, scrypt);
+}
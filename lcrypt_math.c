@@ -443,7 +443,8 @@ static int lcrypt_bigint_length (lua_State *L) {
   return 1;
 }
 
-static int lcrypt_bigint_index (lua_State *L) {
+/* the computed fields, methods are found in lcrypt_bigint_methods first */
+static int lcrypt_bigint_properties (lua_State *L) {
   lcrypt_bigint *bi = luaL_checkudata(L, 1, "LCRYPT_BIGINT");
   const char *index = luaL_checkstring(L, 2);
 
@@ -481,17 +482,6 @@ static int lcrypt_bigint_index (lua_State *L) {
       return 1;
     }
   #endif
-
-  if (strcmp(index, "add")     == 0) { lua_pushcfunction(L, lcrypt_bigint_add); return 1; }
-  if (strcmp(index, "sub")     == 0) { lua_pushcfunction(L, lcrypt_bigint_sub); return 1; }
-  if (strcmp(index, "mul")     == 0) { lua_pushcfunction(L, lcrypt_bigint_mul); return 1; }
-  if (strcmp(index, "div")     == 0) { lua_pushcfunction(L, lcrypt_bigint_divmod); return 1; }
-  if (strcmp(index, "mod")     == 0) { lua_pushcfunction(L, lcrypt_bigint_mod); return 1; }
-  if (strcmp(index, "gcd")     == 0) { lua_pushcfunction(L, lcrypt_bigint_gcd); return 1; }
-  if (strcmp(index, "lcm")     == 0) { lua_pushcfunction(L, lcrypt_bigint_lcm); return 1; }
-  if (strcmp(index, "invmod")  == 0) { lua_pushcfunction(L, lcrypt_bigint_invmod); return 1; }
-  if (strcmp(index, "mulmod")  == 0) { lua_pushcfunction(L, lcrypt_bigint_mulmod); return 1; }
-  if (strcmp(index, "exptmod") == 0) { lua_pushcfunction(L, lcrypt_bigint_exptmod); return 1; }
   return 0;
 }
 
@@ -558,8 +548,21 @@ static int lcrypt_bigint_create (lua_State *L) {
   return 1;
 }
 
+static const struct luaL_Reg lcrypt_bigint_methods[] = {
+  {"add",     &lcrypt_bigint_add},
+  {"sub",     &lcrypt_bigint_sub},
+  {"mul",     &lcrypt_bigint_mul},
+  {"div",     &lcrypt_bigint_divmod},
+  {"mod",     &lcrypt_bigint_mod},
+  {"gcd",     &lcrypt_bigint_gcd},
+  {"lcm",     &lcrypt_bigint_lcm},
+  {"invmod",  &lcrypt_bigint_invmod},
+  {"mulmod",  &lcrypt_bigint_mulmod},
+  {"exptmod", &lcrypt_bigint_exptmod},
+  {NULL,      NULL}
+};
+
 static const struct luaL_Reg lcrypt_bigint_flib[] = {
-  {"__index",    &lcrypt_bigint_index},
   {"__add",      &lcrypt_bigint_add},
   {"__sub",      &lcrypt_bigint_sub},
   {"__mul",      &lcrypt_bigint_mul},
@@ -578,6 +581,7 @@ static const struct luaL_Reg lcrypt_bigint_flib[] = {
 static void lcrypt_start_math (lua_State *L) {
   (void)luaL_newmetatable(L, "LCRYPT_BIGINT");
   (void)luaL_register(L, NULL, lcrypt_bigint_flib);
+  lcrypt_set_index(L, lcrypt_bigint_methods, lcrypt_bigint_properties);
   lua_pop(L, 1);
 
   #ifndef USE_NCIPHER
@@ -0,0 +1,291 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+/*
+ * Multi-buffer SHA-256 / SHA-224, SHA-1 and MD5. Eight independent messages are hashed at once, one per
+ * 32 bit lane of an AVX2 register, and a lane is handed the next message as soon as its own is done, so a
+ * batch of mixed lengths keeps every lane busy until the last few messages.
+ */
+
+#define LCRYPT_MULTIHASH_LANES 8
+
+/* state[w][j] is word w of lane j, blocks[j] the 64 byte block lane j takes next */
+typedef void (*lcrypt_multihash_compress_t)(uint32_t state[][LCRYPT_MULTIHASH_LANES], const unsigned char *const *blocks);
+
+typedef struct {
+  const char *name;
+  int words;                      /* state words */
+  unsigned long digest_length;
+  int big_endian;                 /* of the message words, the length and the digest */
+  uint32_t iv[8];
+  lcrypt_multihash_compress_t compress;
+} lcrypt_multihash_t;
+
+#ifdef LCRYPT_X86
+
+/* word offset / 4 of every lane, byte swapped when big */
+LCRYPT_TARGET("avx2") static inline __m256i _lcrypt_multihash_load (const unsigned char *const *blocks, int offset, int big) {
+  uint32_t w[LCRYPT_MULTIHASH_LANES];
+  int j;
+  if (big) {
+    for (j = 0; j < LCRYPT_MULTIHASH_LANES; ++j) LOAD32H(w[j], blocks[j] + offset);
+  } else {
+    for (j = 0; j < LCRYPT_MULTIHASH_LANES; ++j) LOAD32L(w[j], blocks[j] + offset);
+  }
+  return _mm256_loadu_si256((const __m256i*)w);
+}
+
+#define MULTIHASH_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define MULTIHASH_ROTR(v, n) _mm256_or_si256(_mm256_srli_epi32(v, n), _mm256_slli_epi32(v, 32 - (n)))
+#define MULTIHASH_ADD3(a, b, c) _mm256_add_epi32(_mm256_add_epi32(a, b), c)
+
+LCRYPT_TARGET("avx2") static void _lcrypt_multihash_sha256_avx2 (uint32_t state[][LCRYPT_MULTIHASH_LANES], const unsigned char *const *blocks) {
+  __m256i s[8], v[8], w[16];
+  int i;
+  for (i = 0; i < 8; ++i) v[i] = s[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+  for (i = 0; i < 64; ++i) {
+    __m256i t1, t2;
+    if (i < 16) {
+      w[i] = _lcrypt_multihash_load(blocks, 4 * i, 1);
+    } else {
+      __m256i w2 = w[(i - 2) & 15], w15 = w[(i - 15) & 15];
+      __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(MULTIHASH_ROTR(w15, 7), MULTIHASH_ROTR(w15, 18)), _mm256_srli_epi32(w15, 3));
+      __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(MULTIHASH_ROTR(w2, 17), MULTIHASH_ROTR(w2, 19)), _mm256_srli_epi32(w2, 10));
+      w[i & 15] = _mm256_add_epi32(MULTIHASH_ADD3(w[i & 15], s0, w[(i - 7) & 15]), s1);
+    }
+    /* v[0..7] are a..h */
+    t1 = _mm256_xor_si256(_mm256_xor_si256(MULTIHASH_ROTR(v[4], 6), MULTIHASH_ROTR(v[4], 11)), MULTIHASH_ROTR(v[4], 25));
+    t1 = MULTIHASH_ADD3(v[7], t1, _mm256_xor_si256(_mm256_and_si256(v[4], v[5]), _mm256_andnot_si256(v[4], v[6])));
+    t1 = MULTIHASH_ADD3(t1, _mm256_set1_epi32((int)lcrypt_sha256_k[i]), w[i & 15]);
+    t2 = _mm256_xor_si256(_mm256_xor_si256(MULTIHASH_ROTR(v[0], 2), MULTIHASH_ROTR(v[0], 13)), MULTIHASH_ROTR(v[0], 22));
+    t2 = _mm256_add_epi32(t2, _mm256_or_si256(_mm256_and_si256(v[0], v[1]), _mm256_and_si256(v[2], _mm256_or_si256(v[0], v[1]))));
+    v[7] = v[6]; v[6] = v[5]; v[5] = v[4]; v[4] = _mm256_add_epi32(v[3], t1);
+    v[3] = v[2]; v[2] = v[1]; v[1] = v[0]; v[0] = _mm256_add_epi32(t1, t2);
+  }
+  for (i = 0; i < 8; ++i) _mm256_storeu_si256((__m256i*)state[i], _mm256_add_epi32(s[i], v[i]));
+}
+
+LCRYPT_TARGET("avx2") static void _lcrypt_multihash_sha1_avx2 (uint32_t state[][LCRYPT_MULTIHASH_LANES], const unsigned char *const *blocks) {
+  __m256i s[5], a, b, c, d, e, w[16];
+  int i;
+  for (i = 0; i < 5; ++i) s[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+  a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4];
+  for (i = 0; i < 80; ++i) {
+    __m256i f, k, t;
+    if (i < 16) {
+      w[i] = _lcrypt_multihash_load(blocks, 4 * i, 1);
+    } else {
+      t = _mm256_xor_si256(_mm256_xor_si256(w[(i - 3) & 15], w[(i - 8) & 15]), _mm256_xor_si256(w[(i - 14) & 15], w[i & 15]));
+      w[i & 15] = MULTIHASH_ROTL(t, 1);
+    }
+    if (i < 20) {
+      f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+      k = _mm256_set1_epi32(0x5a827999);
+    } else if (i < 40) {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32(0x6ed9eba1);
+    } else if (i < 60) {
+      f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+      k = _mm256_set1_epi32((int)0x8f1bbcdcUL);
+    } else {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32((int)0xca62c1d6UL);
+    }
+    t = _mm256_add_epi32(MULTIHASH_ADD3(MULTIHASH_ROTL(a, 5), f, e), _mm256_add_epi32(k, w[i & 15]));
+    e = d; d = c; c = MULTIHASH_ROTL(b, 30); b = a; a = t;
+  }
+  s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b); s[2] = _mm256_add_epi32(s[2], c);
+  s[3] = _mm256_add_epi32(s[3], d); s[4] = _mm256_add_epi32(s[4], e);
+  for (i = 0; i < 5; ++i) _mm256_storeu_si256((__m256i*)state[i], s[i]);
+}
+
+static const uint32_t lcrypt_multihash_md5_k[64] = {
+  0xd76aa478UL, 0xe8c7b756UL, 0x242070dbUL, 0xc1bdceeeUL, 0xf57c0fafUL, 0x4787c62aUL, 0xa8304613UL, 0xfd469501UL,
+  0x698098d8UL, 0x8b44f7afUL, 0xffff5bb1UL, 0x895cd7beUL, 0x6b901122UL, 0xfd987193UL, 0xa679438eUL, 0x49b40821UL,
+  0xf61e2562UL, 0xc040b340UL, 0x265e5a51UL, 0xe9b6c7aaUL, 0xd62f105dUL, 0x02441453UL, 0xd8a1e681UL, 0xe7d3fbc8UL,
+  0x21e1cde6UL, 0xc33707d6UL, 0xf4d50d87UL, 0x455a14edUL, 0xa9e3e905UL, 0xfcefa3f8UL, 0x676f02d9UL, 0x8d2a4c8aUL,
+  0xfffa3942UL, 0x8771f681UL, 0x6d9d6122UL, 0xfde5380cUL, 0xa4beea44UL, 0x4bdecfa9UL, 0xf6bb4b60UL, 0xbebfbc70UL,
+  0x289b7ec6UL, 0xeaa127faUL, 0xd4ef3085UL, 0x04881d05UL, 0xd9d4d039UL, 0xe6db99e5UL, 0x1fa27cf8UL, 0xc4ac5665UL,
+  0xf4292244UL, 0x432aff97UL, 0xab9423a7UL, 0xfc93a039UL, 0x655b59c3UL, 0x8f0ccc92UL, 0xffeff47dUL, 0x85845dd1UL,
+  0x6fa87e4fUL, 0xfe2ce6e0UL, 0xa3014314UL, 0x4e0811a1UL, 0xf7537e82UL, 0xbd3af235UL, 0x2ad7d2bbUL, 0xeb86d391UL
+};
+
+static const unsigned char lcrypt_multihash_md5_r[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+/* the shift is a variable here, so the rotate goes through the count register forms */
+#define MULTIHASH_ROTLV(v, n) _mm256_or_si256(_mm256_sll_epi32(v, _mm_cvtsi32_si128(n)), _mm256_srl_epi32(v, _mm_cvtsi32_si128(32 - (n))))
+
+LCRYPT_TARGET("avx2") static void _lcrypt_multihash_md5_avx2 (uint32_t state[][LCRYPT_MULTIHASH_LANES], const unsigned char *const *blocks) {
+  __m256i s[4], a, b, c, d, m[16], ones = _mm256_set1_epi32(-1);
+  int i;
+  for (i = 0; i < 4; ++i) s[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+  for (i = 0; i < 16; ++i) m[i] = _lcrypt_multihash_load(blocks, 4 * i, 0);
+  a = s[0]; b = s[1]; c = s[2]; d = s[3];
+  for (i = 0; i < 64; ++i) {
+    __m256i f, t;
+    int g;
+    switch (i >> 4) {
+      case 0:  f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))); g = i;                break;
+      case 1:  f = _mm256_xor_si256(c, _mm256_and_si256(d, _mm256_xor_si256(b, c))); g = (5 * i + 1) & 15; break;
+      case 2:  f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);                      g = (3 * i + 5) & 15; break;
+      default: f = _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, ones))); g = (7 * i) & 15;   break;
+    }
+    t = MULTIHASH_ADD3(a, f, _mm256_add_epi32(_mm256_set1_epi32((int)lcrypt_multihash_md5_k[i]), m[g]));
+    a = d; d = c; c = b;
+    b = _mm256_add_epi32(b, MULTIHASH_ROTLV(t, lcrypt_multihash_md5_r[((i >> 4) << 2) | (i & 3)]));
+  }
+  s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+  s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+  for (i = 0; i < 4; ++i) _mm256_storeu_si256((__m256i*)state[i], s[i]);
+}
+
+#undef MULTIHASH_ROTLV
+#undef MULTIHASH_ADD3
+#undef MULTIHASH_ROTR
+#undef MULTIHASH_ROTL
+
+static const lcrypt_multihash_t lcrypt_multihashes[] = {
+  { "sha256", 8, 32, 1,
+    { 0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL, 0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL },
+    _lcrypt_multihash_sha256_avx2 },
+  { "sha224", 8, 28, 1,
+    { 0xc1059ed8UL, 0x367cd507UL, 0x3070dd17UL, 0xf70e5939UL, 0xffc00b31UL, 0x68581511UL, 0x64f98fa7UL, 0xbefa4fa4UL },
+    _lcrypt_multihash_sha256_avx2 },
+  { "sha1", 5, 20, 1,
+    { 0x67452301UL, 0xefcdab89UL, 0x98badcfeUL, 0x10325476UL, 0xc3d2e1f0UL },
+    _lcrypt_multihash_sha1_avx2 },
+  { "md5", 4, 16, 0,
+    { 0x67452301UL, 0xefcdab89UL, 0x98badcfeUL, 0x10325476UL },
+    _lcrypt_multihash_md5_avx2 },
+  { NULL, 0, 0, 0, { 0 }, NULL }
+};
+
+#endif
+
+static int lcrypt_multihash_avx2 = 0;    /* set by lcrypt_multihash_implementation once every kernel passed */
+
+/* the multi-buffer kernel for a hash name, NULL when there is none or the kernels are not in use */
+static const lcrypt_multihash_t *lcrypt_multihash_find (const char *name) {
+  #ifdef LCRYPT_X86
+    const lcrypt_multihash_t *m;
+    if (!lcrypt_multihash_avx2 || name == NULL) return NULL;
+    for (m = lcrypt_multihashes; m->name != NULL; ++m) {
+      if (strcmp(m->name, name) == 0) return m;
+    }
+  #else
+    (void)name;
+  #endif
+  return NULL;
+}
+
+typedef struct {
+  unsigned long message, block, blocks;
+  unsigned char tail[64];
+} lcrypt_multihash_lane_t;
+
+/* block k of the padded message, the last one or two are built in lane->tail */
+static const unsigned char *_lcrypt_multihash_block (const lcrypt_multihash_t *m, lcrypt_multihash_lane_t *lane, const unsigned char *in, unsigned long length) {
+  unsigned long offset = lane->block * 64;
+  if (offset + 64 <= length) return in + offset;
+  memset(lane->tail, 0, sizeof(lane->tail));
+  if (offset < length) memcpy(lane->tail, in + offset, length - offset);
+  if (offset <= length) lane->tail[length - offset] = 0x80;
+  if (lane->block + 1 == lane->blocks) {
+    ulong64 bits = (ulong64)length << 3;
+    if (m->big_endian) STORE64H(bits, lane->tail + 56); else STORE64L(bits, lane->tail + 56);
+  }
+  return lane->tail;
+}
+
+/* hashes count messages into out, digest_length bytes each */
+static void lcrypt_multihash (const lcrypt_multihash_t *m, const unsigned char *const *in, const unsigned long *length, unsigned long count, unsigned char *out) {
+  static const unsigned char idle[64];
+  uint32_t state[8][LCRYPT_MULTIHASH_LANES];
+  lcrypt_multihash_lane_t lanes[LCRYPT_MULTIHASH_LANES];
+  const unsigned char *blocks[LCRYPT_MULTIHASH_LANES];
+  unsigned long next = 0;
+  int i, j, active = 0;
+
+  memset(state, 0, sizeof(state));
+  for (j = 0; j < LCRYPT_MULTIHASH_LANES; ++j) lanes[j].blocks = 0;
+  for (;;) {
+    /* hand every idle lane the next message */
+    for (j = 0; j < LCRYPT_MULTIHASH_LANES; ++j) {
+      if (lanes[j].blocks != 0) continue;
+      if (next == count) break;
+      lanes[j].message = next++;
+      lanes[j].block   = 0;
+      lanes[j].blocks  = (length[lanes[j].message] + 8) / 64 + 1;
+      for (i = 0; i < m->words; ++i) state[i][j] = m->iv[i];
+      ++active;
+    }
+    if (active == 0) break;
+
+    for (j = 0; j < LCRYPT_MULTIHASH_LANES; ++j) {
+      lcrypt_multihash_lane_t *lane = &lanes[j];
+      blocks[j] = lane->blocks == 0 ? idle : _lcrypt_multihash_block(m, lane, in[lane->message], length[lane->message]);
+    }
+    m->compress(state, blocks);
+
+    for (j = 0; j < LCRYPT_MULTIHASH_LANES; ++j) {
+      lcrypt_multihash_lane_t *lane = &lanes[j];
+      unsigned char digest[32];
+      if (lane->blocks == 0 || ++lane->block < lane->blocks) continue;
+      for (i = 0; i < m->words; ++i) {
+        if (m->big_endian) STORE32H(state[i][j], digest + 4 * i); else STORE32L(state[i][j], digest + 4 * i);
+      }
+      memcpy(out + lane->message * m->digest_length, digest, m->digest_length);
+      lane->blocks = 0;
+      --active;
+    }
+  }
+  zeromem(state, sizeof(state));
+  zeromem(lanes, sizeof(lanes));
+}
+
+#ifdef LCRYPT_X86
+
+/* a kernel against the registered descriptor of its hash, the lengths fall around the padding boundaries */
+static int _lcrypt_multihash_test (const lcrypt_multihash_t *m) {
+  static const unsigned long lengths[] = { 0, 55, 56, 64, 119, 1000, 0, 55, 56, 64, 119 };
+  const unsigned long count = sizeof(lengths) / sizeof(lengths[0]);
+  const unsigned char *in[sizeof(lengths) / sizeof(lengths[0])];
+  unsigned char data[1024], out[sizeof(lengths) / sizeof(lengths[0]) * 32], digest[MAXBLOCKSIZE];
+  hash_state state;
+  unsigned long i;
+  int hash = find_hash(m->name);
+
+  if (hash < 0) return CRYPT_INVALID_HASH;
+  for (i = 0; i < sizeof(data); ++i) data[i] = (unsigned char)(i * 7 + 1);
+  /* eleven messages for eight lanes, so lanes are handed a second message mid batch */
+  for (i = 0; i < count; ++i) in[i] = data + i;
+  lcrypt_multihash(m, in, lengths, count, out);
+  for (i = 0; i < count; ++i) {
+    if (hash_descriptor[hash].init(&state) != CRYPT_OK) return CRYPT_FAIL_TESTVECTOR;
+    if (hash_descriptor[hash].process(&state, in[i], lengths[i]) != CRYPT_OK) return CRYPT_FAIL_TESTVECTOR;
+    if (hash_descriptor[hash].done(&state, digest) != CRYPT_OK) return CRYPT_FAIL_TESTVECTOR;
+    if (memcmp(digest, out + i * m->digest_length, (size_t)m->digest_length) != 0) return CRYPT_FAIL_TESTVECTOR;
+  }
+  return CRYPT_OK;
+}
+
+#endif
+
+/* for lcrypt.implementations, the kernels are only used once they match the registered hashes */
+static const char *lcrypt_multihash_implementation (void) {
+  #ifdef LCRYPT_X86
+    const lcrypt_multihash_t *m;
+    int passed = lcrypt_cpu.avx2;
+    for (m = lcrypt_multihashes; passed && m->name != NULL; ++m) passed = _lcrypt_multihash_test(m) == CRYPT_OK;
+    lcrypt_multihash_avx2 = passed;
+    return passed ? "avx2" : "portable";
+  #else
+    return "portable";
+  #endif
+}
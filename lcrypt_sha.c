@@ -0,0 +1,311 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+/*
+ * Accelerated SHA-1, SHA-224/256 (SHA extensions) and SHA-384/512 (SSSE3 message schedule, BMI2 rotates).
+ * They are libtomcrypt's descriptors with process and done swapped, on the same hash_state layout, so
+ * init, hmac and everything else that goes through hash_descriptor keeps working unchanged.
+ */
+
+typedef struct {
+  const char *name;
+  const char *implementation;     /* NULL until lcrypt_sha_desc saw the name */
+  struct ltc_hash_descriptor desc;
+} lcrypt_sha_accel_t;
+
+static lcrypt_sha_accel_t lcrypt_sha_accel[] = {
+  { "sha1", NULL, { 0 } },  { "sha224", NULL, { 0 } },  { "sha256", NULL, { 0 } },
+  { "sha384", NULL, { 0 } },  { "sha512", NULL, { 0 } },  { NULL, NULL, { 0 } }
+};
+
+#ifdef LCRYPT_X86
+
+static const ulong32 lcrypt_sha256_k[64] = {
+  0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+  0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+  0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+  0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+  0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+  0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+  0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+  0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+LCRYPT_TARGET("sha,sse4.1") static void _lcrypt_sha256_shani (ulong32 *state, const unsigned char *in, unsigned long blocks) {
+  const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+  __m128i abef, cdgh, t;
+  /* the rounds want the state as ABEF and CDGH */
+  t    = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xb1);
+  cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1b);
+  abef = _mm_alignr_epi8(t, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+  for (; blocks > 0; --blocks, in += 64) {
+    __m128i m[4], abef_save = abef, cdgh_save = cdgh;
+    int i;
+    for (i = 0; i < 4; ++i) m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 16 * i)), swap);
+    for (i = 0; i < 16; ++i) {
+      t    = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i*)(lcrypt_sha256_k + 4 * i)));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, t);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(t, 0x0e));
+      /* words 4i+16 .. 4i+19 replace the ones just used */
+      if (i < 12) {
+        t = _mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]), _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+        m[i & 3] = _mm_sha256msg2_epu32(t, m[(i + 3) & 3]);
+      }
+    }
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+  }
+
+  t    = _mm_shuffle_epi32(abef, 0x1b);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(t, cdgh, 0xf0));
+  _mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(cdgh, t, 8));
+}
+
+/* sha1rnds4 takes its round function as an immediate */
+#define SHA1_SHANI_RNDS4(abcd, e, i)                                                    \
+  switch ((i) / 5) {                                                                    \
+    case 0:  abcd = _mm_sha1rnds4_epu32(abcd, e, 0); break;                             \
+    case 1:  abcd = _mm_sha1rnds4_epu32(abcd, e, 1); break;                             \
+    case 2:  abcd = _mm_sha1rnds4_epu32(abcd, e, 2); break;                             \
+    default: abcd = _mm_sha1rnds4_epu32(abcd, e, 3); break;                             \
+  }
+
+LCRYPT_TARGET("sha,sse4.1") static void _lcrypt_sha1_shani (ulong32 *state, const unsigned char *in, unsigned long blocks) {
+  const __m128i swap = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+  __m128i e0   = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+  for (; blocks > 0; --blocks, in += 64) {
+    __m128i m[4], e[2], abcd_save = abcd, e_save = e0;
+    int i;
+    for (i = 0; i < 4; ++i) m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 16 * i)), swap);
+    e[0] = e0;
+    /* rounds 4i .. 4i+3, the two e registers take turns holding the next e */
+    for (i = 0; i < 20; ++i) {
+      if (i == 0) e[0] = _mm_add_epi32(e[0], m[0]);
+      else        e[i & 1] = _mm_sha1nexte_epu32(e[i & 1], m[i & 3]);
+      e[(i + 1) & 1] = abcd;
+      SHA1_SHANI_RNDS4(abcd, e[i & 1], i);
+      if (i >= 1 && i <= 16) m[(i - 1) & 3] = _mm_sha1msg1_epu32(m[(i - 1) & 3], m[i & 3]);
+      if (i >= 2 && i <= 17) m[(i - 2) & 3] = _mm_xor_si128(m[(i - 2) & 3], m[i & 3]);
+      if (i >= 3 && i <= 18) m[(i + 1) & 3] = _mm_sha1msg2_epu32(m[(i + 1) & 3], m[i & 3]);
+    }
+    e0   = _mm_sha1nexte_epu32(e[0], e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = (ulong32)_mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1_SHANI_RNDS4
+
+static const ulong64 lcrypt_sha512_k[80] = {
+  CONST64(0x428a2f98d728ae22), CONST64(0x7137449123ef65cd), CONST64(0xb5c0fbcfec4d3b2f), CONST64(0xe9b5dba58189dbbc),
+  CONST64(0x3956c25bf348b538), CONST64(0x59f111f1b605d019), CONST64(0x923f82a4af194f9b), CONST64(0xab1c5ed5da6d8118),
+  CONST64(0xd807aa98a3030242), CONST64(0x12835b0145706fbe), CONST64(0x243185be4ee4b28c), CONST64(0x550c7dc3d5ffb4e2),
+  CONST64(0x72be5d74f27b896f), CONST64(0x80deb1fe3b1696b1), CONST64(0x9bdc06a725c71235), CONST64(0xc19bf174cf692694),
+  CONST64(0xe49b69c19ef14ad2), CONST64(0xefbe4786384f25e3), CONST64(0x0fc19dc68b8cd5b5), CONST64(0x240ca1cc77ac9c65),
+  CONST64(0x2de92c6f592b0275), CONST64(0x4a7484aa6ea6e483), CONST64(0x5cb0a9dcbd41fbd4), CONST64(0x76f988da831153b5),
+  CONST64(0x983e5152ee66dfab), CONST64(0xa831c66d2db43210), CONST64(0xb00327c898fb213f), CONST64(0xbf597fc7beef0ee4),
+  CONST64(0xc6e00bf33da88fc2), CONST64(0xd5a79147930aa725), CONST64(0x06ca6351e003826f), CONST64(0x142929670a0e6e70),
+  CONST64(0x27b70a8546d22ffc), CONST64(0x2e1b21385c26c926), CONST64(0x4d2c6dfc5ac42aed), CONST64(0x53380d139d95b3df),
+  CONST64(0x650a73548baf63de), CONST64(0x766a0abb3c77b2a8), CONST64(0x81c2c92e47edaee6), CONST64(0x92722c851482353b),
+  CONST64(0xa2bfe8a14cf10364), CONST64(0xa81a664bbc423001), CONST64(0xc24b8b70d0f89791), CONST64(0xc76c51a30654be30),
+  CONST64(0xd192e819d6ef5218), CONST64(0xd69906245565a910), CONST64(0xf40e35855771202a), CONST64(0x106aa07032bbd1b8),
+  CONST64(0x19a4c116b8d2d0c8), CONST64(0x1e376c085141ab53), CONST64(0x2748774cdf8eeb99), CONST64(0x34b0bcb5e19b48a8),
+  CONST64(0x391c0cb3c5c95a63), CONST64(0x4ed8aa4ae3418acb), CONST64(0x5b9cca4f7763e373), CONST64(0x682e6ff3d6b2b8a3),
+  CONST64(0x748f82ee5defb2fc), CONST64(0x78a5636f43172f60), CONST64(0x84c87814a1f0ab72), CONST64(0x8cc702081a6439ec),
+  CONST64(0x90befffa23631e28), CONST64(0xa4506cebde82bde9), CONST64(0xbef9a3f7b2c67915), CONST64(0xc67178f2e372532b),
+  CONST64(0xca273eceea26619c), CONST64(0xd186b8c721c0c207), CONST64(0xeada7dd6cde0eb1e), CONST64(0xf57d4f7fee6ed178),
+  CONST64(0x06f067aa72176fba), CONST64(0x0a637dc5a2c898a6), CONST64(0x113f9804bef90dae), CONST64(0x1b710b35131c471b),
+  CONST64(0x28db77f523047d84), CONST64(0x32caab7b40c72493), CONST64(0x3c9ebe0a15c9bebc), CONST64(0x431d67c49c100d4c),
+  CONST64(0x4cc5d4becb3e42b6), CONST64(0x597f299cfc657e2a), CONST64(0x5fcb6fab3ad6faec), CONST64(0x6c44198c4a475817)
+};
+
+#define SHA512_ROR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define SHA512_VROR(v, n) _mm_or_si128(_mm_srli_epi64(v, n), _mm_slli_epi64(v, 64 - (n)))
+
+/* the whole schedule is expanded two words at a time in 128 bit registers, the rounds are scalar with rorx */
+LCRYPT_TARGET("ssse3,bmi2") static void _lcrypt_sha512_ssse3 (ulong64 *state, const unsigned char *in, unsigned long blocks) {
+  const __m128i swap = _mm_set_epi64x(0x08090a0b0c0d0e0fLL, 0x0001020304050607LL);
+  ulong64 w[80];
+  int i;
+
+  for (; blocks > 0; --blocks, in += 128) {
+    ulong64 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (i = 0; i < 16; i += 2) {
+      _mm_storeu_si128((__m128i*)(w + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 8 * i)), swap));
+    }
+    for (i = 16; i < 80; i += 2) {
+      __m128i w2 = _mm_loadu_si128((const __m128i*)(w + i - 2)), w15 = _mm_loadu_si128((const __m128i*)(w + i - 15));
+      __m128i s0 = _mm_xor_si128(_mm_xor_si128(SHA512_VROR(w15, 1), SHA512_VROR(w15, 8)), _mm_srli_epi64(w15, 7));
+      __m128i s1 = _mm_xor_si128(_mm_xor_si128(SHA512_VROR(w2, 19), SHA512_VROR(w2, 61)), _mm_srli_epi64(w2, 6));
+      __m128i t  = _mm_add_epi64(_mm_loadu_si128((const __m128i*)(w + i - 16)), _mm_loadu_si128((const __m128i*)(w + i - 7)));
+      _mm_storeu_si128((__m128i*)(w + i), _mm_add_epi64(_mm_add_epi64(t, s0), s1));
+    }
+    for (i = 0; i < 80; ++i) {
+      ulong64 t1 = h + (SHA512_ROR(e, 14) ^ SHA512_ROR(e, 18) ^ SHA512_ROR(e, 41)) + (g ^ (e & (f ^ g))) + lcrypt_sha512_k[i] + w[i];
+      ulong64 t2 = (SHA512_ROR(a, 28) ^ SHA512_ROR(a, 34) ^ SHA512_ROR(a, 39)) + (((a | b) & c) | (a & b));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+  zeromem(w, sizeof(w));
+}
+
+#undef SHA512_VROR
+#undef SHA512_ROR
+
+/* libtomcrypt's process loop, except that whole blocks go to compress in one run */
+#define LCRYPT_SHA_PROCESS(name, field, block_size, compress)                                      \
+  static int name (hash_state *md, const unsigned char *in, unsigned long inlen) {                 \
+    if (md == NULL || (in == NULL && inlen > 0)) return CRYPT_INVALID_ARG;                         \
+    if (md->field.curlen > sizeof(md->field.buf)) return CRYPT_INVALID_ARG;                        \
+    while (inlen > 0) {                                                                            \
+      if (md->field.curlen == 0 && inlen >= block_size) {                                          \
+        unsigned long blocks = inlen / block_size;                                                 \
+        compress(md->field.state, in, blocks);                                                     \
+        md->field.length += (ulong64)blocks * block_size * 8;                                      \
+        in += blocks * block_size; inlen -= blocks * block_size;                                   \
+      } else {                                                                                     \
+        unsigned long n = block_size - (unsigned long)md->field.curlen;                            \
+        if (n > inlen) n = inlen;                                                                  \
+        memcpy(md->field.buf + md->field.curlen, in, (size_t)n);                                   \
+        md->field.curlen += n; in += n; inlen -= n;                                                \
+        if (md->field.curlen == block_size) {                                                      \
+          compress(md->field.state, md->field.buf, 1);                                             \
+          md->field.length += block_size * 8;                                                      \
+          md->field.curlen = 0;                                                                    \
+        }                                                                                          \
+      }                                                                                            \
+    }                                                                                              \
+    return CRYPT_OK;                                                                               \
+  }
+
+/* appends the 0x80, the zeros and the bit length (the last 8 bytes, sha512's upper 64 bits stay zero) */
+#define LCRYPT_SHA_PAD(md, field, block_size, compress)                                            \
+  {                                                                                                \
+    if (md->field.curlen >= sizeof(md->field.buf)) return CRYPT_INVALID_ARG;                       \
+    md->field.length += md->field.curlen * 8;                                                      \
+    md->field.buf[md->field.curlen++] = 0x80;                                                      \
+    if (md->field.curlen > block_size - (block_size) / 8) {                                        \
+      memset(md->field.buf + md->field.curlen, 0, (size_t)(block_size - md->field.curlen));        \
+      compress(md->field.state, md->field.buf, 1);                                                 \
+      md->field.curlen = 0;                                                                        \
+    }                                                                                              \
+    memset(md->field.buf + md->field.curlen, 0, (size_t)(block_size - 8 - md->field.curlen));      \
+    STORE64H(md->field.length, md->field.buf + block_size - 8);                                    \
+    compress(md->field.state, md->field.buf, 1);                                                   \
+  }
+
+LCRYPT_SHA_PROCESS(_lcrypt_sha1_shani_process,   sha1,   64,  _lcrypt_sha1_shani)
+LCRYPT_SHA_PROCESS(_lcrypt_sha256_shani_process, sha256, 64,  _lcrypt_sha256_shani)
+LCRYPT_SHA_PROCESS(_lcrypt_sha512_ssse3_process, sha512, 128, _lcrypt_sha512_ssse3)
+
+static int _lcrypt_sha1_shani_done (hash_state *md, unsigned char *out) {
+  int i;
+  LCRYPT_SHA_PAD(md, sha1, 64, _lcrypt_sha1_shani);
+  for (i = 0; i < 5; ++i) STORE32H(md->sha1.state[i], out + 4 * i);
+  zeromem(md, sizeof(hash_state));
+  return CRYPT_OK;
+}
+
+/* sha224 is sha256 with its own iv, which init already set, and a shorter output */
+static int _lcrypt_sha256_shani_finish (hash_state *md, unsigned char *out, int words) {
+  int i;
+  LCRYPT_SHA_PAD(md, sha256, 64, _lcrypt_sha256_shani);
+  for (i = 0; i < words; ++i) STORE32H(md->sha256.state[i], out + 4 * i);
+  zeromem(md, sizeof(hash_state));
+  return CRYPT_OK;
+}
+
+static int _lcrypt_sha256_shani_done (hash_state *md, unsigned char *out) { return _lcrypt_sha256_shani_finish(md, out, 8); }
+static int _lcrypt_sha224_shani_done (hash_state *md, unsigned char *out) { return _lcrypt_sha256_shani_finish(md, out, 7); }
+
+static int _lcrypt_sha512_ssse3_finish (hash_state *md, unsigned char *out, int words) {
+  int i;
+  LCRYPT_SHA_PAD(md, sha512, 128, _lcrypt_sha512_ssse3);
+  for (i = 0; i < words; ++i) STORE64H(md->sha512.state[i], out + 8 * i);
+  zeromem(md, sizeof(hash_state));
+  return CRYPT_OK;
+}
+
+static int _lcrypt_sha512_ssse3_done (hash_state *md, unsigned char *out) { return _lcrypt_sha512_ssse3_finish(md, out, 8); }
+static int _lcrypt_sha384_ssse3_done (hash_state *md, unsigned char *out) { return _lcrypt_sha512_ssse3_finish(md, out, 6); }
+
+#undef LCRYPT_SHA_PAD
+#undef LCRYPT_SHA_PROCESS
+
+/* the accelerated descriptor has to agree with the portable one over block boundaries and split updates */
+static int _lcrypt_sha_test (const struct ltc_hash_descriptor *accel, const struct ltc_hash_descriptor *portable) {
+  static const unsigned long lengths[] = { 0, 3, 55, 56, 64, 111, 112, 128, 129, 1000 };
+  unsigned char in[1000], a[MAXBLOCKSIZE], b[MAXBLOCKSIZE];
+  hash_state ha, hb;
+  size_t i;
+  for (i = 0; i < sizeof(in); ++i) in[i] = (unsigned char)(i * 7 + 1);
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+    unsigned long l = lengths[i];
+    if (accel->init(&ha) != CRYPT_OK || portable->init(&hb) != CRYPT_OK) return CRYPT_FAIL_TESTVECTOR;
+    if (accel->process(&ha, in, l / 3) != CRYPT_OK || accel->process(&ha, in + l / 3, l - l / 3) != CRYPT_OK) return CRYPT_FAIL_TESTVECTOR;
+    if (portable->process(&hb, in, l) != CRYPT_OK) return CRYPT_FAIL_TESTVECTOR;
+    if (accel->done(&ha, a) != CRYPT_OK || portable->done(&hb, b) != CRYPT_OK) return CRYPT_FAIL_TESTVECTOR;
+    if (memcmp(a, b, (size_t)portable->hashsize) != 0) return CRYPT_FAIL_TESTVECTOR;
+  }
+  return CRYPT_OK;
+}
+
+#endif
+
+/* the descriptor to register for portable, an accelerated copy when the cpu has what it needs */
+static const struct ltc_hash_descriptor *lcrypt_sha_desc (const struct ltc_hash_descriptor *portable) {
+  lcrypt_sha_accel_t *a;
+  for (a = lcrypt_sha_accel; a->name != NULL; ++a) {
+    if (strcmp(a->name, portable->name) == 0) break;
+  }
+  if (a->name == NULL) return portable;
+  a->implementation = "portable";
+  a->desc = *portable;
+  #ifdef LCRYPT_X86
+  {
+    const char *implementation = NULL;
+    if (lcrypt_cpu.sha && lcrypt_cpu.sse41) {
+      implementation = "shani";
+      if (strcmp(a->name, "sha1") == 0)   { a->desc.process = _lcrypt_sha1_shani_process;   a->desc.done = _lcrypt_sha1_shani_done; }
+      else if (strcmp(a->name, "sha224") == 0) { a->desc.process = _lcrypt_sha256_shani_process; a->desc.done = _lcrypt_sha224_shani_done; }
+      else if (strcmp(a->name, "sha256") == 0) { a->desc.process = _lcrypt_sha256_shani_process; a->desc.done = _lcrypt_sha256_shani_done; }
+      else implementation = NULL;
+    }
+    if (implementation == NULL && lcrypt_cpu.ssse3 && lcrypt_cpu.bmi2) {
+      implementation = "ssse3";
+      if (strcmp(a->name, "sha384") == 0)      { a->desc.process = _lcrypt_sha512_ssse3_process; a->desc.done = _lcrypt_sha384_ssse3_done; }
+      else if (strcmp(a->name, "sha512") == 0) { a->desc.process = _lcrypt_sha512_ssse3_process; a->desc.done = _lcrypt_sha512_ssse3_done; }
+      else implementation = NULL;
+    }
+    if (implementation != NULL && _lcrypt_sha_test(&a->desc, portable) == CRYPT_OK) {
+      a->implementation = implementation;
+      return &a->desc;
+    }
+  }
+  #endif
+  return portable;
+}
+
+/* records the implementation of every name lcrypt_sha_desc was asked about, the module table must be on top */
+static void lcrypt_sha_set_implementations (lua_State *L) {
+  lcrypt_sha_accel_t *a;
+  for (a = lcrypt_sha_accel; a->name != NULL; ++a) {
+    if (a->implementation != NULL) lcrypt_set_implementation(L, a->name, a->implementation);
+  }
+}
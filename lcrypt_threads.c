@@ -0,0 +1,79 @@
+/**
+ *
+ * Copyright (c) 2011-2015 David Eder, InterTECH
+ * Copyright (c) 2015 Simbiose
+ *
+ * License: https://www.gnu.org/licenses/lgpl-2.1.html LGPL version 2.1
+ *
+ */
+
+#include <pthread.h>
+
+#define LCRYPT_THREADS_MAX        64
+#define LCRYPT_THREADS_MIN_SLICE  (64 * 1024)
+
+typedef void *(*lcrypt_job_t)(void *arg);
+
+static int lcrypt_threads_default = 1;
+
+static int lcrypt_threads_online (void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) return 1;
+  return (cpus > LCRYPT_THREADS_MAX) ? LCRYPT_THREADS_MAX : (int)cpus;
+}
+
+/* runs job once for each of the count argument structs, the first one on the calling thread */
+static void lcrypt_parallel (lcrypt_job_t job, void *args, size_t arg_size, int count) {
+  pthread_t threads[LCRYPT_THREADS_MAX];
+  int started[LCRYPT_THREADS_MAX];
+  int i;
+
+  for (i = 1; i < count; ++i)
+    started[i] = pthread_create(&threads[i], NULL, job, (char*)args + i * arg_size) == 0;
+
+  (void)job(args);
+
+  for (i = 1; i < count; ++i) {
+    if (started[i])
+      (void)pthread_join(threads[i], NULL);
+    else
+      (void)job((char*)args + i * arg_size); /* out of threads, do it here */
+  }
+}
+
+/* threads field of the option table at index or the module default */
+static int lcrypt_threads_requested (lua_State *L, int index) {
+  int threads = lcrypt_threads_default;
+
+  if (lua_istable(L, index)) {
+    lua_getfield(L, index, "threads");
+    if (lua_isnumber(L, -1) == 1) threads = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+
+  if (threads <= 0) threads = lcrypt_threads_online();
+  return (threads > LCRYPT_THREADS_MAX) ? LCRYPT_THREADS_MAX : threads;
+}
+
+/* the requested threads, but with at least MIN_SLICE bytes each */
+static int lcrypt_threads_option (lua_State *L, int index, size_t length) {
+  int threads = lcrypt_threads_requested(L, index);
+  if ((size_t)threads > length / LCRYPT_THREADS_MIN_SLICE) threads = (int)(length / LCRYPT_THREADS_MIN_SLICE);
+  return (threads < 1) ? 1 : threads;
+}
+
+/* count = lcrypt.threads([count]), 0 uses every online cpu */
+static int lcrypt_threads (lua_State *L) {
+  if (lua_isnumber(L, 1) == 1) {
+    int threads = luaL_checkint(L, 1);
+    if (threads < 0) RETURN_STRING_ERROR(L, "Thread count must not be negative");
+    lcrypt_threads_default = (threads == 0) ? lcrypt_threads_online() : threads;
+    if (lcrypt_threads_default > LCRYPT_THREADS_MAX) lcrypt_threads_default = LCRYPT_THREADS_MAX;
+  }
+  lua_pushinteger(L, (lua_Integer)lcrypt_threads_default);
+  return 1;
+}
+
+static void lcrypt_start_threads (lua_State *L) {
+  ADD_FUNCTION(L, threads);
+}
@@ -9,3 +9,951 @@ check = key:decrypt(out)
 print(out, check)
 
 print( lcrypt.tohex( lcrypt.hash('md5', 'hash', 'bla bla'):done() ) )
+
+local function hex (data)
+  return lcrypt.tohex(data):lower()
+end
+
+local function expect (name, got, wanted)
+  assert(got == wanted, name .. ': got ' .. tostring(got) .. ', wanted ' .. tostring(wanted))
+end
+
+local function raises (name, f, ...)
+  assert(not pcall(f, ...), name .. ': did not raise')
+end
+
+-- bytes counting 0 to 250 and around again, the input of the BLAKE3 test_vectors.json
+local function pattern (length)
+  local bytes = {}
+  for i = 1, length do bytes[i] = string.char((i - 1) % 251) end
+  return table.concat(bytes)
+end
+
+-- NIST SP 800-38A appendix F, the AES-128 key and the plaintext of its examples
+local sp800_key     = lcrypt.fromhex('2b7e151628aed2a6abf7158809cf4f3c')
+local sp800_plain   = lcrypt.fromhex('6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51' ..
+                                     '30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710')
+local sp800_counter = lcrypt.fromhex('f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff')
+local sp800_ctr     = '874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff' ..
+                      '5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee'
+
+-- buffers
+do
+  local buffer = lcrypt.buffer(8)
+  expect('buffer size', #buffer, 8)
+  expect('buffer zeroed', buffer:read(), string.rep('\0', 8))
+  buffer:fill(65)
+  expect('buffer write', buffer:write(2, 'xyz'), 3)
+  expect('buffer read', buffer:read(1, 5), 'AxyzA')
+  expect('buffer tostring', tostring(buffer), 'AAxyzAAA')
+  expect('buffer from data', lcrypt.buffer('data'):read(), 'data')
+  raises('buffer write past the end', buffer.write, buffer, 6, 'xyz')
+  raises('buffer read past the end', buffer.read, buffer, 4, 5)
+end
+
+-- SP 800-38A F.5.1 and F.5.2 through encrypt_into / decrypt_into, in two calls at an offset
+do
+  local buffer = lcrypt.buffer(80)
+  key = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  expect('encrypt_into', key:encrypt_into(buffer, 8, sp800_plain:sub(1, 20)), 20)
+  expect('encrypt_into continued', key:encrypt_into(buffer, 28, sp800_plain:sub(21)), 44)
+  expect('encrypt_into F.5.1', hex(buffer:read(8, 64)), sp800_ctr)
+  key = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  expect('decrypt_into', key:decrypt_into(buffer, 0, buffer:read(8, 64)), 64)
+  expect('decrypt_into F.5.2', buffer:read(0, 64), sp800_plain)
+  raises('encrypt_into past the end', key.encrypt_into, key, buffer, 40, sp800_plain)
+
+  -- the string and buffer paths of a chained mode agree
+  key   = lcrypt.key('aes', 'cbc', sp800_key, sp800_counter)
+  out   = key:encrypt(pattern(80))
+  key   = lcrypt.key('aes', 'cbc', sp800_key, sp800_counter)
+  key:encrypt_into(buffer, 0, pattern(32))
+  key:encrypt_into(buffer, 32, pattern(80):sub(33))
+  expect('cbc encrypt_into', tostring(buffer), out)
+end
+
+local sp800_iv  = lcrypt.fromhex('000102030405060708090a0b0c0d0e0f')
+local sp800_cbc = '7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2' ..
+                  '73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7'
+
+-- batches without ivs chain from one record into the next, so SP 800-38A F.2.1 and F.2.2 still come out
+do
+  local records = { sp800_plain:sub(1, 16), sp800_plain:sub(17, 48), sp800_plain:sub(49, 64) }
+  key = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv)
+  out = key:encrypt_batch(records)
+  expect('encrypt_batch records', #out, 3)
+  expect('encrypt_batch F.2.1', hex(table.concat(out)), sp800_cbc)
+  key.iv = sp800_iv
+  expect('decrypt_batch F.2.2', table.concat(key:decrypt_batch(out)), sp800_plain)
+
+  -- with ivs every record is what its own encrypt call gives
+  local ivs    = { string.rep('a', 16), string.rep('b', 16), string.rep('c', 16) }
+  local serial = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv)
+  out = key:encrypt_batch(records, ivs)
+  for i = 1, #records do
+    serial.iv = ivs[i]
+    expect('encrypt_batch ' .. i, out[i], serial:encrypt(records[i]))
+  end
+  check = key:decrypt_batch(out, ivs)
+  for i = 1, #records do expect('decrypt_batch ' .. i, check[i], records[i]) end
+
+  -- into a buffer the records go back to back from the offset
+  local buffer = lcrypt.buffer(80)
+  local offsets, next_offset = key:encrypt_batch(records, ivs, buffer, 10)
+  expect('encrypt_batch offsets', table.concat(offsets, ','), '10,26,58')
+  expect('encrypt_batch next offset', next_offset, 74)
+  expect('encrypt_batch buffer', buffer:read(10, 64), table.concat(out))
+  raises('encrypt_batch buffer too small', key.encrypt_batch, key, records, ivs, buffer, 20)
+  raises('encrypt_batch partial block', key.encrypt_batch, key, { 'short' })
+end
+
+-- GCM test case 4 of the GCM specification, in two calls and with the aad set after the iv
+do
+  local gcm_key   = lcrypt.fromhex('feffe9928665731c6d6a8f9467308308')
+  local gcm_iv    = lcrypt.fromhex('cafebabefacedbaddecaf888')
+  local gcm_aad   = lcrypt.fromhex('feedfacedeadbeeffeedfacedeadbeefabaddad2')
+  local gcm_plain = lcrypt.fromhex('d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72' ..
+                                   '1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39')
+  local gcm_tag   = lcrypt.fromhex('5bc94fbc3221a5db94fae95ae7121a47')
+  key = lcrypt.key('aes', 'gcm', gcm_key, gcm_iv, gcm_aad)
+  out = key:encrypt(gcm_plain:sub(1, 25)) .. key:encrypt(gcm_plain:sub(26))
+  expect('gcm', hex(out), '42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e' ..
+                          '21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091')
+  expect('gcm tag', key:done(), gcm_tag)
+  key = lcrypt.key('aes', 'gcm', gcm_key, gcm_iv)
+  key:aad(gcm_aad)
+  expect('gcm decrypt', key:decrypt(out), gcm_plain)
+  expect('gcm verify', key:verify(gcm_tag), true)
+  key = lcrypt.key('aes', 'gcm', gcm_key, gcm_iv, gcm_aad)
+  key:decrypt(out:sub(1, 59) .. string.char((out:byte(60) + 1) % 256))
+  expect('gcm verify tampered', key:verify(gcm_tag), false)
+end
+
+-- RFC 3610 packet vector 1, the iv set again starts a new message
+do
+  local ccm_nonce = lcrypt.fromhex('00000003020100a0a1a2a3a4a5')
+  local ccm_aad   = lcrypt.fromhex('0001020304050607')
+  local ccm_plain = lcrypt.fromhex('08090a0b0c0d0e0f101112131415161718191a1b1c1d1e')
+  key = lcrypt.key('aes', 'ccm', lcrypt.fromhex('c0c1c2c3c4c5c6c7c8c9cacbcccdcecf'), ccm_nonce, ccm_aad, 8)
+  out = key:encrypt(ccm_plain)
+  expect('ccm', hex(out), '588c979a61c663d2f066d0c2c0f989806d5f6b61dac384')
+  expect('ccm tag', hex(key:done()), '17e8d12cfdf926e0')
+  raises('ccm second message', key.encrypt, key, ccm_plain)
+  key.iv = ccm_nonce
+  key:aad(ccm_aad)
+  expect('ccm decrypt', key:decrypt(out), ccm_plain)
+  expect('ccm verify', key:verify(lcrypt.fromhex('17e8d12cfdf926e0')), true)
+end
+
+-- the EAX paper's test vectors, the header once at setup and once through aad
+do
+  key = lcrypt.key('aes', 'eax', lcrypt.fromhex('91945d3f4dcbee0bf45ef52255f095a4'),
+                   lcrypt.fromhex('becaf043b0a23d843194ba972c66debd'), lcrypt.fromhex('fa3bfd4806eb53fa'))
+  expect('eax', hex(key:encrypt(lcrypt.fromhex('f7fb'))), '19dd')
+  expect('eax tag', hex(key:done()), '5c4c9331049d0bdab0277408f67967e5')
+  key = lcrypt.key('aes', 'eax', lcrypt.fromhex('01f74ad64077f2e704c0f60ada3dd523'), lcrypt.fromhex('70c3db4f0d26368400a10ed05d2bff5e'))
+  key:aad(lcrypt.fromhex('234a3463c1264ac6'))
+  expect('eax aad', hex(key:encrypt(lcrypt.fromhex('1a47cb4933'))), 'd851d5bae0')
+  expect('eax aad tag', hex(key:done()), '3a59f238a23e39199dc9266626c40f80')
+  key = lcrypt.key('aes', 'eax', lcrypt.fromhex('233952dee4d5ed5f9b9c6d6ff80ff478'),
+                   lcrypt.fromhex('62ec67f9c3a4a407fcb2a8c49031a8b3'), lcrypt.fromhex('6bfb914fd07eae6b'))
+  expect('eax empty', key:verify(lcrypt.fromhex('e037830e8389f27b025a2d6527e79d01')), true)
+end
+
+-- OCB has no vectors for libtomcrypt's OCB1 left to check against, so it goes both ways
+do
+  key = lcrypt.key('aes', 'ocb', sp800_key, sp800_counter)
+  out = key:encrypt(pattern(50))
+  local tag = key:done()
+  expect('ocb tag size', #tag, 16)
+  key = lcrypt.key('aes', 'ocb', sp800_key, sp800_counter)
+  expect('ocb decrypt', key:decrypt(out), pattern(50))
+  expect('ocb verify', key:verify(tag), true)
+  key = lcrypt.key('aes', 'ocb', sp800_key, sp800_counter)
+  key:decrypt(out:sub(1, 49) .. string.char((out:byte(50) + 1) % 256))
+  expect('ocb verify tampered', key:verify(tag), false)
+end
+
+-- ECB and CTR over several threads against the serial path, 1 MB so that every thread gets a slice
+do
+  local data = string.rep(pattern(4096), 256)
+  expect('threads default', lcrypt.threads(), 1)
+  key = lcrypt.key('aes', 'ecb', sp800_key)
+  expect('ecb threads', key:encrypt(data, {threads = 4}), lcrypt.key('aes', 'ecb', sp800_key):encrypt(data))
+  expect('ecb decrypt threads', key:decrypt(key:encrypt(data), {threads = 3}), data)
+
+  -- the threads start after the rest of a partly used pad, and leave the counter where the serial path does
+  local serial = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  key = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  expect('ctr head', key:encrypt('abc'), serial:encrypt('abc'))
+  expect('ctr threads', key:encrypt(data .. 'tail', {threads = 4}), serial:encrypt(data .. 'tail'))
+  expect('ctr after threads', key:encrypt(pattern(40)), serial:encrypt(pattern(40)))
+
+  -- lcrypt.threads sets what calls without options use, the _into calls take the options after the data
+  expect('threads set', lcrypt.threads(3), 3)
+  expect('ctr default threads', key:encrypt(data), serial:encrypt(data))
+  lcrypt.threads(1)
+  local buffer = lcrypt.buffer(#data)
+  key:encrypt_into(buffer, 0, data, {threads = 4})
+  expect('ctr encrypt_into threads', tostring(buffer), serial:encrypt(data))
+end
+
+-- CBC and CFB decryption in parallel slices against the serial path, CFB from a partly used register
+do
+  local data = string.rep(pattern(4096), 256)
+  for _, mode in ipairs({ 'cbc', 'cfb' }) do
+    local head   = (mode == 'cfb') and 5 or 16
+    local serial = lcrypt.key('aes', mode, sp800_key, sp800_iv)
+    out = lcrypt.key('aes', mode, sp800_key, sp800_iv):encrypt(data .. pattern(48))
+    key = lcrypt.key('aes', mode, sp800_key, sp800_iv)
+    expect(mode .. ' head', key:decrypt(out:sub(1, head)), serial:decrypt(out:sub(1, head)))
+    expect(mode .. ' threads', key:decrypt(out:sub(head + 1, #data), {threads = 4}), data:sub(head + 1))
+    expect(mode .. ' serial', serial:decrypt(out:sub(head + 1, #data)), data:sub(head + 1))
+    expect(mode .. ' iv after threads', key.iv, serial.iv)
+    expect(mode .. ' after threads', key:decrypt(out:sub(#data + 1)), pattern(48))
+  end
+end
+
+-- AES through AES-NI where lcrypt.implementations.aes says so, FIPS-197 C.1 to C.3 and SP 800-38A F.1, F.2 and F.5
+do
+  local implementation = lcrypt.implementations.aes
+  assert(implementation == 'aesni' or implementation == 'portable', 'aes implementation: ' .. tostring(implementation))
+  local block = lcrypt.fromhex('00112233445566778899aabbccddeeff')
+  for _, v in ipairs({
+    { 16, '69c4e0d86a7b0430d8cdb78070b4c55a' },
+    { 24, 'dda97ca4864cdfe06eaf70a0ec0d7191' },
+    { 32, '8ea2b7ca516745bfeafc49904b496089' },
+  }) do
+    key = lcrypt.key('aes', 'ecb', pattern(v[1]))
+    expect('fips-197 ' .. v[1] * 8, hex(key:encrypt(block)), v[2])
+    expect('fips-197 inverse ' .. v[1] * 8, key:decrypt(lcrypt.fromhex(v[2])), block)
+  end
+
+  key = lcrypt.key('aes', 'ecb', sp800_key)
+  expect('F.1.1', hex(key:encrypt(sp800_plain)), '3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf' ..
+                                                   '43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4')
+  expect('F.1.2', key:decrypt(key:encrypt(sp800_plain)), sp800_plain)
+  expect('F.2.1', hex(lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt(sp800_plain)), sp800_cbc)
+  expect('F.2.2', lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):decrypt(lcrypt.fromhex(sp800_cbc)), sp800_plain)
+  key = lcrypt.key('aes', 'cbc', lcrypt.fromhex('603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4'), sp800_iv)
+  expect('F.2.5', hex(key:encrypt(sp800_plain)), 'f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d' ..
+                                                   '39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b')
+  expect('F.5.1', hex(lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be'):encrypt(sp800_plain)), sp800_ctr)
+
+  -- the interleaved blocks of long calls against one call per block
+  key = lcrypt.key('aes', 'ecb', sp800_key)
+  out = key:encrypt(pattern(16 * 37))
+  local blocks = {}
+  for i = 1, 37 do blocks[i] = key:decrypt(out:sub(16 * i - 15, 16 * i)) end
+  expect('ecb blocks', table.concat(blocks), pattern(16 * 37))
+  expect('ecb in one call', key:decrypt(out), pattern(16 * 37))
+end
+
+local sunscreen = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it."
+
+-- RFC 8439 2.4.2
+key = lcrypt.key('chacha20', 'stream', lcrypt.fromhex('000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f'),
+                 lcrypt.fromhex('000000000000004a00000000'), 1)
+expect('chacha20', hex(key:encrypt(sunscreen)),
+       '6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0bf91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8' ..
+       '07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab77937365af90bbf74a35be6b40b8eedf2785e42874d')
+
+-- RFC 8439 2.8.2
+key = lcrypt.key('chacha20', 'poly1305', lcrypt.fromhex('808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f'),
+                 lcrypt.fromhex('070000004041424344454647'), lcrypt.fromhex('50515253c0c1c2c3c4c5c6c7'))
+expect('chacha20-poly1305', hex(key:encrypt(sunscreen)),
+       'd31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36' ..
+       '92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc3ff4def08e4b7a9de576d26586cec64b6116')
+expect('chacha20-poly1305 tag', hex(key:done()), '1ae10b594f09e26a7e902ecbd0600691')
+
+-- the same key and nonce through the decrypting side, and a changed byte failing verify
+do
+  local chacha_key, chacha_nonce = lcrypt.fromhex('808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f'),
+                                   lcrypt.fromhex('070000004041424344454647')
+  out = lcrypt.key('chacha20', 'poly1305', chacha_key, chacha_nonce, 'header'):encrypt(sunscreen)
+  key = lcrypt.key('chacha20', 'poly1305', chacha_key, chacha_nonce, 'header')
+  expect('chacha20-poly1305 decrypt', key:decrypt(out), sunscreen)
+  local tag = key:done()
+  key = lcrypt.key('chacha20', 'poly1305', chacha_key, chacha_nonce, 'header')
+  key:decrypt(out:sub(1, 9) .. string.char((out:byte(10) + 1) % 256) .. out:sub(11))
+  expect('chacha20-poly1305 verify tampered', key:verify(tag), false)
+end
+
+-- a 12 byte nonce stops at counter 2^32 - 1, an 8 byte nonce carries into the next word
+do
+  key = lcrypt.key('chacha20', 'stream', pattern(32), pattern(12), 4294967295)
+  expect('chacha20 last block', #key:encrypt(string.rep('\0', 64)), 64)
+  raises('chacha20 counter wrap', key.encrypt, key, 'x')
+  raises('chacha20 counter range', lcrypt.key, 'chacha20', 'stream', pattern(32), pattern(12), 4294967296)
+  out = lcrypt.key('chacha20', 'stream', pattern(32), pattern(8), 4294967295):encrypt(string.rep('\0', 128))
+  expect('chacha20 carry', out:sub(65), lcrypt.key('chacha20', 'stream', pattern(32), pattern(8), 4294967296):encrypt(string.rep('\0', 64)))
+end
+
+-- over several threads against the serial path
+do
+  local data   = string.rep(pattern(4096), 256)
+  local serial = lcrypt.key('chacha20', 'stream', pattern(32), pattern(12), 1)
+  key = lcrypt.key('chacha20', 'stream', pattern(32), pattern(12), 1)
+  expect('chacha20 head', key:encrypt('abc'), serial:encrypt('abc'))
+  expect('chacha20 threads', key:encrypt(data, {threads = 4}), serial:encrypt(data))
+  expect('chacha20 after threads', key:encrypt(pattern(40)), serial:encrypt(pattern(40)))
+end
+
+-- IEEE 1619 XTS-AES-128 vectors 1 and 2, a sector number is the little endian tweak
+do
+  key = lcrypt.key('aes', 'xts', string.rep('\0', 32), string.rep('\0', 16))
+  expect('xts vector 1', hex(key:encrypt(string.rep('\0', 32))), '917cf69ebd68b2ec9b9fe9a3eadda692cd43d2f59598ed858c02c2652fbf922e')
+  key = lcrypt.key('aes', 'xts', string.rep('\17', 16) .. string.rep('\34', 16))
+  key.iv = string.rep('\51', 5) .. string.rep('\0', 11)
+  out = lcrypt.fromhex('c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0')
+  expect('xts vector 2', key:encrypt(string.rep('\68', 32)), out)
+  expect('xts vector 2 decrypt', key:decrypt(out), string.rep('\68', 32))
+  expect('xts vector 2 sector', key:encrypt_sectors(string.rep('\68', 32), 32, 219902325555), out)
+  raises('xts short data', key.encrypt, key, 'short')
+
+  -- sectors over several threads against one encrypt per sector
+  local data = string.rep(pattern(512), 512)
+  out = key:encrypt_sectors(data, 512, 1000, {threads = 4})
+  for i = 0, 511, 37 do
+    local sector = 1000 + i
+    key.iv = string.char(sector % 256, math.floor(sector / 256)) .. string.rep('\0', 14)
+    expect('xts sector ' .. sector, out:sub(512 * i + 1, 512 * (i + 1)), key:encrypt(data:sub(512 * i + 1, 512 * (i + 1))))
+  end
+  expect('xts decrypt_sectors', key:decrypt_sectors(out, 512, 1000, {threads = 4}), data)
+  raises('xts partial sector', key.encrypt_sectors, key, data:sub(2), 512, 0)
+end
+
+-- seek against running the stream from its start, wherever the key was before
+do
+  local data = pattern(1000)
+  out = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be'):encrypt(data)
+  key = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  key:encrypt(pattern(77))
+  for _, offset in ipairs({ 0, 1, 15, 16, 17, 500, 999 }) do
+    key:seek(offset)
+    expect('ctr seek ' .. offset, key:decrypt(out:sub(offset + 1)), data:sub(offset + 1))
+  end
+
+  out = lcrypt.key('chacha20', 'stream', pattern(32), pattern(12), 1):encrypt(data)
+  key = lcrypt.key('chacha20', 'stream', pattern(32), pattern(12), 1)
+  key:encrypt(pattern(77))
+  for _, offset in ipairs({ 0, 1, 63, 64, 65, 500, 999 }) do
+    key:seek(offset)
+    expect('chacha20 seek ' .. offset, key:encrypt(out:sub(offset + 1)), data:sub(offset + 1))
+  end
+
+  -- a 12 byte nonce ends with counter 2^32 - 1, here 2^32 - 1 blocks after the start at 1
+  key:seek(274877906880)
+  raises('chacha20 after the last block', key.encrypt, key, 'x')
+  raises('chacha20 seek past the counter', key.seek, key, 274877906881)
+  key = lcrypt.key('aes', 'cbc', sp800_key, sp800_counter)
+  expect('cbc seek', key.seek, nil)
+end
+
+-- encrypt_file / decrypt_file against encrypt, with paths, file handles and the io thread
+do
+  local function write (path, content)
+    local file = assert(io.open(path, 'wb'))
+    file:write(content)
+    file:close()
+  end
+  local function read (path)
+    local file = assert(io.open(path, 'rb'))
+    local content = file:read('*a')
+    file:close()
+    return content
+  end
+  local function ctr ()
+    return lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  end
+
+  local data = string.rep(pattern(4096), 300) .. pattern(100)
+  local plain, sealed, opened = os.tmpname(), os.tmpname(), os.tmpname()
+  write(plain, data)
+  expect('encrypt_file', ctr():encrypt_file(plain, sealed, 65536), #data)
+  expect('encrypt_file content', read(sealed), ctr():encrypt(data))
+  expect('decrypt_file io thread', ctr():decrypt_file(sealed, opened, 262144, {io_thread = true, threads = 2}), #data)
+  expect('decrypt_file io thread content', read(opened), data)
+  local input, output = assert(io.open(sealed, 'rb')), assert(io.open(opened, 'wb'))
+  expect('decrypt_file handles', ctr():decrypt_file(input, output, 1000), #data)
+  input:close()
+  output:close()
+  expect('decrypt_file handles content', read(opened), data)
+
+  -- CBC files are whole blocks, whatever the chunk size
+  key = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv)
+  raises('encrypt_file partial block', key.encrypt_file, key, plain, sealed)
+  write(plain, data:sub(1, 3 * 65536))
+  expect('encrypt_file cbc', lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt_file(plain, sealed, 5000), 3 * 65536)
+  expect('encrypt_file cbc content', read(sealed), lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt(data:sub(1, 3 * 65536)))
+  raises('encrypt_file missing file', key.encrypt_file, key, plain .. '.missing', sealed)
+  os.remove(plain)
+  os.remove(sealed)
+  os.remove(opened)
+end
+
+-- padding against padding by hand and encrypting without, SP 800-38A F.2.1's first block padded with pkcs7
+do
+  local function pad (padding, data)
+    local tail = 16 - #data % 16
+    if padding == 'pkcs7' then return data .. string.rep(string.char(tail), tail) end
+    if padding == 'iso7816' then return data .. '\128' .. string.rep('\0', tail - 1) end
+    return data .. string.rep('\0', tail % 16)
+  end
+  for _, padding in ipairs({ 'pkcs7', 'iso7816', 'zero' }) do
+    for _, length in ipairs({ 0, 1, 15, 16, 17, 31, 32, 100 }) do
+      local data = string.rep('x', length)
+      if padding ~= 'zero' or length > 0 then
+        local name = padding .. ' ' .. length
+        out = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt(pad(padding, data))
+        expect(name, lcrypt.key('aes', 'cbc', sp800_key, sp800_iv, nil, nil, padding):encrypt(data), out)
+        expect(name .. ' option', lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt(data, {padding = padding}), out)
+        expect(name .. ' decrypt', lcrypt.key('aes', 'cbc', sp800_key, sp800_iv, nil, nil, padding):decrypt(out), data)
+      end
+    end
+  end
+
+  key = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv)
+  expect('padding default', key.padding, 'none')
+  key.padding = 'pkcs7'
+  expect('padding set', key.padding, 'pkcs7')
+  expect('cbc pkcs7', hex(key:encrypt(sp800_plain:sub(1, 16))),
+         '7649abac8119b246cee98e9b12e9197d8964e0b149c10b7b682e6e39aaeb731c')
+  expect('ecb pkcs7 empty', hex(lcrypt.key('aes', 'ecb', sp800_key):encrypt('', {padding = 'pkcs7'})), 'a254be88e037ddd9d79fb6411c3f9df8')
+
+  -- bad padding and misuse raise
+  key = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv, nil, nil, 'pkcs7')
+  raises('pkcs7 invalid', key.decrypt, key, lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt(string.rep('x', 16)))
+  raises('pkcs7 empty', key.decrypt, key, '')
+  raises('padding unknown', lcrypt.key, 'aes', 'cbc', sp800_key, sp800_iv, nil, nil, 'bits')
+  raises('padding ctr', lcrypt.key, 'aes', 'ctr', sp800_key, sp800_counter, 'be', nil, 'pkcs7')
+end
+
+-- clone against the key it came from, then keys out of the key cache against keys set up from scratch
+do
+  key = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv)
+  key:encrypt(pattern(32))
+  local copy = key:clone()
+  expect('clone', copy:encrypt(pattern(48)), key:encrypt(pattern(48)))
+  local iv = key.iv
+  copy = key:clone(sp800_iv)
+  expect('clone iv', copy.iv, sp800_iv)
+  expect('clone leaves the key', key.iv, iv)
+  expect('clone F.2.1', hex(copy:encrypt(sp800_plain)), sp800_cbc)
+
+  for _, mode in ipairs({ 'gcm', 'ccm' }) do
+    key  = lcrypt.key('aes', mode, sp800_key, string.rep('n', 12), 'header')
+    copy = key:clone()
+    expect('clone ' .. mode, copy:encrypt(pattern(30)), key:encrypt(pattern(30)))
+    expect('clone ' .. mode .. ' tag', copy:done(), key:done())
+  end
+
+  local function seal (mode)
+    key = (mode == 'gcm') and lcrypt.key('aes', 'gcm', sp800_key, string.rep('n', 12), 'header')
+                          or lcrypt.key('aes', mode, sp800_key, sp800_iv, 'be')
+    out = key:encrypt(sp800_plain)
+    return (mode == 'gcm') and out .. key:done() or out
+  end
+  local modes, fresh = { 'ecb', 'cbc', 'ctr', 'cfb', 'ofb', 'gcm' }, {}
+  expect('key_cache off', lcrypt.key_cache(), 0)
+  for _, mode in ipairs(modes) do fresh[mode] = seal(mode) end
+  expect('key_cache size', lcrypt.key_cache(16), 16)
+  for _, mode in ipairs(modes) do
+    expect('key_cache miss ' .. mode, seal(mode), fresh[mode])
+    expect('key_cache hit ' .. mode, seal(mode), fresh[mode])
+  end
+  expect('key_cache F.2.1', hex(fresh.cbc), sp800_cbc)
+  expect('key_cache F.5.1', hex(lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be'):encrypt(sp800_plain)), sp800_ctr)
+  lcrypt.key_cache(0)
+end
+
+-- every key counts in lcrypt.key_memory with the size of its cipher and mode, and works trimmed
+do
+  collectgarbage()
+  local bytes, count = lcrypt.key_memory()
+  local ctr = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  local after_bytes, after_count = lcrypt.key_memory()
+  expect('key_memory count', after_count, count + 1)
+  expect('key_memory bytes', after_bytes, bytes + ctr.memory)
+  assert(lcrypt.key('des', 'ecb', '12345678').memory < lcrypt.key('aes', 'ecb', sp800_key).memory, 'des key not smaller than aes')
+  assert(ctr.memory < lcrypt.key('aes', 'gcm', sp800_key, sp800_iv).memory, 'ctr key not smaller than gcm')
+  expect('trimmed F.5.1', hex(ctr:clone():encrypt(sp800_plain)), sp800_ctr)
+  expect('trimmed F.2.1', hex(lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt(sp800_plain)), sp800_cbc)
+  ctr = nil
+  collectgarbage()
+  expect('key_memory after collect', select(2, lcrypt.key_memory()), count)
+end
+
+-- encrypt_many / decrypt_many against one encrypt per record, with mixed modes and key sizes and a key used twice
+do
+  local modes = { 'ecb', 'cbc', 'ctr', 'ofb' }
+  local function keyset ()
+    local keys = {}
+    for i = 1, 10 do
+      keys[i] = lcrypt.key('aes', modes[i % 4 + 1], pattern(16 + 8 * (i % 3)), sp800_counter, 'be')
+    end
+    keys[11] = keys[2]
+    return keys
+  end
+  local records, ivs = {}, {}
+  for i = 1, 11 do
+    records[i] = pattern(16 * i + 48)
+    ivs[i]     = string.rep(string.char(64 + i), 16)
+  end
+
+  local serial = keyset()
+  out = lcrypt.encrypt_many(keyset(), records, ivs)
+  for i = 1, 11 do
+    if serial[i].mode ~= 'ecb' then serial[i].iv = ivs[i] end
+    expect('encrypt_many ' .. i, out[i], serial[i]:encrypt(records[i]))
+  end
+  check = lcrypt.decrypt_many(keyset(), out, ivs)
+  for i = 1, 11 do expect('decrypt_many ' .. i, check[i], records[i]) end
+
+  -- without ivs the keys go on from where they are
+  serial = keyset()
+  out = lcrypt.encrypt_many(keyset(), records)
+  for i = 1, 11 do expect('encrypt_many chained ' .. i, out[i], serial[i]:encrypt(records[i])) end
+  expect('encrypt_many F.1.1', hex(lcrypt.encrypt_many({ lcrypt.key('aes', 'ecb', sp800_key) }, { sp800_plain })[1]),
+         '3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4')
+  raises('encrypt_many partial block', lcrypt.encrypt_many, keyset(), { 'short' })
+end
+
+-- every key mode sees its own methods, computed fields still come from the key
+do
+  local ctr = lcrypt.key('aes', 'ctr', sp800_key, sp800_counter, 'be')
+  local cbc = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv)
+  local gcm = lcrypt.key('aes', 'gcm', sp800_key, string.rep('n', 12))
+  local xts = lcrypt.key('aes', 'xts', pattern(32))
+  expect('ctr seek', type(ctr.seek), 'function')
+  expect('cbc seek', cbc.seek, nil)
+  expect('cbc done', cbc.done, nil)
+  expect('cbc encrypt_sectors', cbc.encrypt_sectors, nil)
+  expect('gcm done', type(gcm.done), 'function')
+  expect('gcm seek', gcm.seek, nil)
+  expect('xts encrypt_sectors', type(xts.encrypt_sectors), 'function')
+  expect('cbc mode', cbc.mode, 'cbc')
+  expect('cbc cipher', cbc.cipher, 'aes')
+  expect('cbc block_size', cbc.block_size, 16)
+  expect('cbc iv', cbc.iv, sp800_iv)
+  expect('gcm tag_size', gcm.tag_size, 16)
+  expect('cbc unknown field', cbc.unknown, nil)
+  expect('F.2.1 through the method table', hex(cbc:encrypt(sp800_plain)), sp800_cbc)
+
+  local hash = lcrypt.hash('sha256', 'hash')
+  expect('hash add', type(hash.add), 'function')
+  expect('hash size', hash.size, 32)
+  expect('hash mode', hash.mode, 'hash')
+  expect('buffer read', type(lcrypt.buffer(1).read), 'function')
+end
+
+-- FIPS 180 and RFC 1321 for digest, RFC 2202 and RFC 4231 case 2 for hmac, RFC 4493 for omac
+do
+  expect('digest sha256', hex(lcrypt.digest('sha256', 'abc')), 'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad')
+  expect('digest sha1', hex(lcrypt.digest('sha1', 'abc')), 'a9993e364706816aba3e25717850c26c9cd0d89d')
+  expect('digest md5', hex(lcrypt.digest('md5', '')), 'd41d8cd98f00b204e9800998ecf8427e')
+  expect('hmac sha256', hex(lcrypt.hmac('sha256', 'Jefe', 'what do ya want for nothing?')),
+         '5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843')
+  expect('hmac sha1', hex(lcrypt.hmac('sha1', 'Jefe', 'what do ya want for nothing?')), 'effcdf6ae5eb2fa2d27416d5f184df9c259a7c79')
+  expect('hmac md5', hex(lcrypt.hmac('md5', 'Jefe', 'what do ya want for nothing?')), '750c783e6ab0b503eaa86e310a5db738')
+  expect('omac empty', hex(lcrypt.omac('aes', sp800_key, '')), 'bb1d6929e95937287fa37d129b756746')
+  expect('omac', hex(lcrypt.omac('aes', sp800_key, sp800_plain:sub(1, 16))), '070a16b46b4d4144f79bdd9dd04a287c')
+
+  -- the one-shot calls against the hash objects
+  for _, name in ipairs({ 'md5', 'sha1', 'sha256', 'sha512' }) do
+    expect('digest ' .. name .. ' object', lcrypt.digest(name, pattern(1000)), lcrypt.hash(name, 'hash', pattern(1000)):done())
+    expect('hmac ' .. name .. ' object', lcrypt.hmac(name, 'key', pattern(1000)), lcrypt.hash(name, 'hmac', pattern(1000), 'key'):done())
+  end
+  expect('omac object', lcrypt.omac('aes', sp800_key, pattern(100)), lcrypt.hash('aes', 'omac', pattern(100), sp800_key):done())
+end
+
+-- digest_many against digest, across the lengths where the final block changes shape and more lanes than a batch
+do
+  local lengths, messages = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 1000, 5000 }, {}
+  for i, length in ipairs(lengths) do messages[i] = pattern(length) end
+  for i = #lengths + 1, 21 do messages[i] = pattern(i * 37) end
+  for _, name in ipairs({ 'sha256', 'sha224', 'sha1', 'md5', 'sha512' }) do
+    out = lcrypt.digest_many(name, messages)
+    expect('digest_many ' .. name .. ' count', #out, #messages)
+    for i = 1, #messages do expect('digest_many ' .. name .. ' ' .. #messages[i], out[i], lcrypt.digest(name, messages[i])) end
+  end
+  out = lcrypt.digest_many('sha256', { 'abc', '', 'abc' })
+  expect('digest_many abc', hex(out[1]), 'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad')
+  expect('digest_many empty', hex(out[2]), 'e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855')
+  expect('digest_many md5 empty', hex(lcrypt.digest_many('md5', { '' })[1]), 'd41d8cd98f00b204e9800998ecf8427e')
+  expect('digest_many none', #lcrypt.digest_many('sha1', {}), 0)
+end
+
+-- FIPS 180 examples through whichever SHA implementation was registered, whole and added in odd pieces
+do
+  local short, long = 'abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq',
+                      'abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu'
+  for _, v in ipairs({
+    { 'sha1',   'abc', 'a9993e364706816aba3e25717850c26c9cd0d89d' },
+    { 'sha1',   short, '84983e441c3bd26ebaae4aa1f95129e5e54670f1' },
+    { 'sha224', 'abc', '23097d223405d8228642a477bda255b32aadbce4bda0b3f7e36c9da7' },
+    { 'sha224', short, '75388b16512776cc5dba5da1fd890150b0c6455cb4f58b1952522525' },
+    { 'sha256', 'abc', 'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad' },
+    { 'sha256', short, '248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1' },
+    { 'sha384', 'abc', 'cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7' },
+    { 'sha384', long,  '09330c33f71147e83d192fc782cd1b4753111b173b3b05d22fa08086e3b0f712fcc7c71a557e2db966c3e9fa91746039' },
+    { 'sha512', 'abc', 'ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f' },
+    { 'sha512', long,  '8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909' },
+  }) do
+    expect(v[1] .. ' ' .. #v[2], hex(lcrypt.digest(v[1], v[2])), v[3])
+  end
+  local million = string.rep('a', 1000000)
+  expect('sha1 million', hex(lcrypt.digest('sha1', million)), '34aa973cd4c4daa4f61eeb2bdbad27316534016f')
+  expect('sha256 million', hex(lcrypt.digest('sha256', million)), 'cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0')
+
+  for _, name in ipairs({ 'sha1', 'sha224', 'sha256', 'sha384', 'sha512' }) do
+    local hash, data, at = lcrypt.hash(name, 'hash'), pattern(5000), 1
+    for _, size in ipairs({ 1, 63, 64, 65, 127, 500, 3 }) do
+      hash:add(data:sub(at, at + size - 1))
+      at = at + size
+    end
+    hash:add(data:sub(at))
+    expect(name .. ' in pieces', hash:done(), lcrypt.digest(name, data))
+    expect(name .. ' implementation', type(lcrypt.implementations[name]), 'string')
+  end
+end
+
+
+-- BLAKE3 test_vectors.json, the first 32 bytes of each hash
+for _, v in ipairs({
+  {     0, 'af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262' },
+  {     1, '2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213' },
+  {  1024, '42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7' },
+  {  1025, 'd00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444' },
+  {  2048, 'e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a' },
+  {  2049, '5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030' },
+  { 31744, '62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47' },
+}) do
+  expect('blake3 ' .. v[1], hex(lcrypt.digest('blake3', pattern(v[1]))), v[2])
+end
+
+-- RFC 7693 appendix A and B, the rest from Python's hashlib
+expect('blake2b abc', hex(lcrypt.digest('blake2b', 'abc')),
+       'ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d17d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923')
+expect('blake2s abc', hex(lcrypt.digest('blake2s', 'abc')), '508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982')
+for _, v in ipairs({
+  {    0, '786a02f742015903c6c6fd852552d272912f4740e15847618a86e217f71f5419d25e1031afee585313896444934eb04b903a685b1448b755d56f701afe9be2ce',
+          '69217a3079908094e11121d042354a7c1f55b6482ca1a51e1b250dfd1ed0eef9' },
+  {  128, '2319e3789c47e2daa5fe807f61bec2a1a6537fa03f19ff32e87eecbfd64b7e0e8ccff439ac333b040f19b0c4ddd11a61e24ac1fe0f10a039806c5dcc0da3d115',
+          '1fa877de67259d19863a2a34bcc6962a2b25fcbf5cbecd7ede8f1fa36688a796' },
+  {  129, 'f59711d44a031d5f97a9413c065d1e614c417ede998590325f49bad2fd444d3e4418be19aec4e11449ac1a57207898bc57d76a1bcf3566292c20c683a5c4648f',
+          '5bd169e67c82c2c2e98ef7008bdf261f2ddf30b1c00f9e7f275bb3e8a28dc9a2' },
+  { 1000, 'c11e1c0340bd7e5a1b275f1230c962fad215ecb1391486e74e31b960a2f2996381a5fad092da06841d5f26e38f6ecfeaf441acbcd1c2de61aef121e7927175f5',
+          '1c067a5e746fb0f6734efac9a8cdb0e11061f0077f255184365c690115392501' },
+}) do
+  expect('blake2b ' .. v[1], hex(lcrypt.digest('blake2b', pattern(v[1]))), v[2])
+  expect('blake2s ' .. v[1], hex(lcrypt.digest('blake2s', pattern(v[1]))), v[3])
+end
+key = pattern(64)
+expect('blake2b keyed', hex(lcrypt.hash('blake2b', 'hash', pattern(200), key):done()),
+       '3095a349d245708c7cf550118703d7302c27b60af5d4e67fc978f8a4e60953c7a04f92fcf41aee64321ccb707a895851552b1e37b00bc5e6b72fa5bcef9e3fff')
+expect('blake2s keyed', hex(lcrypt.hash('blake2s', 'hash', pattern(200), key:sub(1, 32)):done()),
+       '13c88480a5d00d6c8c7ad2110d76a82d9b70f4fa6696d4e5dd42a066dcaf9920')
+
+
+-- BLAKE3 over several threads and added in pieces against the serial one-shot digest
+do
+  local data = string.rep(pattern(4096), 300)
+  expect('blake3 threads', lcrypt.digest('blake3', data, {threads = 4}), lcrypt.digest('blake3', data))
+  local hash = lcrypt.hash('blake3', 'hash')
+  hash:add(data:sub(1, 1000))
+  hash:add(data:sub(1001, 700000), {threads = 4})
+  hash:add(data:sub(700001))
+  expect('blake3 in pieces', hash:done(), lcrypt.digest('blake3', data))
+  for _, name in ipairs({ 'blake2b', 'blake2s' }) do
+    hash = lcrypt.hash(name, 'hash', data:sub(1, 129))
+    hash:add(data:sub(130))
+    expect(name .. ' in pieces', hash:done(), lcrypt.digest(name, data))
+  end
+end
+
+-- clone and peek against running the whole message again, on plain hashes, HMAC and OMAC
+do
+  local hash = lcrypt.hash('sha256', 'hash', 'a')
+  expect('peek', hex(hash:peek('bc')), 'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad')
+  expect('peek leaves the hash', hash:peek(), lcrypt.digest('sha256', 'a'))
+  local copy = hash:clone()
+  hash:add('bc')
+  copy:add('xyz')
+  expect('clone', hex(hash:done()), 'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad')
+  expect('clone on its own', copy:done(), lcrypt.digest('sha256', 'axyz'))
+
+  hash = lcrypt.hash('sha256', 'hmac', 'what do ya ', 'Jefe')
+  copy = hash:clone()
+  expect('hmac peek', hex(hash:peek('want for nothing?')), '5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843')
+  hash = nil
+  collectgarbage()
+  expect('hmac clone', hex(copy:done('want for nothing?')), '5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843')
+
+  hash = lcrypt.hash('aes', 'omac', sp800_plain:sub(1, 7), sp800_key)
+  copy = hash:clone()
+  expect('omac peek', hex(hash:peek(sp800_plain:sub(8, 16))), '070a16b46b4d4144f79bdd9dd04a287c')
+  expect('omac clone', hex(copy:done(sp800_plain:sub(8, 16))), '070a16b46b4d4144f79bdd9dd04a287c')
+  expect('omac after peek', hex(hash:done(sp800_plain:sub(8, 16))), '070a16b46b4d4144f79bdd9dd04a287c')
+
+  -- a long state, so the peeked and cloned copies carry whole blocks
+  hash = lcrypt.hash('sha512', 'hash', pattern(1000))
+  expect('sha512 peek', hash:peek(pattern(3000):sub(1001)), lcrypt.digest('sha512', pattern(3000)))
+  expect('sha512 clone', hash:clone():done(), lcrypt.digest('sha512', pattern(1000)))
+end
+
+-- several values in one add and add_table against one add per value, numbers go in as their 8 byte big endian double
+do
+  local parts = { 'ab', 'c', '', pattern(300), 'xyz' }
+  local hash = lcrypt.hash('sha256', 'hash')
+  hash:add('ab', 'c', nil, pattern(300), 'xyz')
+  expect('add several', hash:done(), lcrypt.digest('sha256', table.concat(parts)))
+  hash = lcrypt.hash('sha256', 'hash')
+  hash:add_table(parts)
+  expect('add_table', hash:done(), lcrypt.digest('sha256', table.concat(parts)))
+  hash = lcrypt.hash('sha256', 'hmac', nil, 'Jefe')
+  hash:add_table({ 'nothing', 'what do ya ', 'want for ', 'nothing?', 'x' }, 2, 4)
+  expect('add_table range', hex(hash:done()), '5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843')
+
+  hash = lcrypt.hash('sha256', 'hash')
+  hash:add(1.5)
+  expect('add number', hex(hash:done()), '430d595dc1ef65e95d4ebdc1c16a5b1dd745685e5b14bab114354489bd878b00')
+  hash = lcrypt.hash('sha256', 'hash')
+  hash:add_table({ 'a', 1.5 })
+  expect('add_table number', hash:done(), lcrypt.digest('sha256', 'a' .. lcrypt.fromhex('3ff8000000000000')))
+  hash = lcrypt.hash('sha256', 'hash')
+  raises('add boolean', hash.add, hash, 'a', true)
+  raises('add_table boolean', hash.add_table, hash, { 'a', false })
+end
+
+-- hash_file against digest and hmac of the same bytes, by path and from where an open handle is
+do
+  local data, path = string.rep(pattern(4096), 100) .. 'tail', os.tmpname()
+  local file = assert(io.open(path, 'wb'))
+  file:write(data)
+  file:close()
+  expect('hash_file', lcrypt.hash_file('sha256', path), lcrypt.digest('sha256', data))
+  expect('hash_file threads', lcrypt.hash_file('blake3', path, 'hash', nil, {threads = 2}), lcrypt.digest('blake3', data))
+  expect('hash_file hmac', lcrypt.hash_file('sha1', path, 'hmac', 'key'), lcrypt.hmac('sha1', 'key', data))
+  file = assert(io.open(path, 'rb'))
+  file:read(5000)
+  expect('hash_file handle', lcrypt.hash_file('md5', file), lcrypt.digest('md5', data:sub(5001)))
+  expect('hash_file handle at the end', file:read(1), nil)
+  file:close()
+  file = assert(io.open(path, 'wb'))
+  file:write('abc')
+  file:close()
+  expect('hash_file abc', hex(lcrypt.hash_file('sha256', path)), 'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad')
+  os.remove(path)
+  raises('hash_file missing', lcrypt.hash_file, 'sha256', path)
+end
+
+-- RFC 6070
+expect('pbkdf2 1', hex(lcrypt.pbkdf2('sha1', 'password', 'salt', 1, 20)), '0c60c80f961f0e71f3a9b524af6012062fe037a6')
+expect('pbkdf2 2', hex(lcrypt.pbkdf2('sha1', 'password', 'salt', 2, 20)), 'ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957')
+expect('pbkdf2 4096', hex(lcrypt.pbkdf2('sha1', 'password', 'salt', 4096, 20)), '4b007901b765489abead49d926f721d065a429c1')
+expect('pbkdf2 25', hex(lcrypt.pbkdf2('sha1', 'passwordPASSWORDpassword', 'saltSALTsaltSALTsaltSALTsaltSALTsalt', 4096, 25)),
+       '3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038')
+expect('pbkdf2 nul', hex(lcrypt.pbkdf2('sha1', 'pass\0word', 'sa\0lt', 4096, 16)), '56fa6aa75548099dcc37d7f03425e0c3')
+
+-- RFC 5869 A.1 to A.4, A.2 takes runs of consecutive bytes
+local function run (first, last)
+  local bytes = {}
+  for i = first, last do bytes[#bytes + 1] = string.char(i) end
+  return table.concat(bytes)
+end
+
+-- RFC 5869 A.1 to A.4
+expect('hkdf A.1', hex(lcrypt.hkdf('sha256', lcrypt.fromhex(string.rep('0b', 22)), lcrypt.fromhex('000102030405060708090a0b0c'),
+                                   lcrypt.fromhex('f0f1f2f3f4f5f6f7f8f9'), 42)),
+       '3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865')
+expect('hkdf A.2', hex(lcrypt.hkdf('sha256', run(0x00, 0x4f), run(0x60, 0xaf), run(0xb0, 0xff), 82)),
+       'b11e398dc80327a1c8e7f78c596a49344f012eda2d4efad8a050cc4c19afa97c59045a99cac7827271cb41c65e590e09da3275600c2f09b8367793a9aca3db71cc30c58179ec3e87c14c01d5c1f3434f1d87')
+expect('hkdf A.3', hex(lcrypt.hkdf('sha256', lcrypt.fromhex(string.rep('0b', 22)), nil, nil, 42)),
+       '8da4e775a563c18f715f802a063c5a31b8a11f5c5ee1879ec3454e5f3c738d2d9d201395faa4b61a96c8')
+expect('hkdf A.4', hex(lcrypt.hkdf('sha1', lcrypt.fromhex(string.rep('0b', 11)), lcrypt.fromhex('000102030405060708090a0b0c'),
+                                   lcrypt.fromhex('f0f1f2f3f4f5f6f7f8f9'), 42)),
+       '085a01ea1b10f36933068b56efa5ad81a4f14b822f5b091568a9cdd4f155fda2c22e422478d305f3f896')
+
+-- RFC 7914 12, all but the 1 GiB one
+expect('scrypt 16', hex(lcrypt.scrypt('', '', 16, 1, 1, 64)),
+       '77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906')
+expect('scrypt 1024', hex(lcrypt.scrypt('password', 'NaCl', 1024, 8, 16, 64)),
+       'fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640')
+expect('scrypt 16384', hex(lcrypt.scrypt('pleaseletmein', 'SodiumChloride', 16384, 8, 1, 64)),
+       '7023bdcb3afd7348461c06cd81fd38ebfda8fbba904f8e3ea9b543f6545da1f2d5432955613f0fcf62d49705242a9af9e61e85dc0d651e40dfcf017b45575887')
+
+-- the check values of the CRC catalogue, and combining or continuing the crcs of the two halves
+expect('crc32c', lcrypt.crc32c('123456789'), 0xe3069283)
+expect('crc32', lcrypt.crc32('123456789'), 0xcbf43926)
+expect('crc32c continued', lcrypt.crc32c('56789', lcrypt.crc32c('1234')), 0xe3069283)
+expect('crc32 continued', lcrypt.crc32('56789', lcrypt.crc32('1234')), 0xcbf43926)
+expect('crc32c_combine', lcrypt.crc32c_combine(lcrypt.crc32c('1234'), lcrypt.crc32c('56789'), 5), 0xe3069283)
+expect('crc32_combine', lcrypt.crc32_combine(lcrypt.crc32('1234'), lcrypt.crc32('56789'), 5), 0xcbf43926)
+local long = pattern(100000)
+expect('crc32c_combine long', lcrypt.crc32c_combine(lcrypt.crc32c(long:sub(1, 40000)), lcrypt.crc32c(long:sub(40001)), 60000),
+       lcrypt.crc32c(long))
+expect('crc32_combine long', lcrypt.crc32_combine(lcrypt.crc32(long:sub(1, 40000)), lcrypt.crc32(long:sub(40001)), 60000),
+       lcrypt.crc32(long))
+
+-- keys of one mode share a metatable, and only keys pass for keys
+do
+  local cbc = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv)
+  expect('metatable per mode', getmetatable(cbc), getmetatable(lcrypt.key('aes', 'cbc', pattern(16), sp800_iv)))
+  assert(getmetatable(cbc) ~= getmetatable(lcrypt.key('aes', 'ecb', sp800_key)), 'cbc and ecb share a metatable')
+  raises('encrypt on a buffer', cbc.encrypt, lcrypt.buffer(16), pattern(16))
+  raises('encrypt_many on a buffer', lcrypt.encrypt_many, { lcrypt.buffer(16) }, { pattern(16) })
+  raises('encrypt_many on a hash', lcrypt.encrypt_many, { lcrypt.hash('md5', 'hash') }, { pattern(16) })
+end
+
+-- lcrypt.hash takes its data like add does
+do
+  expect('hash number', hex(lcrypt.hash('sha256', 'hash', 1.5):done()), '430d595dc1ef65e95d4ebdc1c16a5b1dd745685e5b14bab114354489bd878b00')
+  expect('hash digits', lcrypt.hash('sha256', 'hash', '1.5'):done(), lcrypt.digest('sha256', '1.5'))
+  raises('hash boolean', lcrypt.hash, 'sha256', 'hash', true)
+end
+
+-- AEAD keys tag one message per iv, so the batch, file and many paths refuse them, and a CCM message per iv
+do
+  local path = os.tmpname()
+  local ccm_nonce = lcrypt.fromhex('00000003020100a0a1a2a3a4a5')
+  for _, mode in ipairs({ 'gcm', 'ccm', 'eax', 'ocb' }) do
+    local iv = (mode == 'ccm') and ccm_nonce or sp800_counter
+    key = lcrypt.key('aes', mode, sp800_key, iv)
+    raises('encrypt_batch ' .. mode, key.encrypt_batch, key, { pattern(16), pattern(16) })
+    raises('decrypt_batch ' .. mode, key.decrypt_batch, key, { pattern(16) }, { iv })
+    raises('encrypt_file ' .. mode, key.encrypt_file, key, path, path)
+    raises('encrypt_many ' .. mode, lcrypt.encrypt_many, { key }, { pattern(16) })
+  end
+  key = lcrypt.key('chacha20', 'poly1305', pattern(32), pattern(12))
+  raises('encrypt_batch poly1305', key.encrypt_batch, key, { pattern(16) })
+  os.remove(path)
+
+  key = lcrypt.key('aes', 'ccm', sp800_key, ccm_nonce, nil, 8)
+  local first = key:encrypt(pattern(32))
+  raises('ccm second message', key.encrypt, key, string.rep('x', 32))
+  key.iv = lcrypt.fromhex('00000004030201a0a1a2a3a4a5')
+  local second = key:encrypt(string.rep('x', 32))
+  assert(lcrypt.xor(first, second) ~= lcrypt.xor(pattern(32), string.rep('x', 32)), 'ccm keystream reused')
+end
+
+-- a new iv on EAX and OCB keys starts a fresh message under the same key, for the key itself and for a clone
+do
+  local eax_key, eax_nonce = lcrypt.fromhex('01f74ad64077f2e704c0f60ada3dd523'), lcrypt.fromhex('70c3db4f0d26368400a10ed05d2bff5e')
+  key = lcrypt.key('aes', 'eax', eax_key, sp800_counter, 'dropped with the old nonce')
+  key:encrypt('first message')
+  key.iv = eax_nonce
+  key:aad(lcrypt.fromhex('234a3463c1264ac6'))
+  expect('eax new iv', hex(key:encrypt(lcrypt.fromhex('1a47cb4933'))), 'd851d5bae0')
+  expect('eax new iv tag', hex(key:done()), '3a59f238a23e39199dc9266626c40f80')
+  local copy = lcrypt.key('aes', 'eax', eax_key, sp800_counter):clone(eax_nonce)
+  copy:aad(lcrypt.fromhex('234a3463c1264ac6'))
+  expect('eax clone iv', hex(copy:encrypt(lcrypt.fromhex('1a47cb4933'))), 'd851d5bae0')
+  expect('eax clone iv tag', hex(copy:done()), '3a59f238a23e39199dc9266626c40f80')
+
+  key = lcrypt.key('aes', 'ocb', sp800_key, sp800_counter)
+  out = key:encrypt(pattern(50))
+  local tag = key:done()
+  key.iv = sp800_iv
+  local other = key:encrypt(pattern(50))
+  assert(other ~= out, 'ocb new iv gave the old message')
+  key.iv = sp800_counter
+  expect('ocb iv again', key:encrypt(pattern(50)), out)
+  expect('ocb iv again tag', key:done(), tag)
+  key = lcrypt.key('aes', 'ocb', sp800_key, sp800_iv)
+  copy = key:clone(sp800_counter)
+  expect('ocb clone iv', copy:encrypt(pattern(50)), out)
+  expect('ocb clone iv tag', copy:done(), tag)
+  expect('ocb clone leaves the key', key:encrypt(pattern(50)), other)
+  raises('ocb short iv', function () key.iv = 'short' end)
+end
+
+-- a finished hash has no state left to peek at or clone
+do
+  local hash = lcrypt.hash('sha256', 'hash', 'abc')
+  hash:done()
+  raises('peek after done', hash.peek, hash)
+  raises('peek with data after done', hash.peek, hash, 'more')
+  raises('clone after done', hash.clone, hash)
+  hash = lcrypt.hash('sha256', 'hmac', 'what do ya want for nothing?', 'Jefe')
+  hash:done()
+  raises('hmac peek after done', hash.peek, hash)
+end
+
+-- a string of digits is data for a buffer, not its size
+do
+  local buffer = lcrypt.buffer('123')
+  expect('buffer from digits size', #buffer, 3)
+  expect('buffer from digits', buffer:read(), '123')
+  expect('buffer from a number', #lcrypt.buffer(123), 123)
+end
+
+-- into, batch, file and many pad and strip like encrypt and decrypt do
+do
+  local function cbc (padding)
+    return lcrypt.key('aes', 'cbc', sp800_key, sp800_iv, nil, nil, padding)
+  end
+  local records = { '', pattern(5), pattern(16), pattern(33) }
+  for _, padding in ipairs({ 'pkcs7', 'iso7816', 'zero' }) do
+    local sealed, lengths = {}, {}
+    for i = 1, #records do
+      sealed[i] = cbc(padding):encrypt(records[i])
+      lengths[i] = #sealed[i]
+    end
+
+    local buffer = lcrypt.buffer(64)
+    expect('encrypt_into ' .. padding, cbc(padding):encrypt_into(buffer, 3, pattern(33)), 48)
+    expect('encrypt_into ' .. padding .. ' content', buffer:read(3, 48), sealed[4])
+    expect('decrypt_into ' .. padding, cbc(padding):decrypt_into(buffer, 3, sealed[4]), 33)
+    expect('decrypt_into ' .. padding .. ' content', buffer:read(3, 33), pattern(33))
+    raises('encrypt_into ' .. padding .. ' no room', cbc(padding).encrypt_into, cbc(padding), lcrypt.buffer(33), 0, pattern(33))
+
+    local ivs = { sp800_iv, sp800_iv, sp800_iv, sp800_iv }
+    out = cbc(padding):encrypt_batch(records, ivs)
+    for i = 1, #records do expect('encrypt_batch ' .. padding .. ' ' .. i, out[i], sealed[i]) end
+    if padding ~= 'zero' then
+      out = cbc(padding):decrypt_batch(sealed, ivs)
+      for i = 1, #records do expect('decrypt_batch ' .. padding .. ' ' .. i, out[i], records[i]) end
+      buffer = lcrypt.buffer(128)
+      local offsets, next_offset = cbc(padding):decrypt_batch(sealed, ivs, buffer, 1)
+      expect('decrypt_batch ' .. padding .. ' next', next_offset, 1 + 0 + 5 + 16 + 33)
+      expect('decrypt_batch ' .. padding .. ' packed', buffer:read(offsets[2], 54), pattern(5) .. pattern(16) .. pattern(33))
+    end
+
+    local keys = {}
+    for i = 1, #records do keys[i] = cbc(padding) end
+    out = lcrypt.encrypt_many(keys, records, ivs)
+    for i = 1, #records do expect('encrypt_many ' .. padding .. ' ' .. i, out[i], sealed[i]) end
+    for i = 1, #records do keys[i] = cbc(padding) end
+    out = lcrypt.decrypt_many({ keys[2], keys[3], keys[4] }, { sealed[2], sealed[3], sealed[4] })
+    for i = 2, #records do expect('decrypt_many ' .. padding .. ' ' .. i, out[i - 1], records[i]) end
+
+    local plain, sealed_file, opened = os.tmpname(), os.tmpname(), os.tmpname()
+    for _, length in ipairs({ 0, 5, 64, 100 }) do
+      local data = pattern(length)
+      local file = assert(io.open(plain, 'wb'))
+      file:write(data)
+      file:close()
+      local wanted = cbc(padding):encrypt(data)
+      expect('encrypt_file ' .. padding .. ' ' .. length, cbc(padding):encrypt_file(plain, sealed_file, 64), #wanted)
+      file = assert(io.open(sealed_file, 'rb'))
+      expect('encrypt_file ' .. padding .. ' ' .. length .. ' content', file:read('*a'), wanted)
+      file:close()
+      if padding ~= 'zero' then
+        expect('decrypt_file ' .. padding .. ' ' .. length, cbc(padding):decrypt_file(sealed_file, opened, 64), length)
+        file = assert(io.open(opened, 'rb'))
+        expect('decrypt_file ' .. padding .. ' ' .. length .. ' content', file:read('*a'), data)
+        file:close()
+      end
+    end
+    os.remove(plain)
+    os.remove(sealed_file)
+    os.remove(opened)
+  end
+
+  key = cbc('pkcs7')
+  local bad = lcrypt.key('aes', 'cbc', sp800_key, sp800_iv):encrypt(string.rep('x', 16))
+  raises('decrypt_batch invalid padding', key.decrypt_batch, key, { bad })
+  raises('decrypt_many invalid padding', lcrypt.decrypt_many, { cbc('pkcs7') }, { bad })
+  raises('decrypt_into invalid padding', key.decrypt_into, key, lcrypt.buffer(16), 0, bad)
+end